@@ -1,6 +1,12 @@
 #include "ti.h"
+#include <atomic>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <mutex>
-#include <queue>
+#include <thread>
+#include <unordered_map>
 
 namespace ti {
 namespace client {
@@ -27,31 +33,155 @@ void append_req_buffer(char *start, const T &next, const Args &...args) {
     append_req_buffer(start + next.length() + 1, args...);
 }
 
+/**
+ * Request body of NUL-terminated strings, as taken by Client::send
+ */
+template <typename... Args> std::string req_body(const Args &...args) {
+    std::string body(req_len(args...), '\0');
+    append_req_buffer(&body[0], args...);
+    return body;
+}
+
+class Client;
+/**
+ * The blocks of a streamed response (see helper::append_block),
+ * read chunk by chunk as they arrive. A response that isn't streamed
+ * reads as a single chunk
+ */
+class ChunkReader {
+    Client &client;
+    uint32_t tag;
+    Response chunk;
+    size_t ptr;
+    bool done;
+    /**
+     * Wait for the next chunk that isn't empty
+     * @return false if the response has ended
+     */
+    bool next();
+
+  public:
+    ChunkReader(Client &client, uint32_t tag);
+    ChunkReader(ChunkReader &&other) noexcept;
+    ChunkReader(const ChunkReader &) = delete;
+    ~ChunkReader();
+    /**
+     * Wait for the response to start. A streamed response is OK
+     */
+    ResponseCode get_code();
+    /**
+     * @throws std::runtime_error if the response ends first
+     */
+    size_t read_len_header();
+    std::string read_block();
+    /**
+     * Like read_block, without copying. The view is good until
+     * the next read
+     */
+    StringView view_block();
+};
+
 class Client {
+    friend class ChunkReader;
+    /**
+     * A request waiting for its response, whose chunks, if streamed,
+     * are joined before it is handed over
+     */
+    struct Pending {
+        std::promise<Response> promise;
+        std::string joined;
+    };
     std::string addr;
     short port;
     SocketFd socketfd;
-    bool running;
-    std::mutex sockmtx, resmtx, detmtx;
-    std::queue<Response> res_queue;
+    std::atomic<bool> running;
+    std::thread reader;
+    std::mutex sockmtx, resmtx;
+    std::unordered_map<uint32_t, Pending> pending;
+    std::unordered_map<uint32_t, Response> tagged_res;
+    std::unordered_map<uint32_t, std::deque<Response>> chunks;
+    std::condition_variable tagged_cv;
+    /**
+     * The reader waits on this while a stream has a full backlog and
+     * nothing else is waited for, see read_loop
+     */
+    std::condition_variable chunk_room;
+    size_t starving;
+    /** Set by stop(), so that the reader never waits for room again */
+    bool closing;
+    std::atomic<uint32_t> next_tag;
+
+    /**
+     * Hand each frame to whoever waits for it, until the connection
+     * closes. Blocks in recv, and while a streamed response has
+     * CLIENT_CHUNK_BACKLOG chunks nobody took yet, unless a response
+     * or another stream is waited for, which may only come after.
+     * Never polls
+     */
+    void read_loop();
+    /**
+     * Let the reader go on reading, to the end of the connection
+     */
+    void close_streams();
+    /**
+     * Write frames to the socket in one go, so that frames from
+     * different threads never interleave
+     * @throws std::runtime_error if the connection broke
+     */
+    void write_frames(const compat::socket::Buffer *bufs, int count);
+    /**
+     * Wait for the next CHUNK of a tagged response, or its final frame
+     */
+    Response next_chunk(uint32_t tag);
 
   public:
     Client(std::string addr, short port);
+    /**
+     * Call stop() first, on_close() can't be called from here
+     */
     ~Client();
     void start();
     void stop();
+    /**
+     * Send a tagged request without waiting for its response. Any
+     * number of threads may have requests in flight at once
+     * @return the response, or a std::runtime_error if the
+     * connection closes first
+     */
+    std::future<Response> send_async(RequestCode req_c, const void *data,
+                                     size_t len);
+    /**
+     * @param body see req_body
+     */
+    std::future<Response> send_async(RequestCode req_c,
+                                     const std::string &body);
     Response send(RequestCode req_c, const void *data, size_t len);
+    /**
+     * Send a request that isn't answered, such as HELLO
+     * @param body see req_body
+     */
+    void post(RequestCode req_c, const std::string &body);
     Response send(RequestCode req_c, const std::string &content);
     template <typename... Args>
     Response send(RequestCode req_c, const std::string &first,
                   const Args &...args) {
-        size_t len = req_len(first, args...);
-        char *buf = (char *)calloc(len, sizeof(char));
-        append_req_buffer(buf, first, args...);
-        auto res = send(req_c, buf, len);
-        delete buf;
-        return res;
+        return send_async(req_c, req_body(first, args...)).get();
     }
+    /**
+     * Send all requests back to back as tagged frames, then wait
+     * for their responses, so the whole batch costs about one
+     * round trip instead of one each
+     * @param bodies one request body each, see req_body
+     * @return the responses, in the same order as the bodies
+     */
+    std::vector<Response> send_pipelined(RequestCode req_c,
+                                         const std::vector<std::string> &bodies);
+    /**
+     * Send a tagged request and read its response while it is still
+     * arriving, rather than after all of it has
+     * @param body see req_body
+     */
+    ChunkReader send_streamed(RequestCode req_c, const std::string &body);
     bool is_running() const;
     virtual void on_connect(sockaddr_in serveraddr) = 0;
     virtual void on_message(char *data, size_t len) = 0;
@@ -1,4 +1,5 @@
 #include "client.h"
+#include <helper.h>
 
 namespace ti {
 namespace client {
@@ -8,8 +9,54 @@ enum TiClientState { OFFLINE, LOGGED_OUT, READY };
 class TiClient : public Client, public orm::TiOrm {
     TiClientState state;
     std::string userid, token;
+    std::mutex pushmtx;
+    std::condition_variable pushed_cv;
+    std::deque<std::string> pushed;
+    /**
+     * Entities read from the server and not stored yet. Groups stay
+     * serialized until their members are here, see resolve_groups
+     */
+    struct Fetched {
+        std::unordered_map<std::string, Entity *> entities;
+        std::unordered_map<std::string, std::string> groups;
+    };
 
     void panic_if_not(ti::client::TiClientState target);
+    /**
+     * Read a count of serialized entities and the entities, leaving
+     * out those stored already
+     * @param member called with the id of each member of a group
+     * @return the count
+     */
+    size_t
+    read_entities(ChunkReader &stream, Fetched &fetched,
+                  const std::function<void(const std::string &)> &member);
+    /**
+     * Build the fetched groups out of the members stored or fetched
+     * by now. A member that is neither is left out
+     */
+    void resolve_groups(Fetched &fetched);
+    /**
+     * Download the entities not cached yet, with the members of the
+     * groups among them, asking for many ids in each request
+     */
+    void download_entities(const std::vector<std::string> &ids);
+    /**
+     * Fetch the message changes after the cursor stored with the
+     * session, apply them, and store the cursor the server answered with
+     */
+    bool sync_messages();
+    /**
+     * Find the ids of field ("messages" or "contacts") that differ from
+     * the server, walking down the sync trees only where they disagree,
+     * one pipelined round trip per level
+     */
+    ti::helper::Diff<std::string> reconcile(const std::string &field);
+    /**
+     * Download the messages not cached yet, along with their frames
+     * and the entities they refer to
+     */
+    void download_messages(const std::vector<std::string> &ids);
 
   public:
     TiClient(std::string addr, short port, const std::string &dbfile);
@@ -40,7 +87,24 @@ class TiClient : public Client, public orm::TiOrm {
      */
     Message *get_message_or_download(const std::string &id);
     std::vector<Entity *> get_contacts() const;
-    void send(Message *message);
+    /**
+     * Store a message, with its frames, on the server and here. The
+     * server pushes it to the receivers that are online
+     * @param message kept by this client if sent
+     * @return false if the server turned it down
+     */
+    bool send(Message *message);
+    /**
+     * Wait until the server pushes a message, see receive()
+     * @return false if none came in time
+     */
+    bool wait_for_message(int timeout_ms);
+    /**
+     * Store the messages pushed since the last call. One that refers
+     * to an entity not cached yet is left for the next sync
+     * @return the messages stored, which this client keeps
+     */
+    std::vector<Message *> receive();
     void on_connect(sockaddr_in serveraddr) override;
     void on_message(char *data, size_t len) override;
     void on_close() override;
@@ -3,16 +3,44 @@
 #include <log.h>
 #include <thread>
 
+// chunks of one streamed response queued before the reader stops reading
+#define CLIENT_CHUNK_BACKLOG 64
+
 using namespace ti::client;
 
+static bool recv_all(SocketFd fd, char *buf, size_t len) {
+    while (len > 0) {
+        auto n = recv(fd, buf, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
 Client::Client(std::string addr, short port)
-    : addr(std::move(addr)), port(port), running(false) {}
-Client::~Client() { ::closesocketfd(socketfd); }
+    : addr(std::move(addr)), port(port), running(false), starving(0),
+      closing(false), next_tag(0) {}
+Client::~Client() {
+    if (reader.joinable()) {
+        close_streams();
+        shutdown(socketfd, 2);
+        reader.join();
+        ::closesocketfd(socketfd);
+    }
+}
 bool Client::is_running() const { return running; }
 void Client::start() {
     if (running) {
         throw std::runtime_error("client already running");
     }
+    if (reader.joinable()) {
+        // left over from a connection the server closed
+        reader.join();
+        ::closesocketfd(socketfd);
+    }
 
 #if _WIN32
     WSADATA wsaData;
@@ -36,97 +64,331 @@ void Client::start() {
         0) {
         throw std::runtime_error("failed to connect");
     }
+    closing = false;
     running = true;
     on_connect(serveraddr);
-
-    std::thread([&] {
-        detmtx.lock();
-
-        while (running) {
-            sockmtx.lock();
-            char *tres = (char *)calloc(1, sizeof(char));
-            size_t n = recv(socketfd, tres, 1, 0);
-            if (n <= 0) {
-                break;
-            }
-
-            char *tsize = (char *)calloc(BYTES_LEN_HEADER, sizeof(char));
-            n = recv(socketfd, tsize, BYTES_LEN_HEADER * sizeof(char), 0);
-            if (n <= 0) {
+    reader = std::thread(&Client::read_loop, this);
+}
+void Client::read_loop() {
+    while (true) {
+        char header[TAGGED_FRAME_HEADER_LEN];
+        if (!recv_all(socketfd, header, FRAME_HEADER_LEN)) {
+            break;
+        }
+        bool tagged = header[0] & FRAME_TAGGED;
+        if (tagged &&
+            !recv_all(socketfd, header + FRAME_HEADER_LEN, BYTES_TAG_HEADER)) {
+            break;
+        }
+        size_t msize = ti::helper::read_len_header(header + 1);
+        if (msize > MAX_FRAME_LEN) {
+            // the server never sends one, the stream is corrupt
+            logD("[client] frame of %zu bytes is too large", msize);
+            break;
+        }
+        char *buff = nullptr;
+        if (msize > 0) {
+            buff = (char *)calloc(msize, sizeof(char));
+            if (!recv_all(socketfd, buff, msize)) {
+                free(buff);
                 break;
             }
-            size_t msize = ti::helper::read_len_header(tsize);
-            char *buff;
-            if (msize > 0) {
-                buff = (char *)calloc(msize, sizeof(char));
-                n = recv(socketfd, buff, msize, 0);
-                if (n <= 0) {
-                    break;
+        }
+        auto res_c = (ResponseCode)((unsigned char)header[0] & ~FRAME_TAGGED);
+        if (res_c == ResponseCode::MESSAGE) {
+            on_message(buff, msize);
+            free(buff);
+            continue;
+        }
+        if (!tagged) {
+            // every request is tagged, nothing waits for this
+            logD("[client] dropping untagged response %d", res_c);
+            free(buff);
+            continue;
+        }
+        uint32_t tag = ti::helper::read_tag_header(header + FRAME_HEADER_LEN);
+        std::unique_lock<std::mutex> lock(resmtx);
+        auto waiting = pending.find(tag);
+        if (waiting != pending.end()) {
+            auto &joined = waiting->second.joined;
+            if (res_c == ResponseCode::CHUNK || !joined.empty()) {
+                joined.append(buff, msize);
+                free(buff);
+                if (res_c == ResponseCode::CHUNK) {
+                    continue;
                 }
-            } else {
-                buff = nullptr;
-                n = 0;
-            }
-            auto res_c = (ResponseCode)*tres;
-            if (res_c == ResponseCode::MESSAGE) {
-                on_message(buff, n);
-                delete buff;
-            } else {
-                resmtx.lock();
-                res_queue.push(Response{buff, n, res_c});
-                resmtx.unlock();
+                msize = joined.size();
+                buff = (char *)calloc(msize, sizeof(char));
+                std::memcpy(buff, joined.data(), msize);
             }
-            delete tres;
-
-            sockmtx.unlock();
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            auto promise = std::move(waiting->second.promise);
+            pending.erase(waiting);
+            lock.unlock();
+            promise.set_value(Response{buff, msize, res_c});
+            continue;
         }
-        on_close();
+        // a streamed response, see next_chunk
+        if (res_c == ResponseCode::CHUNK) {
+            chunks[tag].push_back(Response{buff, msize, res_c});
+            tagged_cv.notify_all();
+            // the server waits in turn once the socket fills up. Unless
+            // what someone else waits for may be behind this
+            chunk_room.wait(lock, [&] {
+                auto it = chunks.find(tag);
+                return it == chunks.end() ||
+                       it->second.size() < CLIENT_CHUNK_BACKLOG ||
+                       starving > 0 || !pending.empty() || closing;
+            });
+            continue;
+        }
+        tagged_res[tag] = Response{buff, msize, res_c};
+        lock.unlock();
+        tagged_cv.notify_all();
+    }
+    on_close();
+    std::unordered_map<uint32_t, Pending> orphans;
+    {
+        std::lock_guard<std::mutex> lock(resmtx);
         running = false;
-        detmtx.unlock();
-    }).detach();
+        orphans.swap(pending);
+    }
+    for (auto &p : orphans) {
+        p.second.promise.set_exception(std::make_exception_ptr(
+            std::runtime_error("connection closed unexpectedly")));
+    }
+    tagged_cv.notify_all();
 }
 void Client::stop() {
     if (!running) {
         throw std::runtime_error("client is not running");
     }
-    running = false;
+    // wakes the reader, which fails whatever is still waiting
+    close_streams();
+    shutdown(socketfd, 2);
+    reader.join();
     ::closesocketfd(socketfd);
-    detmtx.lock();
-    detmtx.unlock();
+}
+void Client::close_streams() {
+    {
+        std::lock_guard<std::mutex> lock(resmtx);
+        closing = true;
+    }
+    chunk_room.notify_all();
+}
+void Client::write_frames(const compat::socket::Buffer *bufs, int count) {
+    std::lock_guard<std::mutex> lock(sockmtx);
+    if (!compat::socket::sendv(socketfd, bufs, count)) {
+        throw std::runtime_error("connection closed unexpectedly");
+    }
+}
+std::future<Response> Client::send_async(RequestCode req_c, const void *data,
+                                         size_t len) {
+    char header[TAGGED_FRAME_HEADER_LEN];
+    uint32_t tag = next_tag++;
+    header[0] = req_c | FRAME_TAGGED;
+    ti::helper::write_len_header(len, header + 1);
+    ti::helper::write_tag_header(tag, header + FRAME_HEADER_LEN);
+    std::future<Response> future;
+    {
+        // registered first, the response may beat the write back
+        std::lock_guard<std::mutex> lock(resmtx);
+        if (!running) {
+            throw std::runtime_error("client not running");
+        }
+        future = pending[tag].promise.get_future();
+    }
+    chunk_room.notify_all();
+    compat::socket::Buffer bufs[] = {{header, TAGGED_FRAME_HEADER_LEN},
+                                     {data, len}};
+    try {
+        write_frames(bufs, len > 0 ? 2 : 1);
+    } catch (const std::runtime_error &e) {
+        std::lock_guard<std::mutex> lock(resmtx);
+        pending.erase(tag);
+        throw;
+    }
+    return future;
+}
+std::future<Response> Client::send_async(RequestCode req_c,
+                                         const std::string &body) {
+    return send_async(req_c, body.data(), body.length());
 }
 Response Client::send(const RequestCode req_c, const void *data, size_t len) {
+    return send_async(req_c, data, len).get();
+}
+
+void Client::post(RequestCode req_c, const std::string &body) {
     if (!running) {
         throw std::runtime_error("client not running");
     }
-    auto *treq = (char *)calloc(1, sizeof(char));
-    treq[0] = req_c;
-    char *tsize = ti::helper::write_len_header(len);
-    compat::socket::send(socketfd, treq, sizeof(char), 0);
-    compat::socket::send(socketfd, tsize, BYTES_LEN_HEADER * sizeof(char), 0);
-    compat::socket::send(socketfd, data, len, 0);
-    delete tsize;
-    delete treq;
-
-    while (res_queue.empty()) {
-        // sockmtx should be unlocked after receiving
-        sockmtx.lock();
-        sockmtx.unlock();
+    char header[FRAME_HEADER_LEN];
+    header[0] = req_c;
+    ti::helper::write_len_header(body.length(), header + 1);
+    compat::socket::Buffer bufs[] = {{header, FRAME_HEADER_LEN},
+                                     {body.data(), body.length()}};
+    write_frames(bufs, body.empty() ? 1 : 2);
+}
+
+Response Client::send(ti::RequestCode req_c, const std::string &content) {
+    return send_async(req_c, content).get();
+}
+
+std::vector<Response>
+Client::send_pipelined(RequestCode req_c,
+                       const std::vector<std::string> &bodies) {
+    std::vector<uint32_t> tags;
+    std::vector<std::future<Response>> futures;
+    std::string frames;
+    {
+        std::lock_guard<std::mutex> lock(resmtx);
         if (!running) {
-            throw std::runtime_error("connection closed unexpectedly");
+            throw std::runtime_error("client not running");
+        }
+        for (const auto &body : bodies) {
+            char header[TAGGED_FRAME_HEADER_LEN];
+            uint32_t tag = next_tag++;
+            header[0] = req_c | FRAME_TAGGED;
+            ti::helper::write_len_header(body.length(), header + 1);
+            ti::helper::write_tag_header(tag, header + FRAME_HEADER_LEN);
+            frames.append(header, TAGGED_FRAME_HEADER_LEN);
+            frames.append(body);
+            tags.push_back(tag);
+            futures.push_back(pending[tag].promise.get_future());
+        }
+    }
+    chunk_room.notify_all();
+    if (!frames.empty()) {
+        compat::socket::Buffer buf{frames.data(), frames.length()};
+        try {
+            write_frames(&buf, 1);
+        } catch (const std::runtime_error &e) {
+            std::lock_guard<std::mutex> lock(resmtx);
+            for (auto tag : tags) {
+                pending.erase(tag);
+            }
+            throw;
+        }
+    }
+
+    // the server may answer in any order, each lands in its own future
+    std::vector<Response> responses;
+    try {
+        for (auto &f : futures) {
+            responses.push_back(f.get());
+        }
+    } catch (const std::runtime_error &e) {
+        for (auto &res : responses) {
+            delete res.buff;
         }
+        throw;
     }
-    resmtx.lock();
-    auto front = res_queue.front();
-    res_queue.pop();
-    resmtx.unlock();
-    return front;
+    return responses;
 }
 
-Response Client::send(ti::RequestCode req_c, const std::string &content) {
-    char *buf = (char *)calloc(req_len(content), sizeof(char));
-    append_req_buffer(buf, content);
-    auto res = send(req_c, buf, content.length());
-    delete buf;
-    return res;
+ChunkReader Client::send_streamed(RequestCode req_c, const std::string &body) {
+    if (!running) {
+        throw std::runtime_error("client not running");
+    }
+    char header[TAGGED_FRAME_HEADER_LEN];
+    uint32_t tag = next_tag++;
+    header[0] = req_c | FRAME_TAGGED;
+    ti::helper::write_len_header(body.length(), header + 1);
+    ti::helper::write_tag_header(tag, header + FRAME_HEADER_LEN);
+    compat::socket::Buffer bufs[] = {{header, TAGGED_FRAME_HEADER_LEN},
+                                     {body.data(), body.length()}};
+    write_frames(bufs, body.empty() ? 1 : 2);
+    return {*this, tag};
+}
+
+Response Client::next_chunk(uint32_t tag) {
+    std::unique_lock<std::mutex> lock(resmtx);
+    auto ready = [&] {
+        auto it = chunks.find(tag);
+        return (it != chunks.end() && !it->second.empty()) ||
+               tagged_res.count(tag) || !running;
+    };
+    if (!ready()) {
+        // the reader may be waiting for room in another stream
+        starving++;
+        chunk_room.notify_all();
+        tagged_cv.wait(lock, ready);
+        starving--;
+    }
+    // chunks arrive before the frame that ends them
+    auto it = chunks.find(tag);
+    if (it != chunks.end() && !it->second.empty()) {
+        auto chunk = it->second.front();
+        it->second.pop_front();
+        chunk_room.notify_all();
+        return chunk;
+    }
+    chunks.erase(tag);
+    auto res = tagged_res.find(tag);
+    if (res == tagged_res.end()) {
+        throw std::runtime_error("connection closed unexpectedly");
+    }
+    auto end = res->second;
+    tagged_res.erase(res);
+    return end;
+}
+
+ChunkReader::ChunkReader(Client &client, uint32_t tag)
+    : client(client), tag(tag), chunk{nullptr, 0, ResponseCode::CHUNK},
+      ptr(0), done(false) {}
+
+ChunkReader::ChunkReader(ChunkReader &&other) noexcept
+    : client(other.client), tag(other.tag), chunk(other.chunk),
+      ptr(other.ptr), done(other.done) {
+    other.chunk.buff = nullptr;
+    other.done = true;
+}
+
+ChunkReader::~ChunkReader() {
+    // whatever is left would otherwise stay with the client
+    try {
+        while (next()) {
+        }
+    } catch (const std::exception &e) {
+        logD("[client] dropping streamed response: %s", e.what());
+    }
+    delete chunk.buff;
+}
+
+bool ChunkReader::next() {
+    while (!done) {
+        delete chunk.buff;
+        chunk = client.next_chunk(tag);
+        ptr = 0;
+        done = chunk.code != ResponseCode::CHUNK;
+        if (chunk.len > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+ti::ResponseCode ChunkReader::get_code() {
+    if (chunk.buff == nullptr && !done) {
+        next();
+    }
+    return done ? chunk.code : ResponseCode::OK;
+}
+
+size_t ChunkReader::read_len_header() {
+    // blocks never span chunks
+    if (ptr == chunk.len && !next()) {
+        throw std::runtime_error("truncated block");
+    }
+    return ti::helper::read_len_header(chunk.buff, chunk.len, ptr);
+}
+
+std::string ChunkReader::read_block() { return view_block().str(); }
+
+ti::StringView ChunkReader::view_block() {
+    auto n = read_len_header();
+    if (n > chunk.len - ptr) {
+        throw std::runtime_error("truncated block");
+    }
+    ptr += n;
+    return {chunk.buff + ptr - n, n};
 }
@@ -3,6 +3,10 @@
 #include <thread>
 #include <ti_client.h>
 
+#define SYNC_LEAF_SIZE 32
+#define ENTITY_BATCH_SIZE (size_t)512
+#define PUSH_QUEUE_MAX 1024
+
 using namespace ti::client;
 using namespace ti;
 
@@ -15,14 +19,28 @@ TiClient::TiClient(std::string addr, short port, const std::string &dbfile)
     user_id    varchar(21) primary key,
     token      varchar(21) not null,
     last_login datetime,
+    cursor     integer     not null default 0,
     foreign key (user_id)
         references user (id)
 );)");
 }
 TiClient::~TiClient() = default;
-void TiClient::on_message(char *data, size_t len) {}
+void TiClient::on_message(char *data, size_t len) {
+    {
+        std::lock_guard<std::mutex> lock(pushmtx);
+        if (pushed.size() >= PUSH_QUEUE_MAX) {
+            // nobody is receiving, the next sync brings it anyway
+            logD("[client] dropping pushed message");
+            return;
+        }
+        pushed.emplace_back(data, len);
+    }
+    pushed_cv.notify_all();
+}
 void TiClient::on_connect(sockaddr_in serveraddr) {
     logD("[client] connected to %s", inet_ntoa(serveraddr.sin_addr));
+    // servers that don't know HELLO ignore it and keep to text
+    post(RequestCode::HELLO, req_body(std::to_string(WIRE_BINARY_V1)));
     state = LOGGED_OUT;
 }
 void TiClient::on_close() {
@@ -74,51 +92,232 @@ bool TiClient::sync() {
     std::string query = userid;
     auto res = Client::send(RequestCode::SYNC, token, query);
     auto user = User::deserialize(res.buff, res.len);
-    add_entity(user);
     delete res.buff;
+    // replacing the user would leave its messages pointing at the old one
+    if (auto known = get_user(user->get_id())) {
+        delete user;
+        user = known;
+    } else {
+        add_entity(user);
+    }
 
     query = "contacts/hash";
     res = Client::send(RequestCode::SYNC, token, query);
     auto local_sync = get_sync(user);
-    if (std::memcmp(res.buff, local_sync.get_contacts_hash()->hash, res.len) !=
-        0) {
-        delete res.buff;
-        query = "contacts/id";
-        res = Client::send(RequestCode::SYNC, token, query);
-        auto remote_id = ti::helper::read_message_body(res.buff, res.len);
-        auto contacts = get_contacts();
-        auto local_id = ti::helper::get_ids(contacts.begin(), contacts.end());
-        ti::helper::Diff<std::string> diff(remote_id.begin(), remote_id.end(),
-                                           local_id.begin(), local_id.end());
-        for (const auto &eid : diff.plus) {
-            add_contact(user, get_entity_or_download(eid));
-        }
-        for (const auto &eid : diff.minus) {
-            delete_contact(user, get_entity(eid));
-        }
+    auto local_hash = local_sync.get_contacts_hash();
+    if (res.len != local_hash->len ||
+        (res.len > 0 &&
+         std::memcmp(res.buff, local_hash->hash, res.len) != 0)) {
+        auto diff = reconcile("contacts");
+        download_entities(diff.plus);
+        transaction([&] {
+            for (const auto &eid : diff.plus) {
+                if (auto e = get_entity(eid)) {
+                    add_contact(user, e);
+                }
+            }
+            for (const auto &eid : diff.minus) {
+                delete_contact(user, get_entity(eid));
+            }
+        });
     }
     delete res.buff;
 
-    query = "messages/hash";
-    res = Client::send(RequestCode::SYNC, token, query);
-    if (std::memcmp(res.buff, local_sync.get_messages_hash()->hash, res.len) !=
-        0) {
-        delete res.buff;
-        query = "messages/id";
-        res = Client::send(RequestCode::SYNC, token, query);
-        auto remote_id = ti::helper::read_message_body(res.buff, res.len);
-        auto messages = get_messages();
-        auto local_id = ti::helper::get_ids(messages.begin(), messages.end());
-        ti::helper::Diff<std::string> diff(remote_id.begin(), remote_id.end(),
-                                           local_id.begin(), local_id.end());
-        for (const auto &eid : diff.plus) {
-            add_message()
+    return sync_messages();
+}
+
+bool TiClient::sync_messages() {
+    auto t = prepare(R"(SELECT cursor FROM "session" WHERE user_id = ?)");
+    t->bind_text(0, userid);
+    long cursor = 0;
+    for (auto row : *t) {
+        cursor = row.get_int64(0);
+    }
+    delete t;
+
+    // frames and messages are decoded as their chunks come in
+    auto stream = Client::send_streamed(
+        RequestCode::SYNC,
+        req_body(token, "messages/since/" + std::to_string(cursor)));
+    if (stream.get_code() != ResponseCode::OK) {
+        logD("[client] sync messages failed with code %d", stream.get_code());
+        return false;
+    }
+    cursor = (long)stream.read_len_header();
+    std::vector<std::string> removed;
+    for (auto n = stream.read_len_header(); n > 0; n--) {
+        removed.push_back(stream.read_block());
+    }
+
+    // each page carries the entities its messages refer to, so that
+    // nothing is downloaded while the rest of the stream waits. Blocks
+    // are read in place, and messages this side already has are never
+    // built. Frames wait by id until a message of their page claims them
+    Fetched fetched;
+    auto entity = [&](StringView id) -> Entity * {
+        auto key = id.str();
+        if (auto e = get_entity(key)) {
+            return e;
+        }
+        auto f = fetched.entities.find(key);
+        return f == fetched.entities.end() ? nullptr : f->second;
+    };
+    std::vector<Message *> added;
+    while (true) {
+        auto nentities =
+            read_entities(stream, fetched, [](const std::string &) {});
+        resolve_groups(fetched);
+        std::unordered_map<std::string, Frame *> frames;
+        auto nframes = stream.read_len_header();
+        for (auto n = nframes; n > 0; n--) {
+            auto bs = stream.view_block();
+            auto f = TextFrameView(bs.data, bs.len).materialize();
+            if (!frames.emplace(f->get_id(), f).second) {
+                delete f;
+            }
+        }
+        std::unordered_set<Frame *> claimed;
+        auto nmessages = stream.read_len_header();
+        for (auto n = nmessages; n > 0; n--) {
+            auto bs = stream.view_block();
+            MessageView view(bs.data, bs.len);
+            if (get_message(view.id.str()) != nullptr) {
+                continue;
+            }
+            added.push_back(view.materialize(
+                [&](StringView id) -> Frame * {
+                    auto f = frames.find(id.str());
+                    if (f == frames.end()) {
+                        return nullptr;
+                    }
+                    claimed.insert(f->second);
+                    return f->second;
+                },
+                entity));
+        }
+        for (const auto &f : frames) {
+            if (claimed.count(f.second) == 0) {
+                delete f.second;
+            }
+        }
+        // the last page is empty
+        if (nentities == 0 && nframes == 0 && nmessages == 0) {
+            break;
         }
     }
+
+    // the cursor only moves together with what it stands for
+    transaction([&] {
+        for (const auto &e : fetched.entities) {
+            add_entity(e.second);
+        }
+        for (const auto &id : removed) {
+            if (auto m = get_message(id)) {
+                delete_message(m);
+            }
+        }
+        for (auto m : added) {
+            // a snapshot may repeat what the log already delivered
+            if (get_message(m->get_id()) == nullptr) {
+                add_message(m);
+            } else {
+                delete m;
+            }
+        }
+        auto u =
+            prepare(R"(UPDATE "session" SET cursor = ? WHERE user_id = ?)");
+        u->bind_int64(0, cursor);
+        u->bind_text(1, userid);
+        u->begin();
+        delete u;
+    });
+
+    // the log can't repair what went missing on this side, but the
+    // trees can tell whether anything did
+    auto res =
+        Client::send(RequestCode::SYNC, token, std::string("messages/hash"));
+    auto local_sync = get_sync(get_current_user());
+    auto local_hash = local_sync.get_messages_hash();
+    bool diverged = res.len != local_hash->len ||
+                    std::memcmp(res.buff, local_hash->hash, res.len) != 0;
     delete res.buff;
+    if (diverged) {
+        auto diff = reconcile("messages");
+        for (const auto &id : diff.minus) {
+            if (auto m = get_message(id)) {
+                delete_message(m);
+            }
+        }
+        download_messages(diff.plus);
+    }
     return true;
 }
 
+ti::helper::Diff<std::string> TiClient::reconcile(const std::string &field) {
+    static const char digits[] = "0123456789abcdef";
+    auto user = get_current_user();
+    std::vector<std::string> frontier{""}, leaves;
+    while (!frontier.empty()) {
+        std::vector<std::string> bodies, next;
+        for (const auto &prefix : frontier) {
+            bodies.push_back(req_body(token, field + "/tree/" + prefix));
+        }
+        auto responses = Client::send_pipelined(RequestCode::SYNC, bodies);
+        for (size_t i = 0; i < frontier.size(); ++i) {
+            auto &res = responses[i];
+            auto local = get_sync_children(user, field, frontier[i]);
+            size_t ptr = 0;
+            for (int c = 0; c < SYNC_TREE_FANOUT && res.code == OK; ++c) {
+                auto count =
+                    ti::helper::read_len_header(res.buff, res.len, ptr);
+                if (res.len - ptr < SYNC_DIGEST_LEN) {
+                    throw std::runtime_error("truncated sync tree");
+                }
+                std::string hash(res.buff + ptr, SYNC_DIGEST_LEN);
+                ptr += SYNC_DIGEST_LEN;
+                if (count == local[c].count && hash == local[c].hash) {
+                    continue;
+                }
+                auto child = frontier[i] + digits[c];
+                // small enough to list, or as deep as the tree goes
+                if (count + local[c].count <= SYNC_LEAF_SIZE ||
+                    child.length() + 1 >= SYNC_DIGEST_LEN * 2) {
+                    leaves.push_back(child);
+                } else {
+                    next.push_back(child);
+                }
+            }
+        }
+        for (auto &res : responses) {
+            if (res.code != OK) {
+                panic_unknown_res("reconcile", res.code);
+            }
+            delete res.buff;
+        }
+        frontier.swap(next);
+    }
+
+    std::vector<std::string> bodies, remote_id, local_id;
+    for (const auto &prefix : leaves) {
+        bodies.push_back(req_body(token, field + "/range/" + prefix));
+        auto ids = get_sync_range(user, field, prefix);
+        local_id.insert(local_id.end(), ids.begin(), ids.end());
+    }
+    for (auto &res : Client::send_pipelined(RequestCode::SYNC, bodies)) {
+        if (res.code != OK) {
+            panic_unknown_res("reconcile", res.code);
+        }
+        size_t ptr = 0;
+        for (auto n = ti::helper::read_len_header(res.buff, res.len, ptr);
+             n > 0; n--) {
+            remote_id.push_back(ti::helper::read_block(res.buff, res.len, ptr));
+        }
+        delete res.buff;
+    }
+    return {remote_id.begin(), remote_id.end(), local_id.begin(),
+            local_id.end()};
+}
+
 bool TiClient::user_login(const std::string &user_id,
                           const std::string &password) {
     panic_if_not(LOGGED_OUT);
@@ -128,18 +327,30 @@ bool TiClient::user_login(const std::string &user_id,
         return false;
     case ResponseCode::OK:
         break;
+    case ResponseCode::BUSY:
+        throw std::runtime_error("server is busy, try again later");
     default:
         logD("[client] login failed with code %d", res.code);
         panic_unknown_res("login", res.code);
     }
 
     state = READY;
+    userid = user_id;
     token = std::string(res.buff, res.len);
     delete res.buff;
-    auto t = prepare(R"(INSERT INTO "session" VALUES (?, ?, datetime('now')))");
+    // keep the sync cursor of an earlier session of the same user
+    auto t = prepare(
+        R"(INSERT OR IGNORE INTO "session"(user_id, token) VALUES (?, ?))");
     t->bind_text(0, user_id);
     t->bind_text(1, token);
     t->begin();
+    delete t;
+    t = prepare(
+        R"(UPDATE "session" SET token = ?, last_login = datetime('now') WHERE user_id = ?)");
+    t->bind_text(0, token);
+    t->bind_text(1, user_id);
+    t->begin();
+    delete t;
 
     return true;
 }
@@ -153,6 +364,8 @@ std::string TiClient::user_reg(const std::string &name,
         return std::string{};
     case ResponseCode::OK:
         return {res.buff, (std::string::size_type)res.len};
+    case ResponseCode::BUSY:
+        throw std::runtime_error("server is busy, try again later");
     default:
         panic_unknown_res("registry", res.code);
     }
@@ -192,43 +405,230 @@ Entity *TiClient::get_entity_or_download(const std::string &id) {
     if (e != nullptr) {
         return e;
     }
-    auto res = Client::send(RequestCode::SYNC, token, id);
-    switch (res.code) {
-    case ResponseCode::NOT_FOUND:
-        return nullptr;
-    case ResponseCode::OK:
-        break;
-    default:
-        panic_unknown_res("get_entity_or_download", res.code);
+    download_entities({id});
+    return TiOrm::get_entity(id);
+}
+size_t TiClient::read_entities(
+    ChunkReader &stream, Fetched &fetched,
+    const std::function<void(const std::string &)> &member) {
+    auto n = stream.read_len_header();
+    for (auto i = n; i > 0; i--) {
+        auto bs = stream.view_block();
+        if (bs.len == 0) {
+            continue;
+        }
+        auto e = Entity::deserialize(
+            (char *)bs.data, bs.len, [&](const std::string &mid) {
+                member(mid);
+                return nullptr;
+            });
+        if (e == &Server::INSTANCE) {
+            continue;
+        }
+        if (TiOrm::get_entity(e->get_id()) != nullptr ||
+            fetched.entities.count(e->get_id()) != 0) {
+            delete e;
+        } else if (dynamic_cast<Group *>(e) != nullptr) {
+            fetched.groups[e->get_id()] = bs.str();
+            delete e;
+        } else {
+            fetched.entities[e->get_id()] = e;
+        }
+    }
+    return n;
+}
+void TiClient::resolve_groups(Fetched &fetched) {
+    std::function<Entity *(const std::string &)> resolve =
+        [&](const std::string &id) -> Entity * {
+        if (auto e = TiOrm::get_entity(id)) {
+            return e;
+        }
+        auto f = fetched.entities.find(id);
+        if (f != fetched.entities.end()) {
+            return f->second;
+        }
+        auto g = fetched.groups.find(id);
+        if (g == fetched.groups.end()) {
+            return nullptr;
+        }
+        // taken out first, so a group containing itself ends here
+        auto bs = std::move(g->second);
+        fetched.groups.erase(g);
+        auto group = Group::deserialize(&bs[0], bs.length(), resolve);
+        auto &members = group->get_members();
+        members.erase(std::remove(members.begin(), members.end(), nullptr),
+                      members.end());
+        fetched.entities[id] = group;
+        return group;
+    };
+    while (!fetched.groups.empty()) {
+        auto id = fetched.groups.begin()->first;
+        resolve(id);
+    }
+}
+void TiClient::download_entities(const std::vector<std::string> &ids) {
+    std::unordered_set<std::string> seen;
+    std::vector<std::string> wanted;
+    auto want = [&](const std::string &id) {
+        if (!id.empty() && TiOrm::get_entity(id) == nullptr &&
+            seen.insert(id).second) {
+            wanted.push_back(id);
+        }
+    };
+    for (const auto &id : ids) {
+        want(id);
     }
 
-    e = Entity::deserialize(
-        res.buff, res.len, [&](auto id) { return get_entity_or_download(id); });
-    add_entity(e);
-    return e;
+    // one round per level of group nesting
+    Fetched fetched;
+    while (!wanted.empty()) {
+        std::vector<ChunkReader> streams;
+        for (size_t i = 0; i < wanted.size(); i += ENTITY_BATCH_SIZE) {
+            std::string selector = "entities/";
+            auto end = std::min(i + ENTITY_BATCH_SIZE, wanted.size());
+            for (size_t j = i; j < end; ++j) {
+                selector += (j > i ? "," : "") + wanted[j];
+            }
+            streams.push_back(Client::send_streamed(
+                RequestCode::SYNC, req_body(token, selector)));
+        }
+        wanted.clear();
+        for (auto &stream : streams) {
+            if (stream.get_code() != ResponseCode::OK) {
+                panic_unknown_res("download_entities", stream.get_code());
+            }
+            read_entities(stream, fetched, want);
+        }
+    }
+    resolve_groups(fetched);
+    transaction([&] {
+        for (const auto &e : fetched.entities) {
+            add_entity(e.second);
+        }
+    });
 }
 Message *TiClient::get_message_or_download(const std::string &id) {
     auto m = get_message(id);
     if (m != nullptr) {
         return m;
     }
-    auto res = Client::send(RequestCode::SYNC, token, id);
+    download_messages({id});
+    return get_message(id);
+}
+void TiClient::download_messages(const std::vector<std::string> &ids) {
+    static const char *parts[] = {"", "/frames", "/sender", "/receiver",
+                                  "/forward_source"};
+    const size_t nparts = sizeof parts / sizeof *parts;
+    std::vector<std::string> bodies;
+    for (const auto &id : ids) {
+        for (auto part : parts) {
+            bodies.push_back(req_body(token, id + part));
+        }
+    }
+    if (bodies.empty()) {
+        return;
+    }
+    auto responses = Client::send_pipelined(RequestCode::SYNC, bodies);
+    std::vector<std::string> referenced;
+    for (size_t i = 0; i < responses.size(); ++i) {
+        auto &res = responses[i];
+        if (res.code != ResponseCode::OK &&
+            res.code != ResponseCode::NOT_FOUND) {
+            for (auto &r : responses) {
+                delete r.buff;
+            }
+            panic_unknown_res("download_messages", res.code);
+        }
+        if (i % nparts >= 2 && res.code == ResponseCode::OK && res.len > 0) {
+            referenced.emplace_back(res.buff, res.len);
+        }
+    }
+    download_entities(referenced);
+    auto entities = get_entities();
+
+    for (size_t i = 0; i < responses.size(); i += nparts) {
+        auto &msg = responses[i], &frm = responses[i + 1];
+        if (msg.code == ResponseCode::OK && frm.code == ResponseCode::OK &&
+            get_message(ids[i / nparts]) == nullptr) {
+            std::vector<Frame *> frames;
+            size_t ptr = 0;
+            for (auto n = ti::helper::read_len_header(frm.buff, frm.len, ptr);
+                 n > 0; n--) {
+                auto bs = ti::helper::read_block(frm.buff, frm.len, ptr);
+                frames.push_back(TextFrame::deserialize(&bs[0], bs.length()));
+            }
+            add_message(
+                Message::deserialize(msg.buff, msg.len, frames, entities));
+        }
+    }
+    for (auto &res : responses) {
+        delete res.buff;
+    }
+}
+std::vector<Entity *> TiClient::get_contacts() const {
+    return TiOrm::get_contacts(get_current_user());
+}
+bool TiClient::send(ti::Message *message) {
+    panic_if_not(READY);
+    std::string body = token;
+    body.push_back('\0');
+    message->serialize_with_frames(body, WIRE_BINARY_V1);
+    auto res = Client::send(RequestCode::SEND_MESSAGE, body.data(),
+                            body.length());
+    delete res.buff;
     switch (res.code) {
-    case ResponseCode::NOT_FOUND:
-        return nullptr;
     case ResponseCode::OK:
         break;
+    case ResponseCode::BAD_REQUEST:
+    case ResponseCode::TOKEN_EXPIRED:
+        return false;
     default:
-        panic_unknown_res("get_message_or_download", res.code);
+        panic_unknown_res("send", res.code);
     }
-
+    if (get_message(message->get_id()) == nullptr) {
+        add_message(message);
+    }
+    return true;
 }
-std::vector<Entity *> TiClient::get_contacts() const {
-    return TiOrm::get_contacts(get_current_user());
+
+bool TiClient::wait_for_message(int timeout_ms) {
+    std::unique_lock<std::mutex> lock(pushmtx);
+    return pushed_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+                              [&] { return !pushed.empty(); });
 }
-void TiClient::send(ti::Message *message) {
-    // TODO
-    throw std::runtime_error("not implemented");
+
+std::vector<Message *> TiClient::receive() {
+    std::deque<std::string> batch;
+    {
+        std::lock_guard<std::mutex> lock(pushmtx);
+        batch.swap(pushed);
+    }
+    std::vector<Message *> added;
+    for (const auto &payload : batch) {
+        Message *msg;
+        try {
+            msg = Message::deserialize_with_frames(
+                payload.data(), payload.size(),
+                [&](StringView id) { return get_entity(id.str()); });
+        } catch (const std::runtime_error &e) {
+            logD("[client] leaving pushed message to sync: %s", e.what());
+            continue;
+        }
+        if (get_message(msg->get_id()) != nullptr) {
+            for (auto f : msg->get_frames()) {
+                delete f;
+            }
+            delete msg;
+            continue;
+        }
+        added.push_back(msg);
+    }
+    transaction([&] {
+        for (auto m : added) {
+            add_message(m);
+        }
+    });
+    return added;
 }
 
 void TiClient::panic_if_not(ti::client::TiClientState target) {
@@ -1,12 +1,103 @@
+#pragma once
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iterator>
 #include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
 
 #define BYTES_LEN_HEADER 8
+#define BYTES_TAG_HEADER 4
+#define FRAME_HEADER_LEN (1 + BYTES_LEN_HEADER)
+#define TAGGED_FRAME_HEADER_LEN (FRAME_HEADER_LEN + BYTES_TAG_HEADER)
+#define MAX_FRAME_LEN (64 << 20)
+/**
+ * How much of a streamed response is gathered before it's sent
+ * as a CHUNK frame
+ */
+#define STREAM_CHUNK_LEN (64 << 10)
+/**
+ * Set on the code byte of a frame whose header carries a correlation
+ * tag. A tagged request is answered with a tagged response of the same
+ * tag, so several of them may be in flight on one connection
+ */
+#define FRAME_TAGGED 0x80
+/**
+ * Set on the first byte of an object in a versioned wire format, see
+ * ti::WireFormat. Text objects start with a BSID or an id character
+ */
+#define WIRE_VERSION_FLAG 0x80
+#define WIRE_SHORT_ID_MAX 0xbf
+#define SYNC_DIGEST_LEN 32
+#define SYNC_TREE_FANOUT 16
+#define NANOID_LEN 21
+#define DIFF_LINEAR_MAX 32
 
 namespace ti {
 namespace helper {
 char *write_len_header(size_t len);
+void write_len_header(size_t len, char *dst);
 size_t read_len_header(const char *tsize);
+/**
+ * Append a length header, followed by len bytes of data if given
+ */
+void append_block(std::string &dst, size_t len, const char *data = nullptr);
+/**
+ * Read what append_block wrote at ptr and move ptr past it
+ * @throws std::runtime_error if src ends before the block does
+ */
+size_t read_len_header(const char *src, size_t len, size_t &ptr);
+std::string read_block(const char *src, size_t len, size_t &ptr);
+/**
+ * Unsigned LEB128, 7 bits a byte, least significant first
+ */
+void append_varint(std::string &dst, uint64_t n);
+/**
+ * Read what append_varint wrote at ptr and move ptr past it
+ * @throws std::runtime_error if src ends first, or it doesn't fit
+ */
+uint64_t read_varint(const char *src, size_t len, size_t &ptr);
+/**
+ * A varint length followed by the bytes
+ */
+void append_string(std::string &dst, const std::string &str);
+/**
+ * Read what append_string wrote without copying it
+ * @param n set to its length
+ * @return where it lies in src
+ */
+const char *read_string(const char *src, size_t len, size_t &ptr, size_t &n);
+/**
+ * Read what append_string wrote into dst, reusing its storage
+ */
+void read_string(const char *src, size_t len, size_t &ptr, std::string &dst);
+/**
+ * A NanoID takes 16 bytes, its 21 characters of 6 bits packed behind
+ * two set marker bits. Any other id is written behind a length byte
+ * no greater than WIRE_SHORT_ID_MAX
+ * @throws std::runtime_error if id is longer than that
+ */
+void append_id(std::string &dst, const std::string &id);
+/**
+ * Read an id without going to the heap. A packed one is unpacked into
+ * scratch, which holds NANOID_LEN bytes, anything else stays in src
+ * @param n set to its length
+ * @return where the id is
+ */
+const char *read_id(const char *src, size_t len, size_t &ptr, char *scratch,
+                    size_t &n);
+void read_id(const char *src, size_t len, size_t &ptr, std::string &dst);
+/**
+ * Seconds since the epoch, 64 bits big endian
+ */
+void append_time(std::string &dst, std::time_t time);
+std::time_t read_time(const char *src, size_t len, size_t &ptr);
+void write_tag_header(uint32_t tag, char *dst);
+uint32_t read_tag_header(const char *src);
 std::string to_iso_time(const std::time_t &time);
 std::time_t parse_iso_time(const std::string &str);
 std::vector<std::string> read_message_body(const char *data, size_t len,
@@ -28,14 +119,48 @@ inline std::vector<std::string> get_ids(EntityIterator first, EntityIterator las
                    [&](auto e) { return e->get_id(); });
     return result;
 }
-size_t next_sync_hash(char *curr, size_t curr_len, const std::string &addition,
-                      char **dst);
+/**
+ * Digest of an id in the sync trees, SYNC_DIGEST_LEN bytes. A set of
+ * ids hashes to the XOR of their digests, so replicas holding the same
+ * ids agree however they got them
+ */
+void sync_digest(const std::string &id, char *dst);
+/**
+ * Strategies for Diff. A linear search is quadratic but costs nothing
+ * to set up, a sorted merge takes O(n log n) and gives sorted results,
+ * a hash set takes O(n) and keeps the input order
+ */
+struct linear_search_tag {};
+struct sorted_merge_tag {};
+struct hash_set_tag {};
+
+/**
+ * A NanoID packed into machine words, so that comparing and hashing
+ * it takes a few word operations instead of a loop over bytes
+ */
+struct PackedId {
+    uint64_t words[3];
+
+    explicit PackedId(const std::string &id) : words() {
+        std::memcpy(words, id.data(), NANOID_LEN);
+    }
+    bool operator==(const PackedId &other) const {
+        return ((words[0] ^ other.words[0]) | (words[1] ^ other.words[1]) |
+                (words[2] ^ other.words[2])) == 0;
+    }
+    struct Hash {
+        size_t operator()(const PackedId &id) const {
+            uint64_t h = id.words[0] * 0x9e3779b97f4a7c15ull ^ id.words[1];
+            h = h * 0x9e3779b97f4a7c15ull ^ id.words[2];
+            return (size_t)(h ^ h >> 32);
+        }
+    };
+};
+
 template <class T, typename Iterator = typename std::vector<T>::iterator>
 class Diff {
-  public:
-    std::vector<T> plus, minus;
-    Diff(Iterator a_first, Iterator a_last, Iterator b_first, Iterator b_last)
-        : plus(), minus() {
+    void compute(Iterator a_first, Iterator a_last, Iterator b_first,
+                 Iterator b_last, linear_search_tag) {
         Iterator ai, bi;
         for (ai = a_first; ai != a_last; ai++) {
             if (std::find(b_first, b_last, *ai) == b_last) {
@@ -48,6 +173,79 @@ class Diff {
             }
         }
     }
+    void compute(Iterator a_first, Iterator a_last, Iterator b_first,
+                 Iterator b_last, sorted_merge_tag) {
+        std::vector<T> a(a_first, a_last), b(b_first, b_last);
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        std::set_difference(a.begin(), a.end(), b.begin(), b.end(),
+                            std::back_inserter(plus));
+        std::set_difference(b.begin(), b.end(), a.begin(), a.end(),
+                            std::back_inserter(minus));
+    }
+    void compute(Iterator a_first, Iterator a_last, Iterator b_first,
+                 Iterator b_last, hash_set_tag) {
+        compute_hashed(a_first, a_last, b_first, b_last,
+                       std::is_same<T, std::string>());
+    }
+    template <class Key, class Hash>
+    void compute_hashed(Iterator a_first, Iterator a_last, Iterator b_first,
+                        Iterator b_last) {
+        std::unordered_set<Key, Hash> a, b;
+        a.reserve(std::distance(a_first, a_last));
+        b.reserve(std::distance(b_first, b_last));
+        for (auto it = a_first; it != a_last; it++) {
+            a.insert(Key(*it));
+        }
+        for (auto it = b_first; it != b_last; it++) {
+            b.insert(Key(*it));
+        }
+        std::copy_if(a_first, a_last, std::back_inserter(plus),
+                     [&](const T &e) { return b.count(Key(e)) == 0; });
+        std::copy_if(b_first, b_last, std::back_inserter(minus),
+                     [&](const T &e) { return a.count(Key(e)) == 0; });
+    }
+    void compute_hashed(Iterator a_first, Iterator a_last, Iterator b_first,
+                        Iterator b_last, std::false_type) {
+        compute_hashed<T, std::hash<T>>(a_first, a_last, b_first, b_last);
+    }
+    void compute_hashed(Iterator a_first, Iterator a_last, Iterator b_first,
+                        Iterator b_last, std::true_type) {
+        auto is_nanoid = [](const std::string &s) {
+            return s.length() == NANOID_LEN;
+        };
+        if (std::all_of(a_first, a_last, is_nanoid) &&
+            std::all_of(b_first, b_last, is_nanoid)) {
+            compute_hashed<PackedId, PackedId::Hash>(a_first, a_last, b_first,
+                                                     b_last);
+        } else {
+            compute_hashed(a_first, a_last, b_first, b_last, std::false_type());
+        }
+    }
+
+  public:
+    /**
+     * What a has but b doesn't, and the other way around
+     */
+    std::vector<T> plus, minus;
+    /**
+     * Search a few elements linearly, hash anything larger
+     */
+    Diff(Iterator a_first, Iterator a_last, Iterator b_first, Iterator b_last)
+        : plus(), minus() {
+        if (std::distance(a_first, a_last) + std::distance(b_first, b_last) <=
+            DIFF_LINEAR_MAX) {
+            compute(a_first, a_last, b_first, b_last, linear_search_tag());
+        } else {
+            compute(a_first, a_last, b_first, b_last, hash_set_tag());
+        }
+    }
+    template <class Strategy>
+    Diff(Iterator a_first, Iterator a_last, Iterator b_first, Iterator b_last,
+         Strategy strategy)
+        : plus(), minus() {
+        compute(a_first, a_last, b_first, b_last, strategy);
+    }
 };
 } // namespace helper
 } // namespace ti
@@ -0,0 +1,62 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+namespace ti {
+namespace helper {
+/**
+ * Growable byte ring, used to receive framed requests
+ * without allocating for each of them
+ */
+class RingBuffer {
+    char *buf;
+    size_t cap, head, tail;
+
+  public:
+    struct Region {
+        char *data;
+        size_t len;
+    };
+
+    RingBuffer();
+    RingBuffer(const RingBuffer &) = delete;
+    RingBuffer &operator=(const RingBuffer &) = delete;
+    ~RingBuffer();
+    size_t size() const;
+    size_t capacity() const;
+    size_t space() const;
+    /**
+     * Grow to hold at least n bytes, moving the content to the front.
+     * Invalidates every pointer into the buffer
+     */
+    void reserve(size_t n);
+    /**
+     * Give the storage back if nothing is buffered
+     */
+    void release();
+    /**
+     * Free space to receive into, in order
+     * @param regions at least two entries
+     * @return how many regions are used, 0 if full
+     */
+    int free_regions(Region *regions) const;
+    /**
+     * Mark n bytes written into the free regions as content
+     */
+    void commit(size_t n);
+    /**
+     * Copy len bytes starting at offset from the oldest byte
+     */
+    void peek(size_t offset, void *dst, size_t len) const;
+    /**
+     * Pointer to len contiguous bytes starting at offset. If they wrap
+     * around the end of the ring, they are copied into scratch instead
+     */
+    char *view(size_t offset, size_t len, std::vector<char> &scratch);
+    /**
+     * Drop the n oldest bytes
+     */
+    void consume(size_t n);
+};
+} // namespace helper
+} // namespace ti
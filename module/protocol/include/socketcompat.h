@@ -6,6 +6,7 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
@@ -20,8 +21,21 @@ WSACleanup()
 #endif
 
 
+#define SENDV_MAX_BUFFERS 16
+
 namespace compat {
 namespace socket {
+struct Buffer {
+    const void *data;
+    size_t len;
+};
 void send(SocketFd fd, const void *buf, size_t len, int flags);
+/**
+ * Gather-write several buffers to a blocking socket, in as few
+ * syscalls as the platform allows
+ * @param count at most SENDV_MAX_BUFFERS
+ * @return false if the connection broke
+ */
+bool sendv(SocketFd fd, const Buffer *bufs, int count);
 }
 }
\ No newline at end of file
@@ -1,16 +1,79 @@
 #include "socketcompat.h"
+#include <condition_variable>
+#include <cstring>
 #include <ctime>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
 #include <sqlite3.h>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#define ORM_SHARD_COUNT 16
+#define SQL_READER_COUNT 4
+#define SQL_MMAP_SIZE (64l << 20)
+#define SQL_CACHE_SIZE (-8192l)
+
 namespace ti {
 const std::string version = "0.1";
 
+/**
+ * Encodings of serialized objects, negotiated per connection with
+ * HELLO. TEXT separates fields with NUL and writes ISO 8601 times.
+ * BINARY_V1 starts with a version byte and uses varint lengths, packed
+ * ids and 64-bit epoch times. Deserializing tells them apart by the
+ * first byte, so either end may read both
+ */
+enum WireFormat { WIRE_TEXT = 0, WIRE_BINARY_V1 = 1 };
+
 class BinarySerializable {
   public:
-    virtual size_t serialize(char **dst) const = 0;
+    virtual size_t serialize(char **dst,
+                             WireFormat format = WIRE_TEXT) const = 0;
+};
+
+/**
+ * Characters owned by someone else, usually a received buffer.
+ * Stands in for std::string_view, which takes C++17
+ */
+struct StringView {
+    const char *data;
+    size_t len;
+
+    std::string str() const { return {data, len}; }
+    bool operator==(const std::string &other) const {
+        return other.length() == len &&
+               (len == 0 || std::memcmp(data, other.data(), len) == 0);
+    }
+};
+
+/**
+ * An id read off the wire. A packed one is unpacked into the view
+ * itself, anything else is left where it was received
+ */
+class IdView {
+    char unpacked[21];
+    const char *data;
+    size_t len;
+
+  public:
+    IdView();
+    /**
+     * Read the id at ptr in the binary format and move ptr past it
+     */
+    void read(const char *src, size_t len, size_t &ptr);
+    void assign(StringView text);
+    StringView get() const;
+    std::string str() const;
 };
 
 enum BSID { ENTY_SRV = 0x00, ENTY_USR, ENTY_GRP, FRM_TXT = 0x40 };
@@ -29,7 +92,8 @@ class Server final : public Entity {
     std::string get_id() const override;
     ~Server() final;
     Server();
-    size_t serialize(char **dst) const override;
+    size_t serialize(char **dst,
+                     WireFormat format = WIRE_TEXT) const override;
     static Server INSTANCE;
 };
 
@@ -45,10 +109,27 @@ class User : public Entity {
     std::string get_name() const;
     std::string get_bio() const;
     time_t get_registration_time() const;
-    size_t serialize(char **dst) const override;
+    size_t serialize(char **dst,
+                     WireFormat format = WIRE_TEXT) const override;
     static User *deserialize(char *src, size_t len);
 };
 
+/**
+ * A serialized User, read in place. Only materialize() copies
+ */
+class UserView {
+  public:
+    IdView id;
+    StringView name, bio;
+    time_t registration_time;
+
+    /**
+     * @throws std::runtime_error if src isn't a serialized User
+     */
+    UserView(const char *src, size_t len);
+    User *materialize() const;
+};
+
 class Group : public Entity {
     std::string name, id;
     std::vector<Entity *> members;
@@ -60,7 +141,8 @@ class Group : public Entity {
     std::string get_id() const override;
     std::string get_name();
     std::vector<Entity *> &get_members();
-    size_t serialize(char **dst) const override;
+    size_t serialize(char **dst,
+                     WireFormat format = WIRE_TEXT) const override;
     static Group *deserialize(char *src, size_t len,
                               const std::function<Entity *(const std::string &)> &getter);
 };
@@ -80,10 +162,26 @@ class TextFrame : public Frame {
     TextFrame(std::string id, std::string content);
     std::string get_id() const override;
     std::string to_string() const override;
-    size_t serialize(char **dst) const override;
+    size_t serialize(char **dst,
+                     WireFormat format = WIRE_TEXT) const override;
     static TextFrame *deserialize(char *src, size_t len);
 };
 
+/**
+ * A serialized TextFrame, read in place. Only materialize() copies
+ */
+class TextFrameView {
+  public:
+    IdView id;
+    StringView content;
+
+    /**
+     * @throws std::runtime_error if src isn't a serialized TextFrame
+     */
+    TextFrameView(const char *src, size_t len);
+    TextFrame *materialize() const;
+};
+
 class Message : public BinarySerializable {
     std::vector<Frame *> frames;
     Entity *sender, *receiver, *forwarded_from;
@@ -98,14 +196,66 @@ class Message : public BinarySerializable {
     std::string get_id() const;
     Entity *get_sender() const;
     Entity *get_receiver() const;
+    /**
+     * Point it at what replaced its receiver
+     */
+    void set_receiver(Entity *receiver);
     Entity *get_forward_source() const;
     std::time_t get_time() const;
     bool is_visible_by(const Entity *entity);
-    std::vector<User *> get_all_receivers();
-    size_t serialize(char **dst) const override;
+    std::vector<User *> get_all_receivers() const;
+    size_t serialize(char **dst,
+                     WireFormat format = WIRE_TEXT) const override;
     static Message *deserialize(char *src, size_t len,
                                 const std::vector<Frame *> &frames,
                                 const std::vector<Entity *> &entities);
+    /**
+     * The message together with its frames, the way it travels on its
+     * own: the frame count and each frame in a block (see
+     * helper::append_block), then the message in another
+     */
+    void serialize_with_frames(std::string &dst, WireFormat format) const;
+    /**
+     * Read what serialize_with_frames wrote. The frames come with the
+     * message and are the caller's to free
+     * @param entity finds an entity by id, nullptr if it can't
+     * @throws std::runtime_error if src is malformed or a lookup fails
+     */
+    static Message *
+    deserialize_with_frames(const char *src, size_t len,
+                            const std::function<Entity *(StringView)> &entity);
+};
+
+/**
+ * A serialized Message, read in place. The frames and entities it
+ * refers to are only looked up by materialize()
+ */
+class MessageView {
+    const char *src;
+    size_t len, frames_at;
+    bool versioned;
+
+  public:
+    IdView id, sender, receiver, forward_source;
+    std::time_t time;
+    size_t frame_count;
+
+    /**
+     * @throws std::runtime_error if src isn't a serialized Message
+     */
+    MessageView(const char *src, size_t len);
+    /**
+     * Call fn with the id of each frame, in order
+     */
+    void for_each_frame(const std::function<void(StringView)> &fn) const;
+    /**
+     * @param frame finds a frame by id, nullptr if it can't
+     * @param entity finds an entity by id, nullptr if it can't
+     * @throws std::runtime_error if a lookup fails
+     */
+    Message *
+    materialize(const std::function<Frame *(StringView)> &frame,
+                const std::function<Entity *(StringView)> &entity) const;
 };
 
 enum RequestCode {
@@ -116,8 +266,31 @@ enum RequestCode {
     DELETE_USER,
     RECONNECT,
     DETERMINE,
+    /**
+     * Body: the highest WireFormat the client reads. Not answered, so
+     * it may be sent ahead of anything else
+     */
+    HELLO,
+    /**
+     * Body: the token, then the message as Message::serialize_with_frames
+     * writes it. The receivers online get it pushed as a MESSAGE
+     */
+    SEND_MESSAGE,
+};
+/**
+ * CHUNK carries part of an OK response while the rest is still being
+ * written. A streamed response is a series of them, ended by an OK frame.
+ * BUSY turns a request down for now, asking to retry it later
+ */
+enum ResponseCode {
+    OK = 0,
+    NOT_FOUND,
+    BAD_REQUEST,
+    TOKEN_EXPIRED,
+    MESSAGE,
+    CHUNK,
+    BUSY
 };
-enum ResponseCode { OK = 0, NOT_FOUND, BAD_REQUEST, TOKEN_EXPIRED, MESSAGE };
 
 namespace orm {
 class Row {
@@ -134,14 +307,54 @@ class Row {
     int get_type(int col) const;
 };
 
+/**
+ * Prepared statements kept for reuse, keyed by their SQL text.
+ * A statement is taken out while a transaction runs it, and put
+ * back once the transaction is closed. The least recently used
+ * one is finalized when the cache is full
+ */
+class StatementCache {
+    typedef std::list<std::pair<std::string, sqlite3_stmt *>> Entries;
+    size_t capacity;
+    Entries entries;
+    std::unordered_map<std::string, Entries::iterator> index;
+    mutable std::mutex mtx;
+    size_t hits, misses;
+    bool closed;
+
+  public:
+    explicit StatementCache(size_t capacity);
+    ~StatementCache();
+    /**
+     * @return a reset statement for expr, or nullptr if none is cached
+     */
+    sqlite3_stmt *take(const std::string &expr);
+    void put(const std::string &expr, sqlite3_stmt *handle);
+    /**
+     * Finalize every cached statement, and those put back later on
+     */
+    void close();
+    size_t get_hits() const;
+    size_t get_misses() const;
+};
+
 class SqlTransaction {
     sqlite3_stmt *handle;
     bool closed;
     std::vector<char *> pending_str;
+    std::string expr;
+    std::shared_ptr<StatementCache> cache;
+    std::function<void()> release;
     static void throw_on_fail(int code);
 
   public:
-    SqlTransaction(const std::string &expr, sqlite3 *db);
+    /**
+     * @param release called once the statement is closed, to give
+     * back the connection it ran on
+     */
+    SqlTransaction(const std::string &expr, sqlite3 *db,
+                   std::shared_ptr<StatementCache> cache = nullptr,
+                   std::function<void()> release = nullptr);
     ~SqlTransaction();
     void bind_text(int pos, const std::string &text);
     void bind_int(int pos, int n);
@@ -170,19 +383,105 @@ class SqlTransaction {
 };
 
 /**
- * Wrapper for SQLite 3 C API
+ * Writes waiting to be committed together. See SqlDatabase::write
+ */
+struct WriteQueue {
+    struct Write {
+        std::function<void()> fn;
+        std::promise<void> done;
+    };
+    std::mutex txmtx, mtx;
+    std::condition_variable cv;
+    std::deque<Write> pending;
+    std::thread committer;
+    bool running = false;
+    unsigned window_ms = 0;
+    size_t max_batch = 0;
+};
+
+/**
+ * How SqlDatabase opens its connections
+ */
+struct SqlOptions {
+    /** Connections to read on besides the writer, 0 to read on the writer */
+    size_t readers = SQL_READER_COUNT;
+    /** OFF, NORMAL or FULL. NORMAL doesn't lose commits under WAL */
+    std::string synchronous = "NORMAL";
+    /** Bytes of the file to memory map on each connection */
+    long mmap_size = SQL_MMAP_SIZE;
+    /** Page cache of each connection, in pages, or KiB if negative */
+    long cache_size = SQL_CACHE_SIZE;
+};
+
+/**
+ * Read-only connections to the database, each lent to one thread at a
+ * time. See SqlDatabase::prepare_read
+ */
+struct ReaderPool {
+    struct Reader {
+        sqlite3 *handle;
+        std::shared_ptr<StatementCache> statements;
+    };
+    std::mutex mtx;
+    std::vector<Reader *> all, idle;
+};
+
+/**
+ * Wrapper for SQLite 3 C API. Opened on a file, the database runs in
+ * WAL mode, with one connection for writing and a pool of them for
+ * reading in parallel
  */
 class SqlDatabase {
     sqlite3 *dbhandle;
     bool is_cpy;
+    std::shared_ptr<StatementCache> statements;
+    std::shared_ptr<WriteQueue> writes;
+    std::shared_ptr<ReaderPool> readers;
+
+    void commit_loop() const;
+    void open_readers(const SqlOptions &options);
 
   public:
-    explicit SqlDatabase(const std::string &dbfile);
+    explicit SqlDatabase(const std::string &dbfile,
+                         const SqlOptions &options = SqlOptions());
     SqlDatabase(const SqlDatabase &h);
     ~SqlDatabase();
     SqlTransaction *prepare(const std::string &expr) const;
+    /**
+     * Prepare a query on an idle reader, which sees what was committed
+     * before it starts. Inside a transaction, or if every reader is
+     * busy, it runs on the writer like prepare() does
+     */
+    SqlTransaction *prepare_read(const std::string &expr) const;
+    /**
+     * How many readers are in the pool
+     */
+    size_t get_reader_count() const;
     void exec_sql(const std::string &expr) const;
     int get_changes() const;
+    /**
+     * How often prepare() could reuse a compiled statement
+     */
+    size_t get_statement_hits() const;
+    size_t get_statement_misses() const;
+    /**
+     * Run fn in one transaction, committed when it returns and
+     * rolled back if it throws. Inside another transaction on the
+     * same thread, fn simply becomes part of that one
+     */
+    void transaction(const std::function<void()> &fn) const;
+    /**
+     * Run the statements of fn and return once they are committed.
+     * With group commit on, fn runs on the committer thread together
+     * with the writes of other threads, in one transaction
+     */
+    void write(const std::function<void()> &fn) const;
+    /**
+     * Collect concurrent writes for window_ms milliseconds, or until
+     * max_batch of them are waiting, before committing them at once.
+     * 0 turns group commit off again
+     */
+    void set_group_commit(unsigned window_ms, size_t max_batch = 1024);
 
     static void initialize();
     static void shutdown();
@@ -193,6 +492,15 @@ struct ByteArray {
     char *hash;
 };
 
+/**
+ * How many ids there are below a node of a sync tree, and the XOR of
+ * their digests. See TiOrm::get_sync_children
+ */
+struct SyncNode {
+    size_t count;
+    std::string hash;
+};
+
 class Sync {
     SqlDatabase *db;
     User *owner;
@@ -207,40 +515,321 @@ class Sync {
     const ByteArray *get_messages_hash();
 };
 
+/**
+ * The last thing that happened to an object a user can see,
+ * as recorded in the change log. See TiOrm::get_changelog
+ */
+struct Change {
+    long seq;
+    bool removed;
+    std::string id;
+};
+
+struct CacheStats {
+    size_t limit, bytes, objects, pinned;
+    size_t hits, misses, evictions;
+};
+
+/**
+ * Objects kept in memory and in the database at once. Safe to use
+ * from many threads, except for pull(), which must not overlap
+ * with anything else
+ */
 class TiOrm : public SqlDatabase {
-    std::vector<Entity *> entities;
-    std::vector<Frame *> frames;
-    std::vector<Message *> messages;
-    std::vector<std::pair<User *, Entity *>> contacts;
+    /**
+     * A message, with its frames, or a frame on its own,
+     * held by the cache in lazy mode
+     */
+    struct Cached {
+        Message *message;
+        Frame *frame;
+        size_t bytes;
+        unsigned pins;
+        std::list<std::string>::iterator lru;
+    };
+
+    /**
+     * What is kept in memory, split by the hash of the id it's looked
+     * up by, each part behind its own reader-writer lock. Everything
+     * keyed by the same id, such as a user and its contacts and inbox,
+     * lands in the same shard, so no operation holds two at once
+     */
+    struct Shard {
+        mutable std::shared_timed_mutex mtx;
+        std::unordered_map<std::string, Entity *> entities;
+        /**
+         * Empty in lazy mode, where the cache takes their place
+         */
+        std::unordered_map<std::string, Frame *> frames;
+        std::unordered_map<std::string, Message *> messages;
+        /**
+         * Per user and per group views, maintained on write so that
+         * reading them doesn't depend on how much else is stored
+         */
+        std::unordered_map<std::string, std::vector<Entity *>> contacts;
+        std::unordered_map<std::string, std::vector<Message *>> inboxes;
+        std::unordered_map<std::string, std::unordered_set<std::string>>
+            members;
+    };
+    Shard shards[ORM_SHARD_COUNT];
+    /**
+     * An entity replaced or deleted, waiting for whoever may still
+     * look at it to be done
+     */
+    struct Retired {
+        unsigned long long epoch;
+        Entity *entity;
+        /** Nothing stored referred to it as of epoch */
+        bool unreferenced;
+    };
+    /**
+     * Retired entities, oldest first. Each one waits until every
+     * CacheScope that began before its epoch has ended. Then, if
+     * nothing stored refers to it any more, it waits once more for
+     * those that may have reached it that way, and is freed
+     */
+    mutable std::deque<Retired> retired;
+    /**
+     * Retired, but still referred to by messages, groups or
+     * contacts. Looked at again whenever others are due
+     */
+    mutable std::vector<Entity *> kept;
+    mutable unsigned long long epoch;
+    /** The epoch each outermost CacheScope began at */
+    mutable std::multiset<unsigned long long> readers;
+    mutable std::mutex retiredmtx;
+    /** Held by whoever is in reclaim(), one at a time */
+    mutable std::mutex reclaimmtx;
+    /**
+     * In lazy mode, the frames and messages held by the cache, a frame
+     * with the id of the entry holding it. Guarded by cachemtx
+     */
+    mutable std::unordered_map<std::string, std::pair<Frame *, std::string>>
+        frame_index;
+    mutable std::unordered_map<std::string, Message *> message_index;
+    size_t cache_limit;
+    mutable std::unordered_map<std::string, Cached> cache;
+    /**
+     * Entries dropped while pinned, by the object they hold. Freed
+     * once the last CacheScope pinning them ends
+     */
+    mutable std::unordered_map<const void *, Cached> dropped;
+    mutable std::list<std::string> lru;
+    mutable CacheStats stats;
+    /**
+     * Moves on whenever a stored message goes, so that what was loaded
+     * before isn't cached after
+     */
+    mutable unsigned long long cache_version;
+    mutable std::mutex cachemtx;
 
+    Shard &shard_of(const std::string &id) const;
     void reset();
+    /**
+     * Call with the shard of the group locked for writing
+     */
+    void index_group(Shard &shard, Group *group);
+    void index_message(Message *msg);
+    void unindex_message(Message *msg);
+    /**
+     * Hand the messages sent to group to the users who joined it,
+     * and take them from those who left, in the inboxes, the sync
+     * trees and the change log. Call once the new members are stored
+     */
+    void reindex_group(Group *group, const std::set<std::string> &joined,
+                       const std::set<std::string> &left);
+    void insert_frames(const std::vector<Frame *> &frm, Message *parent);
+    bool is_lazy() const;
+    /**
+     * Read from the database, on a reader. Call without cachemtx
+     */
+    Message *load_message(const std::string &id) const;
+    Frame *load_frame(const std::string &id) const;
+    Message *lookup_message(const std::string &id) const;
+    /**
+     * Cache bookkeeping for lazy mode. Call with cachemtx held
+     */
+    /**
+     * Hand msg, or frame on its own, to the cache
+     * @return false if a pinned entry for id is kept instead, in which
+     * case msg or frame is still the caller's
+     */
+    bool cache_insert(const std::string &id, Message *msg, Frame *frame) const;
+    void cache_touch(Cached &entry) const;
+    /**
+     * Forget what is cached for id. If it's pinned, it is only set
+     * aside in dropped
+     */
+    void cache_drop(std::string id) const;
+    void cache_free(Cached &entry) const;
+    /** The object an entry holds, which pins refer to it by */
+    static const void *held(const Cached &entry);
+    /**
+     * Remove frame from frame_index, unless it maps to another copy
+     */
+    void unindex_frame(const Frame *frame) const;
+    void cache_evict() const;
     void update_sync(const User *owner, const std::string& addition, std::string field);
+    /** update_sync, without logging the change */
+    void update_sync_tree(const User *owner, const std::string &addition,
+                          const std::string &field);
+    /**
+     * Fill the sync trees and the change log from the stored contacts
+     * and messages. Call once the entities are pulled, while the trees
+     * are empty
+     */
+    void backfill_sync();
+    /**
+     * Free entity once nobody can be using it. Call after it's gone
+     * from the shards, with no lock held
+     */
+    void retire(Entity *entity) const;
+    /**
+     * Free the retired entities that are due. Call with no lock held
+     */
+    void reclaim() const;
+    /**
+     * Which of among are referred to by stored messages, groups or
+     * contacts, or by groups waiting to be freed
+     */
+    std::unordered_set<const Entity *>
+    referenced(const std::vector<Entity *> &among) const;
 
   public:
-    explicit TiOrm(const std::string &dbfile);
+    /**
+     * Keeps whatever the cache loads during its lifetime on the
+     * calling thread from being evicted, and whatever entity is
+     * replaced or deleted meanwhile from being freed, e.g. while a
+     * request still uses the pointers
+     */
+    class CacheScope {
+        const TiOrm &orm;
+        CacheScope *outer;
+        /** The epoch it began at, if it's the outermost for orm */
+        unsigned long long since;
+        bool reading;
+        /** By id, and by object in case the entry is dropped meanwhile */
+        std::vector<std::pair<std::string, const void *>> pinned;
+        friend class TiOrm;
+
+        void unpin();
+
+      public:
+        explicit CacheScope(const TiOrm &orm);
+        CacheScope(const CacheScope &) = delete;
+        ~CacheScope();
+    };
+
+    explicit TiOrm(const std::string &dbfile,
+                   const SqlOptions &options = SqlOptions());
     TiOrm(const TiOrm &t);
     ~TiOrm();
     virtual void pull();
+    /**
+     * Switch to lazy mode before pull(): users, groups and contacts
+     * are still loaded up front, but messages and frames are read
+     * from the database when looked up, and the least recently used
+     * are dropped once they take more than bytes of memory.
+     * Pointers stay valid while a CacheScope on the same thread is
+     * alive, or otherwise until the next lookup. 0 loads everything
+     */
+    void set_cache_limit(size_t bytes);
+    CacheStats get_cache_stats() const;
     std::vector<User *> get_users() const;
     User *get_user(const std::string &id) const;
     std::vector<Entity *> get_contacts(User *owner) const;
     void add_contact(User *owner, Entity *contact);
     bool delete_contact(User *owner, Entity *contact);
     /**
-     * Insert a new entity, or replace the existing one,
-     * making whose pointer invalid
+     * Insert a new entity, or replace the existing one. The one
+     * replaced is freed once no CacheScope that may have seen it is
+     * left and nothing stored refers to it, see delete_entity
      * @param entity
      */
     void add_entity(Entity *entity);
+    /**
+     * Forget an entity, which is then the ORM's to free the same way
+     * as one replaced by add_entity. Messages, groups and contacts
+     * referring to it keep it alive
+     * @throws std::runtime_error if it isn't the one stored
+     */
     void delete_entity(Entity *entity);
+    /**
+     * Entities replaced or deleted but not freed yet
+     */
+    size_t get_retired_count() const;
+    /**
+     * Every entity, in no particular order
+     */
     std::vector<Entity *> get_entities() const;
     Entity *get_entity(const std::string &id) const;
     void add_frames(const std::vector<Frame *> &frm, Message *parent = nullptr);
+    Frame *get_frame(const std::string &id) const;
+    /**
+     * Every message, or those in the cache if in lazy mode,
+     * in no particular order
+     */
     std::vector<Message *> get_messages() const;
+    /**
+     * Messages received by a user, directly or through a group,
+     * in the order they were added
+     */
+    std::vector<Message *> get_messages(const User *owner) const;
+    /**
+     * The same a page at a time, so that in lazy mode only the page is
+     * loaded. A message deleted meanwhile may take one of the next
+     * page's place
+     * @param after 0 for the first page, moved past the one returned
+     * @return at most limit messages, none past the last page
+     */
+    std::vector<Message *> get_messages(const User *owner, long long &after,
+                                        size_t limit) const;
+    bool is_visible(const Message *msg, const User *user) const;
     Message *get_message(const std::string &id);
     void add_message(Message *msg);
     bool delete_message(Message *msg);
     Sync get_sync(ti::User *owner) const;
+    /**
+     * Sequence number of the latest change to what a user can see,
+     * 0 if there is none. It only ever grows
+     */
+    long get_sync_seq(const User *owner) const;
+    /**
+     * Net changes to a user's messages or contacts after seq,
+     * one per object and oldest first
+     * @param field "messages" or "contacts"
+     */
+    std::vector<Change> get_changelog(const User *owner,
+                                      const std::string &field,
+                                      long seq) const;
+    /**
+     * Forget all but the latest keep changes to what a user can see.
+     * Done now and then as changes are logged
+     */
+    void compact_changelog(const User *owner, size_t keep);
+    /**
+     * The oldest change kept for a user, 0 if there is none. The log
+     * only answers for a cursor at or after it, since the change a
+     * cursor stands for is only forgotten with everything before it
+     */
+    long get_changelog_floor(const User *owner) const;
+    /**
+     * A user's messages or contacts form a tree, keyed by the digests
+     * of their ids, one hex digit per level. Two replicas can find where
+     * they differ by comparing the children of the nodes that disagree,
+     * starting from the root at the empty prefix
+     * @param prefix hex digits leading to the node, at most 63
+     * @return the 16 children of the node
+     */
+    std::vector<SyncNode> get_sync_children(const User *owner,
+                                            const std::string &field,
+                                            const std::string &prefix) const;
+    /**
+     * Ids below a node of the sync tree, ordered by digest
+     */
+    std::vector<std::string> get_sync_range(const User *owner,
+                                            const std::string &field,
+                                            const std::string &prefix) const;
 };
 } // namespace orm
 } // namespace ti
@@ -1,28 +1,238 @@
 #include "helper.h"
 #include <sha3.h>
+#include <stdexcept>
 #include <timecompat.h>
 #include <vector>
 
 char *ti::helper::write_len_header(size_t len) {
     char *tsize = (char *)calloc(BYTES_LEN_HEADER, sizeof(char));
-    int n = BYTES_LEN_HEADER - sizeof(len);
-    while (n < BYTES_LEN_HEADER) {
-        tsize[n] = (len >> (sizeof(len) - n - 1) * 8);
-        n++;
-    }
+    write_len_header(len, tsize);
     return tsize;
 }
 
+void ti::helper::write_len_header(size_t len, char *dst) {
+    // big endian, zero-padded where size_t is narrower than the header
+    for (int n = BYTES_LEN_HEADER - 1; n >= 0; n--) {
+        dst[n] = (char)(len & 0xff);
+        len >>= 8;
+    }
+}
+
 size_t ti::helper::read_len_header(const char *tsize) {
     int n = 0;
     size_t msize = 0;
     while (n < BYTES_LEN_HEADER) {
-        msize <<= sizeof(char);
-        msize |= tsize[n++];
+        msize <<= 8;
+        msize |= (unsigned char)tsize[n++];
     }
     return msize;
 }
 
+void ti::helper::append_block(std::string &dst, size_t len,
+                              const char *data) {
+    char header[BYTES_LEN_HEADER];
+    write_len_header(len, header);
+    dst.append(header, BYTES_LEN_HEADER);
+    if (data != nullptr) {
+        dst.append(data, len);
+    }
+}
+
+size_t ti::helper::read_len_header(const char *src, size_t len, size_t &ptr) {
+    if (len < BYTES_LEN_HEADER || ptr > len - BYTES_LEN_HEADER) {
+        throw std::runtime_error("truncated block");
+    }
+    auto n = read_len_header(src + ptr);
+    ptr += BYTES_LEN_HEADER;
+    return n;
+}
+
+std::string ti::helper::read_block(const char *src, size_t len, size_t &ptr) {
+    auto n = read_len_header(src, len, ptr);
+    if (n > len - ptr) {
+        throw std::runtime_error("truncated block");
+    }
+    std::string block(src + ptr, n);
+    ptr += n;
+    return block;
+}
+
+void ti::helper::append_varint(std::string &dst, uint64_t n) {
+    while (n >= 0x80) {
+        dst.push_back((char)((n & 0x7f) | 0x80));
+        n >>= 7;
+    }
+    dst.push_back((char)n);
+}
+
+uint64_t ti::helper::read_varint(const char *src, size_t len, size_t &ptr) {
+    uint64_t n = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (ptr >= len) {
+            throw std::runtime_error("truncated varint");
+        }
+        auto b = (unsigned char)src[ptr++];
+        n |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return n;
+        }
+    }
+    throw std::runtime_error("varint too long");
+}
+
+void ti::helper::append_string(std::string &dst, const std::string &str) {
+    append_varint(dst, str.length());
+    dst.append(str);
+}
+
+const char *ti::helper::read_string(const char *src, size_t len, size_t &ptr,
+                                    size_t &n) {
+    n = read_varint(src, len, ptr);
+    if (n > len - ptr) {
+        throw std::runtime_error("truncated string");
+    }
+    auto str = src + ptr;
+    ptr += n;
+    return str;
+}
+
+void ti::helper::read_string(const char *src, size_t len, size_t &ptr,
+                             std::string &dst) {
+    size_t n;
+    auto str = read_string(src, len, ptr, n);
+    dst.assign(str, n);
+}
+
+namespace {
+// the alphabet nanoid::generate draws from
+const char nanoid_alphabet[] =
+    "_-0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+const size_t packed_id_len = 16;
+const unsigned char packed_id_mark = 0xc0;
+
+// unlike the length headers, always 64 bits wide
+void write_u64(uint64_t n, char *dst) {
+    for (int i = 7; i >= 0; i--) {
+        dst[i] = (char)(n & 0xff);
+        n >>= 8;
+    }
+}
+
+uint64_t read_u64(const char *src) {
+    uint64_t n = 0;
+    for (int i = 0; i < 8; i++) {
+        n = n << 8 | (unsigned char)src[i];
+    }
+    return n;
+}
+
+const signed char *nanoid_digits() {
+    static const auto table = [] {
+        std::vector<signed char> t(256, -1);
+        for (int i = 0; i < 64; ++i) {
+            t[(unsigned char)nanoid_alphabet[i]] = (signed char)i;
+        }
+        return t;
+    }();
+    return table.data();
+}
+} // namespace
+
+void ti::helper::append_id(std::string &dst, const std::string &id) {
+    auto digits = nanoid_digits();
+    bool packable = id.length() == NANOID_LEN &&
+                    std::all_of(id.begin(), id.end(), [&](char c) {
+                        return digits[(unsigned char)c] >= 0;
+                    });
+    if (!packable) {
+        if (id.length() > WIRE_SHORT_ID_MAX) {
+            throw std::runtime_error("id too long: " + id);
+        }
+        dst.push_back((char)id.length());
+        dst.append(id);
+        return;
+    }
+    // 126 bits, high to low
+    uint64_t hi = 0, lo = 0;
+    for (char c : id) {
+        hi = hi << 6 | lo >> 58;
+        lo = lo << 6 | (uint64_t)digits[(unsigned char)c];
+    }
+    hi |= (uint64_t)packed_id_mark << 56;
+    char packed[packed_id_len];
+    write_u64(hi, packed);
+    write_u64(lo, packed + 8);
+    dst.append(packed, packed_id_len);
+}
+
+const char *ti::helper::read_id(const char *src, size_t len, size_t &ptr,
+                                char *scratch, size_t &n) {
+    if (ptr >= len) {
+        throw std::runtime_error("truncated id");
+    }
+    auto head = (unsigned char)src[ptr];
+    if ((head & packed_id_mark) != packed_id_mark) {
+        ptr++;
+        if (head > len - ptr) {
+            throw std::runtime_error("truncated id");
+        }
+        n = head;
+        ptr += n;
+        return src + ptr - n;
+    }
+    if (len - ptr < packed_id_len) {
+        throw std::runtime_error("truncated id");
+    }
+    uint64_t hi = read_u64(src + ptr) & ~((uint64_t)packed_id_mark << 56),
+             lo = read_u64(src + ptr + 8);
+    ptr += packed_id_len;
+    for (int i = NANOID_LEN - 1; i >= 0; i--) {
+        scratch[i] = nanoid_alphabet[lo & 63];
+        lo = lo >> 6 | hi << 58;
+        hi >>= 6;
+    }
+    n = NANOID_LEN;
+    return scratch;
+}
+
+void ti::helper::read_id(const char *src, size_t len, size_t &ptr,
+                         std::string &dst) {
+    char scratch[NANOID_LEN];
+    size_t n;
+    auto id = read_id(src, len, ptr, scratch, n);
+    dst.assign(id, n);
+}
+
+void ti::helper::append_time(std::string &dst, std::time_t time) {
+    char buf[8];
+    write_u64((uint64_t)(int64_t)time, buf);
+    dst.append(buf, 8);
+}
+
+std::time_t ti::helper::read_time(const char *src, size_t len, size_t &ptr) {
+    if (len < 8 || ptr > len - 8) {
+        throw std::runtime_error("truncated time");
+    }
+    auto time = (std::time_t)(int64_t)read_u64(src + ptr);
+    ptr += 8;
+    return time;
+}
+
+void ti::helper::write_tag_header(uint32_t tag, char *dst) {
+    for (int n = BYTES_TAG_HEADER - 1; n >= 0; n--) {
+        dst[n] = (char)(tag & 0xff);
+        tag >>= 8;
+    }
+}
+
+uint32_t ti::helper::read_tag_header(const char *src) {
+    uint32_t tag = 0;
+    for (int n = 0; n < BYTES_TAG_HEADER; n++) {
+        tag = tag << 8 | (unsigned char)src[n];
+    }
+    return tag;
+}
+
 std::string ti::helper::to_iso_time(const std::time_t &time) {
     char buf[sizeof "0000-00-00T00:00:00Z"]; // i hate magic numbers
     strftime(buf, sizeof buf, "%FT%TZ", gmtime(&time));
@@ -54,23 +264,17 @@ ti::helper::read_message_body(const char *data, size_t len, char separator) {
     return heap;
 }
 
-size_t hex2bin(const std::string &hex, char **buf) {
-    *buf = (char *)calloc(hex.size() / 2, sizeof(char));
+void hex2bin(const std::string &hex, char *dst) {
     for (size_t i = 0, j = 0; i < hex.size(); i++) {
         unsigned char high = hex[i] >= 'a' ? hex[i] - 'a' + 10 : hex[i] - '0';
         i++;
         unsigned char low = hex[i] >= 'a' ? hex[i] - 'a' + 10 : hex[i] - '0';
-        (*buf)[j++] = high * 16 + low;
+        dst[j++] = high * 16 + low;
     }
-    return hex.size() / 2;
 }
 
-size_t ti::helper::next_sync_hash(char *curr, size_t curr_len,
-                                  const std::string &addition, char **dst) {
+void ti::helper::sync_digest(const std::string &id, char *dst) {
     SHA3 sha3;
-    sha3.add(curr, curr_len);
-    sha3.add(addition.c_str(), addition.length());
-    auto hex = sha3.getHash();
-    auto len = hex2bin(hex, dst);
-    return len;
+    sha3.add(id.c_str(), id.length());
+    hex2bin(sha3.getHash(), dst);
 }
@@ -0,0 +1,88 @@
+#include "ringbuffer.h"
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace ti::helper;
+
+RingBuffer::RingBuffer() : buf(nullptr), cap(0), head(0), tail(0) {}
+
+RingBuffer::~RingBuffer() { free(buf); }
+
+size_t RingBuffer::size() const { return tail - head; }
+
+size_t RingBuffer::capacity() const { return cap; }
+
+size_t RingBuffer::space() const { return cap - size(); }
+
+void RingBuffer::reserve(size_t n) {
+    if (n <= cap) {
+        return;
+    }
+    size_t ncap = cap == 0 ? 64 : cap;
+    while (ncap < n) {
+        ncap <<= 1;
+    }
+    auto nbuf = (char *)malloc(ncap);
+    if (nbuf == nullptr) {
+        throw std::bad_alloc();
+    }
+    size_t len = size();
+    if (len > 0) {
+        peek(0, nbuf, len);
+    }
+    free(buf);
+    buf = nbuf;
+    cap = ncap;
+    head = 0;
+    tail = len;
+}
+
+void RingBuffer::release() {
+    if (size() == 0) {
+        free(buf);
+        buf = nullptr;
+        cap = head = tail = 0;
+    }
+}
+
+int RingBuffer::free_regions(Region *regions) const {
+    if (space() == 0) {
+        return 0;
+    }
+    // cap is a power of two, so masking is the same as modulo
+    size_t start = tail & (cap - 1), end = head & (cap - 1);
+    if (start < end) {
+        regions[0] = {buf + start, end - start};
+        return 1;
+    }
+    regions[0] = {buf + start, cap - start};
+    if (end == 0) {
+        return 1;
+    }
+    regions[1] = {buf, end};
+    return 2;
+}
+
+void RingBuffer::commit(size_t n) { tail += n; }
+
+void RingBuffer::peek(size_t offset, void *dst, size_t len) const {
+    size_t start = (head + offset) & (cap - 1);
+    size_t first = std::min(len, cap - start);
+    std::memcpy(dst, buf + start, first);
+    std::memcpy((char *)dst + first, buf, len - first);
+}
+
+char *RingBuffer::view(size_t offset, size_t len, std::vector<char> &scratch) {
+    size_t start = (head + offset) & (cap - 1);
+    if (start + len <= cap) {
+        return buf + start;
+    }
+    if (scratch.size() < len) {
+        scratch.resize(len);
+    }
+    peek(offset, scratch.data(), len);
+    return scratch.data();
+}
+
+void RingBuffer::consume(size_t n) { head += n; }
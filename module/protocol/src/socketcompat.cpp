@@ -1,4 +1,6 @@
 #include "socketcompat.h"
+#include <cerrno>
+#include <stdexcept>
 
 namespace compat {
 namespace socket {
@@ -9,5 +11,53 @@ void send(SocketFd fd, const void *buf, size_t len, int flags) {
 ::send(fd, buf, len, flags);
 #endif
 }
+bool sendv(SocketFd fd, const Buffer *bufs, int count) {
+    if (count > SENDV_MAX_BUFFERS) {
+        throw std::invalid_argument("too many buffers");
+    }
+#ifdef _WIN32
+    WSABUF wsabufs[SENDV_MAX_BUFFERS];
+    for (int i = 0; i < count; ++i) {
+        wsabufs[i].buf = (CHAR *)bufs[i].data;
+        wsabufs[i].len = (ULONG)bufs[i].len;
+    }
+    DWORD sent;
+    return WSASend(fd, wsabufs, count, &sent, 0, nullptr, nullptr) == 0;
+#else
+    iovec iov[SENDV_MAX_BUFFERS];
+    for (int i = 0; i < count; ++i) {
+        iov[i].iov_base = (void *)bufs[i].data;
+        iov[i].iov_len = bufs[i].len;
+    }
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &msg, flags);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        // skip what went out, the kernel may have taken part of a buffer
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return true;
+#endif
+}
 } // namespace socket
 }
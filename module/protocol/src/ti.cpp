@@ -4,8 +4,20 @@
 #include <algorithm>
 #include <numeric>
 
+#define SQL_STATEMENT_CACHE_SIZE 64
+#define SQL_BUSY_TIMEOUT_MS 1000
+// changes kept for each user, older ones are answered with a snapshot
+#define CHANGE_RETENTION 4096
+// one change logged in this many compacts the log of its user
+#define CHANGE_COMPACT_EVERY 256
+
 using namespace ti;
 using namespace orm;
+
+// the connection the calling thread has an open transaction on
+static thread_local sqlite3 *transacting = nullptr;
+// innermost cache scope alive on the calling thread
+static thread_local TiOrm::CacheScope *current_scope = nullptr;
 using namespace helper;
 
 void fail_if_bsid_not(BSID expected, BSID actual) {
@@ -14,13 +26,83 @@ void fail_if_bsid_not(BSID expected, BSID actual) {
     }
 }
 
+const char wire_binary_v1 = (char)(WIRE_VERSION_FLAG | WIRE_BINARY_V1);
+
+/**
+ * Whether src is in a versioned wire format, which is only BINARY_V1
+ * so far
+ */
+bool is_versioned(const char *src, size_t len) {
+    if (len == 0 || !((unsigned char)src[0] & WIRE_VERSION_FLAG)) {
+        return false;
+    }
+    if (src[0] != wire_binary_v1) {
+        throw std::runtime_error("unsupported wire format: " +
+                                 std::to_string((unsigned char)src[0]));
+    }
+    return true;
+}
+
+/**
+ * The BSID of a serialized object, behind its version byte if any
+ */
+BSID read_bsid(const char *src, size_t len) {
+    if (!is_versioned(src, len)) {
+        return (BSID)src[0];
+    }
+    if (len < 2) {
+        throw std::runtime_error("truncated object");
+    }
+    return (BSID)src[1];
+}
+
+size_t copy_out(const std::string &bs, char **dst) {
+    *dst = (char *)calloc(bs.size(), sizeof(char));
+    std::memcpy(*dst, bs.data(), bs.size());
+    return bs.size();
+}
+
+/**
+ * The NUL-terminated text field at ptr, or the rest of src if it's
+ * the last one, moving ptr past it
+ */
+StringView next_field(const char *src, size_t len, size_t &ptr,
+                      const char *what) {
+    if (ptr > len) {
+        throw std::runtime_error(std::string("unexpected size (deserializing ") +
+                                 what + ")");
+    }
+    auto end = (const char *)std::memchr(src + ptr, 0, len - ptr);
+    StringView field{src + ptr, end == nullptr ? len - ptr
+                                               : (size_t)(end - src - ptr)};
+    ptr += field.len + 1;
+    return field;
+}
+
+IdView::IdView() : unpacked(), data(nullptr), len(0) {}
+void IdView::read(const char *src, size_t len, size_t &ptr) {
+    data = helper::read_id(src, len, ptr, unpacked, this->len);
+    if (data == unpacked) {
+        // copies of the view must see their own
+        data = nullptr;
+    }
+}
+void IdView::assign(StringView text) {
+    data = text.data;
+    len = text.len;
+}
+StringView IdView::get() const {
+    return {data == nullptr ? unpacked : data, len};
+}
+std::string IdView::str() const { return get().str(); }
+
 bool Entity::operator==(const Entity &other) const {
     return other.get_id() == get_id();
 }
 Entity *Entity::deserialize(
     char *src, size_t len,
     const std::function<Entity *(const std::string &)> &getter) {
-    auto bsid = (BSID)src[0];
+    auto bsid = read_bsid(src, len);
     switch (bsid) {
     case BSID::ENTY_USR:
         return User::deserialize(src, len);
@@ -36,7 +118,10 @@ Entity *Entity::deserialize(
 Server::~Server() = default;
 Server::Server() = default;
 std::string Server::get_id() const { return "zGuEzyj3EUyeSKAvHw3Zo"; }
-size_t Server::serialize(char **dst) const {
+size_t Server::serialize(char **dst, WireFormat format) const {
+    if (format == WIRE_BINARY_V1) {
+        return copy_out({wire_binary_v1, (char)BSID::ENTY_SRV}, dst);
+    }
     auto id = get_id();
     *dst = (char *)calloc(id.length() + 2, sizeof(char));
     (*dst)[0] = BSID::ENTY_SRV;
@@ -52,7 +137,15 @@ std::string User::get_id() const { return id; }
 std::string User::get_name() const { return name; }
 std::string User::get_bio() const { return bio; }
 time_t User::get_registration_time() const { return registration_time; }
-size_t User::serialize(char **dst) const {
+size_t User::serialize(char **dst, WireFormat format) const {
+    if (format == WIRE_BINARY_V1) {
+        std::string bs{wire_binary_v1, (char)BSID::ENTY_USR};
+        append_id(bs, id);
+        append_string(bs, name);
+        append_string(bs, bio);
+        append_time(bs, registration_time);
+        return copy_out(bs, dst);
+    }
     auto reg_time = to_iso_time(registration_time);
     auto len =
         id.length() + name.length() + bio.length() + reg_time.length() + 5;
@@ -70,12 +163,29 @@ User *User::deserialize(char *src, size_t len) {
     if (len <= 0) {
         return nullptr;
     }
-    fail_if_bsid_not(BSID::ENTY_USR, (BSID)src[0]);
-    auto args = read_message_body(src + 1, len - 1);
-    if (args.size() != 4) {
-        throw std::runtime_error("unexpected size (deserializing User)");
+    return UserView(src, len).materialize();
+}
+
+UserView::UserView(const char *src, size_t len) {
+    fail_if_bsid_not(BSID::ENTY_USR, read_bsid(src, len));
+    if (is_versioned(src, len)) {
+        size_t ptr = 2;
+        id.read(src, len, ptr);
+        name.data = read_string(src, len, ptr, name.len);
+        bio.data = read_string(src, len, ptr, bio.len);
+        registration_time = read_time(src, len, ptr);
+    } else {
+        size_t ptr = 1;
+        const char *what = "User";
+        id.assign(next_field(src, len, ptr, what));
+        name = next_field(src, len, ptr, what);
+        bio = next_field(src, len, ptr, what);
+        registration_time =
+            parse_iso_time(next_field(src, len, ptr, what).str());
     }
-    return new User(args[0], args[1], args[2], parse_iso_time(args[3]));
+}
+User *UserView::materialize() const {
+    return new User(id.str(), name.str(), bio.str(), registration_time);
 }
 
 Group::Group(const std::string &id, const std::string &name,
@@ -84,7 +194,17 @@ Group::Group(const std::string &id, const std::string &name,
 std::string Group::get_name() { return name; }
 std::string Group::get_id() const { return id; }
 std::vector<Entity *> &Group::get_members() { return members; }
-size_t Group::serialize(char **dst) const {
+size_t Group::serialize(char **dst, WireFormat format) const {
+    if (format == WIRE_BINARY_V1) {
+        std::string bs{wire_binary_v1, (char)BSID::ENTY_GRP};
+        append_id(bs, id);
+        append_string(bs, name);
+        append_varint(bs, members.size());
+        for (auto e : members) {
+            append_id(bs, e->get_id());
+        }
+        return copy_out(bs, dst);
+    }
     auto len = name.length() + id.length() + members.size() + 3;
     len += std::accumulate(
         members.begin(), members.end(), 0,
@@ -107,7 +227,19 @@ Group::deserialize(char *src, size_t len,
     if (len <= 0) {
         return nullptr;
     }
-    fail_if_bsid_not(BSID::ENTY_GRP, (BSID)src[0]);
+    fail_if_bsid_not(BSID::ENTY_GRP, read_bsid(src, len));
+    if (is_versioned(src, len)) {
+        size_t ptr = 2;
+        std::string id, name, mid;
+        read_id(src, len, ptr, id);
+        read_string(src, len, ptr, name);
+        std::vector<Entity *> members;
+        for (auto n = read_varint(src, len, ptr); n > 0; n--) {
+            read_id(src, len, ptr, mid);
+            members.push_back(getter(mid));
+        }
+        return new Group(id, name, members);
+    }
     auto args = read_message_body(src + 1, len - 1);
     if (args.size() < 2) {
         throw std::runtime_error("unexpected size (deserializing Group)");
@@ -122,7 +254,13 @@ TextFrame::TextFrame(std::string id, std::string content)
     : id(std::move(id)), content(std::move(content)) {}
 std::string TextFrame::get_id() const { return id; }
 std::string TextFrame::to_string() const { return content; }
-size_t TextFrame::serialize(char **dst) const {
+size_t TextFrame::serialize(char **dst, WireFormat format) const {
+    if (format == WIRE_BINARY_V1) {
+        std::string bs{wire_binary_v1, (char)BSID::FRM_TXT};
+        append_id(bs, id);
+        append_string(bs, content);
+        return copy_out(bs, dst);
+    }
     auto len = id.length() + content.length() + 3;
     *dst = (char *)calloc(len, sizeof(char));
     (*dst)[0] = BSID::FRM_TXT;
@@ -134,12 +272,23 @@ TextFrame *TextFrame::deserialize(char *src, size_t len) {
     if (len <= 0) {
         return nullptr;
     }
-    fail_if_bsid_not(BSID::FRM_TXT, (BSID)src[0]);
-    auto args = read_message_body(src + 1, len - 1);
-    if (args.size() != 2) {
-        throw std::runtime_error("unexpected size (deserializing TextFrame)");
+    return TextFrameView(src, len).materialize();
+}
+
+TextFrameView::TextFrameView(const char *src, size_t len) {
+    fail_if_bsid_not(BSID::FRM_TXT, read_bsid(src, len));
+    if (is_versioned(src, len)) {
+        size_t ptr = 2;
+        id.read(src, len, ptr);
+        content.data = read_string(src, len, ptr, content.len);
+    } else {
+        size_t ptr = 1;
+        id.assign(next_field(src, len, ptr, "TextFrame"));
+        content = next_field(src, len, ptr, "TextFrame");
     }
-    return new TextFrame(args[0], args[1]);
+}
+TextFrame *TextFrameView::materialize() const {
+    return new TextFrame(id.str(), content.str());
 }
 
 Message::Message(const std::string &id, const std::vector<Frame *> &content,
@@ -151,6 +300,7 @@ const std::vector<Frame *> &Message::get_frames() const { return frames; }
 std::string Message::get_id() const { return id; }
 Entity *Message::get_sender() const { return sender; }
 Entity *Message::get_receiver() const { return receiver; }
+void Message::set_receiver(Entity *receiver) { this->receiver = receiver; }
 Entity *Message::get_forward_source() const { return forwarded_from; }
 std::time_t Message::get_time() const { return time; }
 bool Message::is_visible_by(const ti::Entity *entity) {
@@ -165,7 +315,7 @@ bool Message::is_visible_by(const ti::Entity *entity) {
     }
     return false;
 }
-std::vector<User *> Message::get_all_receivers() {
+std::vector<User *> Message::get_all_receivers() const {
     std::vector<User *> targets;
     if (auto *u = dynamic_cast<User *>(receiver)) {
         targets.push_back(u);
@@ -178,7 +328,20 @@ std::vector<User *> Message::get_all_receivers() {
     }
     return targets;
 }
-size_t Message::serialize(char **dst) const {
+size_t Message::serialize(char **dst, WireFormat format) const {
+    if (format == WIRE_BINARY_V1) {
+        std::string bs{wire_binary_v1};
+        append_id(bs, id);
+        append_varint(bs, frames.size());
+        for (auto frame : frames) {
+            append_id(bs, frame->get_id());
+        }
+        append_id(bs, sender->get_id());
+        append_id(bs, receiver->get_id());
+        append_id(bs, forwarded_from == nullptr ? "" : forwarded_from->get_id());
+        append_time(bs, time);
+        return copy_out(bs, dst);
+    }
     auto time_str = to_iso_time(time);
     auto forwardid = forwarded_from == nullptr ? "" : forwarded_from->get_id();
 
@@ -220,47 +383,216 @@ size_t Message::serialize(char **dst) const {
 Message *Message::deserialize(char *src, size_t len,
                               const std::vector<Frame *> &frames,
                               const std::vector<Entity *> &entities) {
-    int ptr = 0;
-    for (; ptr < len; ptr++) {
-        if (src[ptr] == 0) {
-            break;
-        }
+    return MessageView(src, len)
+        .materialize(
+            [&](StringView id) -> Frame * {
+                for (auto f : frames) {
+                    if (id == f->get_id()) {
+                        return f;
+                    }
+                }
+                return nullptr;
+            },
+            [&](StringView id) -> Entity * {
+                for (auto e : entities) {
+                    if (e != nullptr && id == e->get_id()) {
+                        return e;
+                    }
+                }
+                return nullptr;
+            });
+}
+
+void Message::serialize_with_frames(std::string &dst,
+                                    WireFormat format) const {
+    append_block(dst, frames.size());
+    for (auto f : frames) {
+        char *bs;
+        auto n = f->serialize(&bs, format);
+        append_block(dst, n, bs);
+        delete bs;
     }
-    std::string id(src, src + ptr);
-    ptr++;
-    auto frame_count = read_len_header(src + ptr);
-    std::vector<Frame *> content(frame_count);
-    ptr += BYTES_LEN_HEADER;
-    auto preptr = ptr;
-    for (int i = 0; i < frame_count; ++i) {
-        for (; ptr < len; ptr++) {
-            if (src[ptr] == 0) {
-                break;
+    char *bs;
+    auto n = serialize(&bs, format);
+    append_block(dst, n, bs);
+    delete bs;
+}
+
+Message *Message::deserialize_with_frames(
+    const char *src, size_t len,
+    const std::function<Entity *(StringView)> &entity) {
+    std::vector<Frame *> frames;
+    try {
+        size_t ptr = 0;
+        for (auto n = read_len_header(src, len, ptr); n > 0; n--) {
+            auto flen = read_len_header(src, len, ptr);
+            if (flen > len - ptr) {
+                throw std::runtime_error("truncated block");
             }
+            frames.push_back(TextFrameView(src + ptr, flen).materialize());
+            ptr += flen;
         }
-        std::string cid(src + preptr, src + ptr);
-        content[i] = *get_entity_in(frames.begin(), frames.end(), cid);
-        if (content[i] == nullptr) {
-            throw std::runtime_error("no such frame (deserializing Message)");
+        auto mlen = read_len_header(src, len, ptr);
+        if (mlen > len - ptr) {
+            throw std::runtime_error("truncated block");
+        }
+        MessageView view(src + ptr, mlen);
+        if (view.frame_count != frames.size()) {
+            throw std::runtime_error("frames don't match (deserializing "
+                                     "Message)");
+        }
+        return view.materialize(
+            [&](StringView id) -> Frame * {
+                for (auto f : frames) {
+                    if (id == f->get_id()) {
+                        return f;
+                    }
+                }
+                return nullptr;
+            },
+            entity);
+    } catch (const std::runtime_error &e) {
+        for (auto f : frames) {
+            delete f;
+        }
+        throw;
+    }
+}
+
+MessageView::MessageView(const char *src, size_t len)
+    : src(src), len(len), versioned(is_versioned(src, len)) {
+    const char *what = "Message";
+    size_t ptr;
+    if (versioned) {
+        ptr = 1;
+        id.read(src, len, ptr);
+        frame_count = read_varint(src, len, ptr);
+        frames_at = ptr;
+        IdView skipped;
+        for (size_t i = 0; i < frame_count; ++i) {
+            skipped.read(src, len, ptr);
+        }
+        sender.read(src, len, ptr);
+        receiver.read(src, len, ptr);
+        forward_source.read(src, len, ptr);
+        time = read_time(src, len, ptr);
+    } else {
+        ptr = 0;
+        id.assign(next_field(src, len, ptr, what));
+        frame_count = read_len_header(src, len, ptr);
+        frames_at = ptr;
+        for (size_t i = 0; i < frame_count; ++i) {
+            next_field(src, len, ptr, what);
+        }
+        sender.assign(next_field(src, len, ptr, what));
+        receiver.assign(next_field(src, len, ptr, what));
+        forward_source.assign(next_field(src, len, ptr, what));
+        time = parse_iso_time(next_field(src, len, ptr, what).str());
+    }
+}
+void MessageView::for_each_frame(
+    const std::function<void(StringView)> &fn) const {
+    size_t ptr = frames_at;
+    IdView frame;
+    for (size_t i = 0; i < frame_count; ++i) {
+        if (versioned) {
+            frame.read(src, len, ptr);
+        } else {
+            frame.assign(next_field(src, len, ptr, "Message"));
         }
-        preptr = ++ptr;
+        fn(frame.get());
     }
+}
+Message *MessageView::materialize(
+    const std::function<Frame *(StringView)> &frame,
+    const std::function<Entity *(StringView)> &entity) const {
+    std::vector<Frame *> content;
+    content.reserve(frame_count);
+    for_each_frame([&](StringView fid) {
+        auto f = frame(fid);
+        if (f == nullptr) {
+            throw std::runtime_error("no such frame (deserializing Message)");
+        }
+        content.push_back(f);
+    });
+    auto resolve = [&](const IdView &eid) {
+        auto e = entity(eid.get());
+        if (e == nullptr) {
+            throw std::runtime_error("no such entity (deserializing Message)");
+        }
+        return e;
+    };
+    return new Message(id.str(), content, time, resolve(sender),
+                       resolve(receiver),
+                       forward_source.get().len == 0 ? nullptr
+                                                     : resolve(forward_source));
+}
 
-    auto args = read_message_body(src + ptr, len - ptr);
-    if (args.size() != 4) {
-        throw std::runtime_error("unexpected size (deserializing Message)");
+StatementCache::StatementCache(size_t capacity)
+    : capacity(capacity), entries(), index(), hits(0), misses(0),
+      closed(false) {}
+StatementCache::~StatementCache() { close(); }
+sqlite3_stmt *StatementCache::take(const std::string &expr) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto find = index.find(expr);
+    if (find == index.end()) {
+        misses++;
+        return nullptr;
     }
-    return new Message(
-        id, content, parse_iso_time(args[3]),
-        *get_entity_in(entities.begin(), entities.end(), args[0]),
-        *get_entity_in(entities.begin(), entities.end(), args[1]),
-        args[2].length() <= 0
-            ? nullptr
-            : *get_entity_in(entities.begin(), entities.end(), args[2]));
+    hits++;
+    auto handle = find->second->second;
+    entries.erase(find->second);
+    index.erase(find);
+    return handle;
+}
+void StatementCache::put(const std::string &expr, sqlite3_stmt *handle) {
+    std::unique_lock<std::mutex> lock(mtx);
+    if (closed || capacity == 0 || index.count(expr) > 0) {
+        // one spare statement per SQL text is enough
+        lock.unlock();
+        sqlite3_finalize(handle);
+        return;
+    }
+    entries.emplace_front(expr, handle);
+    index[expr] = entries.begin();
+    if (entries.size() > capacity) {
+        auto evicted = entries.back();
+        index.erase(evicted.first);
+        entries.pop_back();
+        lock.unlock();
+        sqlite3_finalize(evicted.second);
+    }
+}
+void StatementCache::close() {
+    std::lock_guard<std::mutex> lock(mtx);
+    closed = true;
+    for (auto &e : entries) {
+        sqlite3_finalize(e.second);
+    }
+    entries.clear();
+    index.clear();
+}
+size_t StatementCache::get_hits() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return hits;
+}
+size_t StatementCache::get_misses() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return misses;
 }
 
-SqlTransaction::SqlTransaction(const std::string &expr, sqlite3 *db)
-    : closed(false), pending_str() {
+SqlTransaction::SqlTransaction(const std::string &expr, sqlite3 *db,
+                               std::shared_ptr<StatementCache> cache,
+                               std::function<void()> release)
+    : closed(false), pending_str(), cache(std::move(cache)),
+      release(std::move(release)) {
+    if (this->cache != nullptr) {
+        this->expr = expr;
+        handle = this->cache->take(expr);
+        if (handle != nullptr) {
+            return;
+        }
+    }
     int n =
         sqlite3_prepare_v2(db, expr.c_str(), expr.length(), &handle, nullptr);
     if (n != SQLITE_OK) {
@@ -304,11 +636,20 @@ SqlTransaction::RowIterator SqlTransaction::end() {
 }
 void SqlTransaction::close() {
     if (!closed) {
-        sqlite3_finalize(handle);
+        if (cache != nullptr) {
+            sqlite3_reset(handle);
+            sqlite3_clear_bindings(handle);
+            cache->put(expr, handle);
+        } else {
+            sqlite3_finalize(handle);
+        }
         closed = true;
         for (auto ptr : pending_str) {
             delete ptr;
         }
+        if (release != nullptr) {
+            release();
+        }
     }
 }
 
@@ -368,18 +709,93 @@ std::string Row::get_text(int col) const {
     return {(const char *)s};
 }
 
-SqlDatabase::SqlDatabase(const std::string &dbfile) : is_cpy(false) {
+// the pragmas every connection is opened with
+static void apply_pragmas(sqlite3 *db, const SqlOptions &options) {
+    auto expr = "PRAGMA mmap_size = " + std::to_string(options.mmap_size) +
+                "; PRAGMA cache_size = " + std::to_string(options.cache_size);
+    char *err;
+    if (sqlite3_exec(db, expr.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
+        auto m = std::string(err);
+        sqlite3_free(err);
+        throw std::runtime_error(m);
+    }
+}
+SqlDatabase::SqlDatabase(const std::string &dbfile, const SqlOptions &options)
+    : is_cpy(false), statements(std::make_shared<StatementCache>(
+                         SQL_STATEMENT_CACHE_SIZE)),
+      writes(std::make_shared<WriteQueue>()),
+      readers(std::make_shared<ReaderPool>()) {
     int n = sqlite3_open(dbfile.c_str(), &dbhandle);
     if (n != SQLITE_OK) {
+        sqlite3_close(dbhandle);
         throw std::runtime_error("failed to open database");
     }
+    try {
+        apply_pragmas(dbhandle, options);
+        exec_sql("PRAGMA synchronous = " + options.synchronous);
+        open_readers(options);
+    } catch (...) {
+        for (auto r : readers->all) {
+            sqlite3_close(r->handle);
+            delete r;
+        }
+        sqlite3_close(dbhandle);
+        throw;
+    }
 }
-SqlDatabase::SqlDatabase(const ti::orm::SqlDatabase &h) : is_cpy(true) {
+void SqlDatabase::open_readers(const SqlOptions &options) {
+    auto file = sqlite3_db_filename(dbhandle, "main");
+    if (options.readers == 0 || file == nullptr || *file == '\0') {
+        // an in-memory database lives on its one connection
+        return;
+    }
+    char *err = nullptr;
+    sqlite3_exec(dbhandle, "PRAGMA journal_mode = WAL", nullptr, nullptr, &err);
+    if (err != nullptr) {
+        auto m = std::string(err);
+        sqlite3_free(err);
+        throw std::runtime_error(m);
+    }
+    for (size_t i = 0; i < options.readers; ++i) {
+        sqlite3 *handle;
+        // a reader is only used by the thread it is lent to
+        int n = sqlite3_open_v2(file, &handle,
+                                SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX,
+                                nullptr);
+        if (n != SQLITE_OK) {
+            sqlite3_close(handle);
+            throw std::runtime_error("failed to open database reader");
+        }
+        auto r = new ReaderPool::Reader{
+            handle,
+            std::make_shared<StatementCache>(SQL_STATEMENT_CACHE_SIZE)};
+        readers->all.push_back(r);
+        readers->idle.push_back(r);
+        sqlite3_busy_timeout(handle, SQL_BUSY_TIMEOUT_MS);
+        apply_pragmas(handle, options);
+        if (sqlite3_exec(handle, "PRAGMA query_only = 1", nullptr, nullptr,
+                         nullptr) != SQLITE_OK) {
+            throw std::runtime_error("failed to open database reader");
+        }
+    }
+}
+SqlDatabase::SqlDatabase(const ti::orm::SqlDatabase &h)
+    : is_cpy(true), statements(h.statements), writes(h.writes),
+      readers(h.readers) {
     dbhandle = h.dbhandle;
 }
 SqlDatabase::~SqlDatabase() {
     if (!is_cpy) {
         logD("[sql helper] closing db handle");
+        set_group_commit(0);
+        for (auto r : readers->all) {
+            r->statements->close();
+            sqlite3_close(r->handle);
+            delete r;
+        }
+        readers->all.clear();
+        readers->idle.clear();
+        statements->close();
         sqlite3_close(dbhandle);
     }
 }
@@ -394,7 +810,148 @@ void SqlDatabase::exec_sql(const std::string &expr) const {
 }
 int SqlDatabase::get_changes() const { return sqlite3_changes(dbhandle); }
 SqlTransaction *SqlDatabase::prepare(const std::string &expr) const {
-    return new SqlTransaction(expr, dbhandle);
+    return new SqlTransaction(expr, dbhandle, statements);
+}
+SqlTransaction *SqlDatabase::prepare_read(const std::string &expr) const {
+    if (transacting == dbhandle) {
+        // what this thread wrote so far is only seen on the writer
+        return prepare(expr);
+    }
+    ReaderPool::Reader *r;
+    {
+        std::lock_guard<std::mutex> lock(readers->mtx);
+        if (readers->idle.empty()) {
+            return prepare(expr);
+        }
+        r = readers->idle.back();
+        readers->idle.pop_back();
+    }
+    auto pool = readers;
+    auto release = [pool, r] {
+        std::lock_guard<std::mutex> lock(pool->mtx);
+        pool->idle.push_back(r);
+    };
+    try {
+        return new SqlTransaction(expr, r->handle, r->statements, release);
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+size_t SqlDatabase::get_reader_count() const {
+    std::lock_guard<std::mutex> lock(readers->mtx);
+    return readers->all.size();
+}
+size_t SqlDatabase::get_statement_hits() const {
+    return statements->get_hits();
+}
+size_t SqlDatabase::get_statement_misses() const {
+    return statements->get_misses();
+}
+void SqlDatabase::transaction(const std::function<void()> &fn) const {
+    if (transacting == dbhandle) {
+        fn();
+        return;
+    }
+    std::lock_guard<std::mutex> lock(writes->txmtx);
+    exec_sql("BEGIN");
+    transacting = dbhandle;
+    try {
+        fn();
+        exec_sql("COMMIT");
+    } catch (...) {
+        transacting = nullptr;
+        // a failed COMMIT may leave the transaction open, or may have
+        // rolled it back already
+        if (!sqlite3_get_autocommit(dbhandle)) {
+            sqlite3_exec(dbhandle, "ROLLBACK", nullptr, nullptr, nullptr);
+        }
+        throw;
+    }
+    transacting = nullptr;
+}
+void SqlDatabase::write(const std::function<void()> &fn) const {
+    std::future<void> done;
+    {
+        std::lock_guard<std::mutex> lock(writes->mtx);
+        if (!writes->running || transacting == dbhandle) {
+            done = std::future<void>();
+        } else {
+            writes->pending.push_back({fn, std::promise<void>()});
+            done = writes->pending.back().done.get_future();
+        }
+    }
+    if (!done.valid()) {
+        transaction(fn);
+        return;
+    }
+    writes->cv.notify_all();
+    done.get();
+}
+void SqlDatabase::set_group_commit(unsigned window_ms, size_t max_batch) {
+    {
+        std::lock_guard<std::mutex> lock(writes->mtx);
+        writes->window_ms = window_ms;
+        writes->max_batch = std::max<size_t>(max_batch, 1);
+        if (writes->running == (window_ms > 0)) {
+            return;
+        }
+        writes->running = window_ms > 0;
+    }
+    if (window_ms > 0) {
+        writes->committer = std::thread([this] { commit_loop(); });
+    } else {
+        writes->cv.notify_all();
+        writes->committer.join();
+    }
+}
+void SqlDatabase::commit_loop() const {
+    auto &q = *writes;
+    while (true) {
+        std::vector<WriteQueue::Write> batch;
+        {
+            std::unique_lock<std::mutex> lock(q.mtx);
+            q.cv.wait(lock, [&] { return !q.pending.empty() || !q.running; });
+            if (q.pending.empty()) {
+                return;
+            }
+            // give the other writers a moment to join in
+            q.cv.wait_for(lock, std::chrono::milliseconds(q.window_ms), [&] {
+                return q.pending.size() >= q.max_batch || !q.running;
+            });
+            auto n = std::min(q.pending.size(), q.max_batch);
+            std::move(q.pending.begin(), q.pending.begin() + n,
+                      std::back_inserter(batch));
+            q.pending.erase(q.pending.begin(), q.pending.begin() + n);
+        }
+
+        std::vector<std::exception_ptr> errors(batch.size());
+        try {
+            transaction([&] {
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    // a failing write mustn't take the others with it
+                    exec_sql("SAVEPOINT write");
+                    try {
+                        batch[i].fn();
+                        exec_sql("RELEASE write");
+                    } catch (...) {
+                        errors[i] = std::current_exception();
+                        exec_sql("ROLLBACK TO write");
+                        exec_sql("RELEASE write");
+                    }
+                }
+            });
+        } catch (...) {
+            std::fill(errors.begin(), errors.end(), std::current_exception());
+        }
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (errors[i] != nullptr) {
+                batch[i].done.set_exception(errors[i]);
+            } else {
+                batch[i].done.set_value();
+            }
+        }
+    }
 }
 void SqlDatabase::initialize() { sqlite3_initialize(); }
 void SqlDatabase::shutdown() { sqlite3_shutdown(); }
@@ -404,32 +961,43 @@ Sync::Sync(ti::orm::SqlDatabase *db, ti::User *owner)
       destroyed(new bool{false}) {}
 Sync::~Sync() {
     *destroyed = true;
-    mh->len = 0;
-    ch->len = 0;
-    delete mh;
-    delete ch;
+    for (auto h : {mh, ch}) {
+        if (h != nullptr) {
+            delete h->hash;
+            delete h;
+        }
+    }
     for (auto t : pending) {
         delete t;
     }
 }
+ByteArray *read_sync_hash(SqlDatabase *db, const User *owner,
+                          const std::string &field) {
+    auto t = db->prepare_read(
+        R"(SELECT hash FROM "sync_bucket" WHERE user_id = ? AND field = ?)");
+    t->bind_text(0, owner->get_id());
+    t->bind_text(1, field);
+    auto h = new ByteArray{SYNC_DIGEST_LEN,
+                           (char *)calloc(SYNC_DIGEST_LEN, sizeof(char))};
+    for (auto row : *t) {
+        char *bucket;
+        row.get_blob(0, (void **)&bucket);
+        for (int i = 0; i < SYNC_DIGEST_LEN; ++i) {
+            h->hash[i] ^= bucket[i];
+        }
+    }
+    delete t;
+    return h;
+}
 const ByteArray *Sync::get_messages_hash() {
     if (*destroyed) {
         throw std::domain_error(
             "This sync has been destroyed. It is probably copied from "
             "something else, which has been deconstructed.");
     }
-    if (mh != nullptr) {
-        return mh;
+    if (mh == nullptr) {
+        mh = read_sync_hash(db, owner, "messages");
     }
-    auto t = db->prepare(R"(SELECT messages from "sync" WHERE user_id = ?)");
-    pending.push_back(t);
-    t->bind_text(0, owner->get_id());
-    char *buf;
-    size_t len = 0;
-    for (auto row : *t) {
-        len = row.get_blob(0, (void **)&buf);
-    }
-    mh = new ByteArray{len, buf};
     return mh;
 }
 const ByteArray *Sync::get_contacts_hash() {
@@ -438,29 +1006,30 @@ const ByteArray *Sync::get_contacts_hash() {
             "This sync has been destroyed. It is probably copied from "
             "something else, which has been deconstructed.");
     }
-    if (mh != nullptr) {
-        return mh;
-    }
-    auto t = db->prepare(R"(SELECT messages from "sync" WHERE user_id = ?)");
-    pending.push_back(t);
-    t->bind_text(0, owner->get_id());
-    char *buf;
-    size_t len = 0;
-    for (auto row : *t) {
-        len = row.get_blob(0, (void **)&buf);
+    if (ch == nullptr) {
+        ch = read_sync_hash(db, owner, "contacts");
     }
-    mh = (ByteArray *)malloc(sizeof(ByteArray));
-    mh->hash = buf;
-    mh->len = len;
-    return mh;
+    return ch;
 }
 
-TiOrm::TiOrm(const ti::orm::TiOrm &t) : SqlDatabase(t) {
-    entities = t.entities;
-    frames = t.frames;
-    messages = t.messages;
+TiOrm::TiOrm(const ti::orm::TiOrm &t)
+    : SqlDatabase(t), epoch(0), cache_limit(t.cache_limit), stats(),
+      cache_version(0) {
+    // cached objects belong to the cache they were loaded into,
+    // and in lazy mode the shards don't hold any others
+    for (size_t i = 0; i < ORM_SHARD_COUNT; ++i) {
+        std::shared_lock<std::shared_timed_mutex> lock(t.shards[i].mtx);
+        shards[i].entities = t.shards[i].entities;
+        shards[i].frames = t.shards[i].frames;
+        shards[i].messages = t.shards[i].messages;
+        shards[i].contacts = t.shards[i].contacts;
+        shards[i].inboxes = t.shards[i].inboxes;
+        shards[i].members = t.shards[i].members;
+    }
 }
-TiOrm::TiOrm(const std::string &dbfile) : SqlDatabase(dbfile) {
+TiOrm::TiOrm(const std::string &dbfile, const SqlOptions &options)
+    : SqlDatabase(dbfile, options), epoch(0), cache_limit(0), stats(),
+      cache_version(0) {
     logD("[orm] executing initializing SQL");
     exec_sql(R"(CREATE TABLE IF NOT EXISTS "user"
 (
@@ -503,12 +1072,35 @@ CREATE TABLE IF NOT EXISTS "contact"
     owner_id   varchar(21) not null,
     contact_id varchar(21) not null
 );
-CREATE TABLE IF NOT EXISTS "sync"
+CREATE INDEX IF NOT EXISTS "box_container" ON "box" (container_id, id);
+CREATE INDEX IF NOT EXISTS "contact_owner" ON "contact" (owner_id, contact_id);
+CREATE INDEX IF NOT EXISTS "message_receiver" ON "message" (receiver_id);
+CREATE TABLE IF NOT EXISTS "sync_item"
 (
-    user_id  varchar(21) primary key,
-    messages blob,
-    contacts blob
+    user_id   varchar(21) not null,
+    field     varchar     not null,
+    digest    blob        not null,
+    object_id varchar(21) not null,
+    primary key (user_id, field, digest)
 );
+CREATE TABLE IF NOT EXISTS "sync_bucket"
+(
+    user_id varchar(21) not null,
+    field   varchar     not null,
+    bucket  integer     not null,
+    count   integer     not null,
+    hash    blob        not null,
+    primary key (user_id, field, bucket)
+);
+CREATE TABLE IF NOT EXISTS "change"
+(
+    seq       integer primary key autoincrement,
+    user_id   varchar(21) not null,
+    field     varchar     not null,
+    op        char(1)     not null,
+    object_id varchar(21) not null
+);
+CREATE INDEX IF NOT EXISTS "change_user" ON "change" (user_id, field, seq);
 )");
 }
 void TiOrm::pull() {
@@ -516,83 +1108,139 @@ void TiOrm::pull() {
 
     auto t = prepare(R"(SELECT * FROM "user")");
     for (auto row : *t) {
-        entities.push_back(new User(row.get_text(0), row.get_text(1),
-                                    row.get_text(2),
-                                    parse_iso_time(row.get_text(3))));
+        auto u = new User(row.get_text(0), row.get_text(1), row.get_text(2),
+                          parse_iso_time(row.get_text(3)));
+        shard_of(u->get_id()).entities[u->get_id()] = u;
     }
     delete t;
 
-    t = prepare(R"(SELECT id, name FROM "group")");
+    // group members and message frames, in insertion order
+    std::unordered_map<std::string, std::vector<std::string>> boxes;
+    t = prepare(
+        is_lazy()
+            ? R"(SELECT container_id, contained_id FROM "box" WHERE container_id IN (SELECT id FROM "group") ORDER BY container_id, id)"
+            : R"(SELECT container_id, contained_id FROM "box" ORDER BY container_id, id)");
     for (auto row : *t) {
-        auto tr = prepare(
-            R"(SELECT "contained_id" FROM "box" WHERE container_id = ?)");
-        tr->bind_text(0, row.get_text(0));
-        std::vector<Entity *> members;
-        std::transform(tr->begin(), tr->end(), std::back_inserter(members),
-                       [&](Row r) {
-                           return *get_entity_in(entities.begin(),
-                                                 entities.end(), r.get_text(0));
-                       });
-        entities.push_back(
-            new Group(row.get_text(0), row.get_text(1), members));
+        boxes[row.get_text(0)].push_back(row.get_text(1));
     }
     delete t;
 
-    t = prepare(R"(SELECT * FROM "text_frame")");
+    // all groups first, since one may be a member of another
+    std::vector<Group *> groups;
+    t = prepare(R"(SELECT id, name FROM "group")");
     for (auto row : *t) {
-        frames.push_back(new TextFrame(row.get_text(0), row.get_text(1)));
+        auto g = new Group(row.get_text(0), row.get_text(1), {});
+        shard_of(g->get_id()).entities[g->get_id()] = g;
+        groups.push_back(g);
     }
     delete t;
+    for (auto g : groups) {
+        for (const auto &id : boxes[g->get_id()]) {
+            if (auto e = get_entity(id)) {
+                g->get_members().push_back(e);
+            }
+        }
+        index_group(shard_of(g->get_id()), g);
+    }
 
-    t = prepare(R"(SELECT * FROM "message")");
-    for (auto row : *t) {
-        std::vector<Frame *> content;
-        auto tr = prepare(
-            R"(SELECT contained_id FROM "box" WHERE container_id = ? ORDER BY id)");
-        tr->bind_text(0, row.get_text(0));
-        std::transform(tr->begin(), tr->end(), std::back_inserter(content),
-                       [&](Row r) {
-                           return *get_entity_in(frames.begin(), frames.end(),
-                                                 r.get_text(0));
-                       });
-        delete tr;
-        messages.push_back(new Message(
-            row.get_text(0), content, parse_iso_time(row.get_text(1)),
-            *get_entity_in(entities.begin(), entities.end(), row.get_text(2)),
-            *get_entity_in(entities.begin(), entities.end(), row.get_text(3)),
-            *get_entity_in(entities.begin(), entities.end(), row.get_text(4))));
+    if (!is_lazy()) {
+        t = prepare(R"(SELECT * FROM "text_frame")");
+        for (auto row : *t) {
+            auto f = new TextFrame(row.get_text(0), row.get_text(1));
+            shard_of(f->get_id()).frames[f->get_id()] = f;
+        }
+        delete t;
+
+        t = prepare(R"(SELECT * FROM "message")");
+        for (auto row : *t) {
+            std::vector<Frame *> content;
+            auto &ids = boxes[row.get_text(0)];
+            std::transform(
+                ids.begin(), ids.end(), std::back_inserter(content),
+                [&](const std::string &id) { return get_frame(id); });
+            auto m = new Message(row.get_text(0), content,
+                                 parse_iso_time(row.get_text(1)),
+                                 get_entity(row.get_text(2)),
+                                 get_entity(row.get_text(3)),
+                                 get_entity(row.get_text(4)));
+            shard_of(m->get_id()).messages[m->get_id()] = m;
+            index_message(m);
+        }
+        delete t;
     }
-    delete t;
 
-    t = prepare(R"(SELECT owner_id, contact_id FROM "contact")");
+    t = prepare(R"(SELECT owner_id, contact_id FROM "contact" ORDER BY id)");
     for (auto e : *t) {
-        contacts.emplace_back(
-            get_user(e.get_text(0)),
-            *get_entity_in(entities.begin(), entities.end(), e.get_text(1)));
+        auto owner = e.get_text(0);
+        shard_of(owner).contacts[owner].push_back(get_entity(e.get_text(1)));
     }
     delete t;
+
+    t = prepare(R"(SELECT EXISTS (SELECT 1 FROM "sync_item"))");
+    auto synced = (*t->begin()).get_int(0) > 0;
+    delete t;
+    if (!synced) {
+        // from before the sync trees were kept, or with nothing to sync
+        backfill_sync();
+    }
+}
+TiOrm::Shard &TiOrm::shard_of(const std::string &id) const {
+    return const_cast<Shard &>(
+        shards[std::hash<std::string>()(id) % ORM_SHARD_COUNT]);
 }
 void TiOrm::reset() {
-    for (auto e : entities) {
-        delete e;
+    for (auto &shard : shards) {
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+        for (const auto &e : shard.entities) {
+            delete e.second;
+        }
+        for (const auto &f : shard.frames) {
+            delete f.second;
+        }
+        for (const auto &m : shard.messages) {
+            delete m.second;
+        }
+        shard.entities.clear();
+        shard.frames.clear();
+        shard.messages.clear();
+        shard.contacts.clear();
+        shard.inboxes.clear();
+        shard.members.clear();
     }
-    for (auto f : frames) {
-        delete f;
+    {
+        std::lock_guard<std::mutex> lock(retiredmtx);
+        for (const auto &r : retired) {
+            delete r.entity;
+        }
+        for (auto e : kept) {
+            delete e;
+        }
+        retired.clear();
+        kept.clear();
     }
-    for (auto m : messages) {
-        delete m;
+    {
+        std::lock_guard<std::mutex> lock(cachemtx);
+        while (!lru.empty()) {
+            cache_drop(lru.front());
+        }
+        for (auto &d : dropped) {
+            stats.pinned--;
+            cache_free(d.second);
+        }
+        dropped.clear();
     }
-    contacts.clear();
-    entities.clear();
-    frames.clear();
-    messages.clear();
+    frame_index.clear();
+    message_index.clear();
 }
 TiOrm::~TiOrm() { reset(); }
 std::vector<User *> TiOrm::get_users() const {
     std::vector<User *> users;
-    for (auto e : entities) {
-        if (User *u = dynamic_cast<User *>(e)) {
-            users.push_back(u);
+    for (auto &shard : shards) {
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+        for (const auto &e : shard.entities) {
+            if (User *u = dynamic_cast<User *>(e.second)) {
+                users.push_back(u);
+            }
         }
     }
     return users;
@@ -604,125 +1252,683 @@ User *TiOrm::get_user(const std::string &id) const {
     }
     return nullptr;
 }
-std::vector<Entity *> TiOrm::get_contacts(User *owner) const {
-    std::vector<Entity *> ev;
-    for (auto e : contacts) {
-        if (*e.first == *owner) {
-            ev.push_back(e.second);
+void TiOrm::index_group(Shard &shard, Group *group) {
+    auto &ids = shard.members[group->get_id()];
+    ids.clear();
+    for (auto m : group->get_members()) {
+        ids.insert(m->get_id());
+    }
+}
+void TiOrm::index_message(Message *msg) {
+    for (auto target : msg->get_all_receivers()) {
+        auto &shard = shard_of(target->get_id());
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+        shard.inboxes[target->get_id()].push_back(msg);
+    }
+}
+void TiOrm::unindex_message(Message *msg) {
+    for (auto target : msg->get_all_receivers()) {
+        auto &shard = shard_of(target->get_id());
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+        auto find = shard.inboxes.find(target->get_id());
+        if (find != shard.inboxes.end()) {
+            auto &inbox = find->second;
+            inbox.erase(std::remove(inbox.begin(), inbox.end(), msg),
+                        inbox.end());
         }
     }
-    return ev;
+}
+std::vector<Entity *> TiOrm::get_contacts(User *owner) const {
+    auto &shard = shard_of(owner->get_id());
+    std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+    auto find = shard.contacts.find(owner->get_id());
+    if (find == shard.contacts.end()) {
+        return {};
+    }
+    return find->second;
 }
 void TiOrm::update_sync(const User *owner, const std::string &addition,
                         std::string field) {
-    auto t = prepare("SELECT " + field + " FROM \"sync\" WHERE user_id = ?");
+    update_sync_tree(owner, addition, field);
+    auto t = prepare(
+        R"(INSERT INTO "change"(user_id, field, op, object_id) VALUES (?, ?, ?, ?))");
+    t->bind_text(0, owner->get_id());
+    t->bind_text(1, field);
+    t->bind_text(2, addition.substr(0, 1));
+    t->bind_text(3, addition.substr(1));
+    t->begin();
+    delete t;
+    t = prepare("SELECT last_insert_rowid()");
+    auto seq = (*t->begin()).get_int64(0);
+    delete t;
+    if (seq % CHANGE_COMPACT_EVERY == 0) {
+        compact_changelog(owner, CHANGE_RETENTION);
+    }
+}
+void TiOrm::update_sync_tree(const User *owner, const std::string &addition,
+                             const std::string &field) {
+    auto id = addition.substr(1);
+    bool removing = addition[0] == '-';
+    char digest[SYNC_DIGEST_LEN];
+    sync_digest(id, digest);
+    SqlTransaction *t;
+    if (removing) {
+        t = prepare(
+            R"(DELETE FROM "sync_item" WHERE user_id = ? AND field = ? AND digest = ?)");
+    } else {
+        t = prepare(R"(INSERT OR IGNORE INTO "sync_item" VALUES (?, ?, ?, ?))");
+        t->bind_text(3, id);
+    }
     t->bind_text(0, owner->get_id());
-    char *buf;
-    size_t len = 0;
+    t->bind_text(1, field);
+    t->bind_blob(2, digest, SYNC_DIGEST_LEN);
+    t->begin();
+    delete t;
+    if (get_changes() > 0) {
+        // adding and removing both flip the digest in its bucket
+        int bucket = (unsigned char)digest[0];
+        t = prepare(
+            R"(SELECT count, hash FROM "sync_bucket" WHERE user_id = ? AND field = ? AND bucket = ?)");
+        t->bind_text(0, owner->get_id());
+        t->bind_text(1, field);
+        t->bind_int(2, bucket);
+        long count = 0;
+        char hash[SYNC_DIGEST_LEN] = {};
+        for (auto row : *t) {
+            count = row.get_int64(0);
+            void *blob;
+            row.get_blob(1, &blob);
+            std::memcpy(hash, blob, SYNC_DIGEST_LEN);
+        }
+        delete t;
+        for (int i = 0; i < SYNC_DIGEST_LEN; ++i) {
+            hash[i] ^= digest[i];
+        }
+        t = prepare(
+            R"(INSERT OR REPLACE INTO "sync_bucket" VALUES (?, ?, ?, ?, ?))");
+        t->bind_text(0, owner->get_id());
+        t->bind_text(1, field);
+        t->bind_int(2, bucket);
+        t->bind_int64(3, count + (removing ? -1 : 1));
+        t->bind_blob(4, hash, SYNC_DIGEST_LEN);
+        t->begin();
+        delete t;
+    }
+}
+void TiOrm::backfill_sync() {
+    std::vector<std::pair<User *, std::string>> contacts, inboxed;
+    auto t =
+        prepare(R"(SELECT owner_id, contact_id FROM "contact" ORDER BY id)");
     for (auto row : *t) {
-        len = row.get_blob(0, (void **)&buf);
-        break;
+        if (auto owner = get_user(row.get_text(0))) {
+            contacts.emplace_back(owner, row.get_text(1));
+        }
     }
-    len = next_sync_hash(buf, len, addition, &buf);
     delete t;
-    t = prepare(R"(INSERT OR IGNORE INTO "sync"(user_id) VALUES (?))");
+    t = prepare(R"(SELECT id, receiver_id FROM "message" ORDER BY rowid)");
+    for (auto row : *t) {
+        auto id = row.get_text(0);
+        Message msg(id, {}, 0, nullptr, get_entity(row.get_text(1)), nullptr);
+        for (auto target : msg.get_all_receivers()) {
+            inboxed.emplace_back(target, id);
+        }
+    }
+    delete t;
+    if (contacts.empty() && inboxed.empty()) {
+        return;
+    }
+    logD("[orm] backfilling the sync trees");
+    // logged too, so a cursor taken from now on has a floor to meet
+    write([&] {
+        for (const auto &c : contacts) {
+            update_sync(c.first, "+" + c.second, "contacts");
+        }
+        for (const auto &m : inboxed) {
+            update_sync(m.first, "+" + m.second, "messages");
+        }
+    });
+}
+void TiOrm::compact_changelog(const User *owner, size_t keep) {
+    auto t = prepare(
+        R"(DELETE FROM "change" WHERE user_id = ?1 AND seq <= (SELECT seq FROM "change" WHERE user_id = ?1 ORDER BY seq DESC LIMIT 1 OFFSET ?2))");
     t->bind_text(0, owner->get_id());
+    t->bind_int64(1, keep);
     t->begin();
     delete t;
-    t = prepare("UPDATE \"sync\" SET " + field + " = ? WHERE user_id = ?");
-    t->bind_blob(0, buf, len);
-    t->bind_text(1, owner->get_id());
-    t->begin();
+}
+long TiOrm::get_changelog_floor(const User *owner) const {
+    auto t =
+        prepare_read(R"(SELECT min(seq) FROM "change" WHERE user_id = ?)");
+    t->bind_text(0, owner->get_id());
+    long seq = 0;
+    for (auto row : *t) {
+        seq = row.get_int64(0);
+    }
     delete t;
+    return seq;
 }
-void TiOrm::add_contact(User *owner, Entity *contact) {
-    contacts.emplace_back(owner, contact);
+long TiOrm::get_sync_seq(const User *owner) const {
     auto t =
-        prepare(R"(INSERT INTO "contact"(owner_id, contact_id) VALUES (?, ?))");
+        prepare_read(R"(SELECT max(seq) FROM "change" WHERE user_id = ?)");
     t->bind_text(0, owner->get_id());
-    t->bind_text(1, contact->get_id());
-    t->begin();
+    long seq = 0;
+    for (auto row : *t) {
+        seq = row.get_int64(0);
+    }
     delete t;
-    update_sync(owner, "+" + contact->get_id(), "contacts");
+    return seq;
 }
-bool TiOrm::delete_contact(ti::User *owner, ti::Entity *contact) {
-    auto find = std::find_if(contacts.begin(), contacts.end(),
-                             [&](auto p) { return p.first == contact; });
-    if (find == contacts.end()) {
-        return false;
+std::vector<Change> TiOrm::get_changelog(const User *owner,
+                                         const std::string &field,
+                                         long seq) const {
+    // the bare columns come from the row holding max(seq),
+    // so only the last change to each object is kept
+    auto t = prepare_read(
+        R"(SELECT op, object_id, max(seq) FROM "change" WHERE user_id = ? AND field = ? AND seq > ? GROUP BY object_id ORDER BY 3)");
+    t->bind_text(0, owner->get_id());
+    t->bind_text(1, field);
+    t->bind_int64(2, seq);
+    std::vector<Change> r;
+    for (auto row : *t) {
+        r.push_back(
+            {row.get_int64(2), row.get_text(0) == "-", row.get_text(1)});
     }
-    contacts.erase(find);
-    auto t = prepare(
-        R"(DELETE FROM "contact" WHERE owner_id = ? AND contact_id = ?)");
+    delete t;
+    return r;
+}
+// hex digit i of a digest
+int digest_nibble(const char *digest, size_t i) {
+    auto byte = (unsigned char)digest[i / 2];
+    return i % 2 == 0 ? byte >> 4 : byte & 0xf;
+}
+// digests from lo up to, but not including, hi start with prefix
+void digest_range(const std::string &prefix, std::string &lo,
+                  std::string &hi) {
+    if (prefix.length() >= SYNC_DIGEST_LEN * 2) {
+        throw std::runtime_error("sync tree prefix too long");
+    }
+    std::vector<int> nibbles;
+    for (auto c : prefix) {
+        if (c >= '0' && c <= '9') {
+            nibbles.push_back(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            nibbles.push_back(c - 'a' + 10);
+        } else {
+            throw std::runtime_error("sync tree prefix is not hex");
+        }
+    }
+    auto pack = [](const std::vector<int> &n) {
+        std::string bytes(SYNC_DIGEST_LEN, '\0');
+        for (size_t i = 0; i < n.size(); ++i) {
+            bytes[i / 2] |= (char)(i % 2 == 0 ? n[i] << 4 : n[i]);
+        }
+        return bytes;
+    };
+    lo = pack(nibbles);
+    int i = (int)nibbles.size() - 1;
+    for (; i >= 0 && nibbles[i] == 0xf; --i) {
+        nibbles[i] = 0;
+    }
+    if (i < 0) {
+        // nothing follows an all f prefix, but this sorts after any digest
+        hi = std::string(SYNC_DIGEST_LEN + 1, '\xff');
+    } else {
+        nibbles[i]++;
+        hi = pack(nibbles);
+    }
+}
+std::vector<SyncNode>
+TiOrm::get_sync_children(const User *owner, const std::string &field,
+                         const std::string &prefix) const {
+    std::string lo, hi;
+    digest_range(prefix, lo, hi);
+    std::vector<SyncNode> children(
+        SYNC_TREE_FANOUT, {0, std::string(SYNC_DIGEST_LEN, '\0')});
+    auto add = [&](int child, size_t count, const char *hash) {
+        children[child].count += count;
+        for (int i = 0; i < SYNC_DIGEST_LEN; ++i) {
+            children[child].hash[i] ^= hash[i];
+        }
+    };
+    SqlTransaction *t;
+    if (prefix.length() < 2) {
+        // the buckets already hold the first two levels
+        t = prepare_read(
+            R"(SELECT bucket, count, hash FROM "sync_bucket" WHERE user_id = ? AND field = ?)");
+        t->bind_text(0, owner->get_id());
+        t->bind_text(1, field);
+        for (auto row : *t) {
+            char bucket = (char)row.get_int(0);
+            if (prefix.empty() ||
+                digest_nibble(&bucket, 0) == digest_nibble(lo.data(), 0)) {
+                char *hash;
+                row.get_blob(2, (void **)&hash);
+                add(digest_nibble(&bucket, prefix.length()),
+                    row.get_int64(1), hash);
+            }
+        }
+    } else {
+        t = prepare_read(
+            R"(SELECT digest FROM "sync_item" WHERE user_id = ? AND field = ? AND digest >= ? AND digest < ?)");
+        t->bind_text(0, owner->get_id());
+        t->bind_text(1, field);
+        t->bind_blob(2, (void *)lo.data(), (int)lo.length());
+        t->bind_blob(3, (void *)hi.data(), (int)hi.length());
+        for (auto row : *t) {
+            char *digest;
+            row.get_blob(0, (void **)&digest);
+            add(digest_nibble(digest, prefix.length()), 1, digest);
+        }
+    }
+    delete t;
+    return children;
+}
+std::vector<std::string>
+TiOrm::get_sync_range(const User *owner, const std::string &field,
+                      const std::string &prefix) const {
+    std::string lo, hi;
+    digest_range(prefix, lo, hi);
+    auto t = prepare_read(
+        R"(SELECT object_id FROM "sync_item" WHERE user_id = ? AND field = ? AND digest >= ? AND digest < ? ORDER BY digest)");
     t->bind_text(0, owner->get_id());
-    t->bind_text(1, contact->get_id());
-    t->begin();
+    t->bind_text(1, field);
+    t->bind_blob(2, (void *)lo.data(), (int)lo.length());
+    t->bind_blob(3, (void *)hi.data(), (int)hi.length());
+    std::vector<std::string> ids;
+    for (auto row : *t) {
+        ids.push_back(row.get_text(0));
+    }
     delete t;
-    update_sync(owner, "-" + contact->get_id(), "contacts");
+    return ids;
+}
+void TiOrm::add_contact(User *owner, Entity *contact) {
+    {
+        auto &shard = shard_of(owner->get_id());
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+        shard.contacts[owner->get_id()].push_back(contact);
+    }
+    write([&] {
+        auto t = prepare(
+            R"(INSERT INTO "contact"(owner_id, contact_id) VALUES (?, ?))");
+        t->bind_text(0, owner->get_id());
+        t->bind_text(1, contact->get_id());
+        t->begin();
+        delete t;
+        update_sync(owner, "+" + contact->get_id(), "contacts");
+    });
+}
+bool TiOrm::delete_contact(ti::User *owner, ti::Entity *contact) {
+    {
+        auto &shard = shard_of(owner->get_id());
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+        auto owned = shard.contacts.find(owner->get_id());
+        if (owned == shard.contacts.end()) {
+            return false;
+        }
+        auto find =
+            std::find(owned->second.begin(), owned->second.end(), contact);
+        if (find == owned->second.end()) {
+            return false;
+        }
+        owned->second.erase(find);
+    }
+    write([&] {
+        auto t = prepare(
+            R"(DELETE FROM "contact" WHERE owner_id = ? AND contact_id = ?)");
+        t->bind_text(0, owner->get_id());
+        t->bind_text(1, contact->get_id());
+        t->begin();
+        delete t;
+        update_sync(owner, "-" + contact->get_id(), "contacts");
+    });
     return true;
 }
+// ids of the users among the members of a group
+static std::set<std::string> member_users(Group *group) {
+    std::set<std::string> ids;
+    for (auto m : group->get_members()) {
+        if (dynamic_cast<User *>(m) != nullptr) {
+            ids.insert(m->get_id());
+        }
+    }
+    return ids;
+}
 void TiOrm::add_entity(Entity *entity) {
-    auto replace = false;
-    for (auto &e : entities) {
-        if (e->get_id() == entity->get_id()) {
-            delete e;
-            e = entity;
-            replace = true;
-            break;
+    Entity *replaced;
+    {
+        auto &shard = shard_of(entity->get_id());
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+        auto &indexed = shard.entities[entity->get_id()];
+        replaced = indexed;
+        indexed = entity;
+        if (auto *g = dynamic_cast<Group *>(entity)) {
+            index_group(shard, g);
         }
     }
-    if (!replace) {
-        entities.push_back(entity);
+    // users who joined or left a group that is replaced
+    std::set<std::string> joined, left;
+    auto *was = dynamic_cast<Group *>(replaced);
+    auto *now = dynamic_cast<Group *>(entity);
+    if (was != nullptr && now != nullptr && was != now) {
+        auto before = member_users(was), after = member_users(now);
+        std::set_difference(after.begin(), after.end(), before.begin(),
+                            before.end(), std::inserter(joined, joined.end()));
+        std::set_difference(before.begin(), before.end(), after.begin(),
+                            after.end(), std::inserter(left, left.end()));
+    }
+    if (replaced != nullptr && replaced != entity) {
+        // whoever had it as a contact has the new one instead
+        for (auto &shard : shards) {
+            std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+            for (auto &c : shard.contacts) {
+                std::replace(c.second.begin(), c.second.end(), replaced,
+                             entity);
+            }
+        }
+        retire(replaced);
     }
     if (auto *u = dynamic_cast<User *>(entity)) {
-        auto t = prepare(R"(INSERT INTO "user" VALUES (?, ?, ?, ?))");
-        t->bind_text(0, u->get_id());
-        t->bind_text(1, u->get_name());
-        t->bind_text(2, u->get_bio());
-        t->bind_text(3, to_iso_time(u->get_registration_time()));
-        t->begin();
-        delete t;
+        write([&] {
+            auto t = prepare(R"(INSERT INTO "user" VALUES (?, ?, ?, ?))");
+            t->bind_text(0, u->get_id());
+            t->bind_text(1, u->get_name());
+            t->bind_text(2, u->get_bio());
+            t->bind_text(3, to_iso_time(u->get_registration_time()));
+            t->begin();
+            delete t;
+        });
     } else if (auto *g = dynamic_cast<Group *>(entity)) {
-        auto t = prepare(R"(INSERT INTO "group" VALUES (?, ?))");
-        t->bind_text(0, g->get_id());
-        t->bind_text(1, g->get_name());
-        t->begin();
-        for (auto m : g->get_members()) {
-            t = prepare(
-                R"(INSERT INTO "box"(container_id, contained_id) VALUES (?, ?))");
+        write([&] {
+            // the members of the one it replaces go with it
+            auto t = prepare(R"(DELETE FROM "box" WHERE container_id = ?)");
             t->bind_text(0, g->get_id());
-            t->bind_text(1, m->get_id());
             t->begin();
+            delete t;
+            t = prepare(R"(INSERT OR REPLACE INTO "group" VALUES (?, ?))");
+            t->bind_text(0, g->get_id());
+            t->bind_text(1, g->get_name());
+            t->begin();
+            for (auto m : g->get_members()) {
+                delete t;
+                t = prepare(
+                    R"(INSERT INTO "box"(container_id, contained_id) VALUES (?, ?))");
+                t->bind_text(0, g->get_id());
+                t->bind_text(1, m->get_id());
+                t->begin();
+            }
+            delete t;
+        });
+        if (!joined.empty() || !left.empty()) {
+            reindex_group(g, joined, left);
         }
-        delete t;
     } else {
         throw std::runtime_error("entity type not implemented");
     }
 }
+void TiOrm::reindex_group(Group *group, const std::set<std::string> &joined,
+                          const std::set<std::string> &left) {
+    std::vector<std::string> ids;
+    auto t = prepare_read(
+        R"(SELECT id FROM "message" WHERE receiver_id = ? ORDER BY rowid)");
+    t->bind_text(0, group->get_id());
+    for (auto row : *t) {
+        ids.push_back(row.get_text(0));
+    }
+    delete t;
+    write([&] {
+        for (const auto &id : ids) {
+            for (const auto &uid : joined) {
+                if (auto u = get_user(uid)) {
+                    update_sync(u, "+" + id, "messages");
+                }
+            }
+            for (const auto &uid : left) {
+                if (auto u = get_user(uid)) {
+                    update_sync(u, "-" + id, "messages");
+                }
+            }
+        }
+    });
+
+    if (is_lazy()) {
+        // loaded again with the new group when asked for
+        std::lock_guard<std::mutex> lock(cachemtx);
+        cache_version++;
+        for (const auto &id : ids) {
+            cache_drop(id);
+        }
+        return;
+    }
+    for (const auto &id : ids) {
+        auto &shard = shard_of(id);
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+        auto find = shard.messages.find(id);
+        if (find != shard.messages.end()) {
+            find->second->set_receiver(group);
+        }
+    }
+    // the inboxes are rebuilt the way the lazy mode reads them, so
+    // that the group's messages fall in place among the rest
+    std::unordered_set<std::string> regrouped(ids.begin(), ids.end());
+    std::set<std::string> affected(joined);
+    affected.insert(left.begin(), left.end());
+    for (const auto &uid : affected) {
+        std::vector<std::string> inbox_ids;
+        t = prepare_read(
+            R"(SELECT id FROM "message" WHERE receiver_id = ?1 OR receiver_id IN (SELECT container_id FROM "box" WHERE contained_id = ?1) ORDER BY rowid)");
+        t->bind_text(0, uid);
+        for (auto row : *t) {
+            inbox_ids.push_back(row.get_text(0));
+        }
+        delete t;
+        std::vector<Message *> inbox;
+        for (const auto &id : inbox_ids) {
+            auto &shard = shard_of(id);
+            std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+            auto find = shard.messages.find(id);
+            if (find != shard.messages.end()) {
+                inbox.push_back(find->second);
+            }
+        }
+        std::unordered_set<Message *> read(inbox.begin(), inbox.end());
+        auto &shard = shard_of(uid);
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+        auto &current = shard.inboxes[uid];
+        // whatever came in meanwhile stays
+        for (auto m : current) {
+            if (read.count(m) == 0 && regrouped.count(m->get_id()) == 0) {
+                inbox.push_back(m);
+            }
+        }
+        current.swap(inbox);
+    }
+}
 void TiOrm::delete_entity(ti::Entity *entity) {
-    auto r = std::remove(entities.begin(), entities.end(), entity);
-    if (*r == nullptr) {
-        throw std::runtime_error("entity not found");
+    {
+        auto &shard = shard_of(entity->get_id());
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+        auto find = shard.entities.find(entity->get_id());
+        if (find == shard.entities.end() || find->second != entity) {
+            throw std::runtime_error("entity not found");
+        }
+        shard.entities.erase(find);
+        shard.contacts.erase(entity->get_id());
+        shard.inboxes.erase(entity->get_id());
+        shard.members.erase(entity->get_id());
     }
-    SqlTransaction *t;
-    if (auto *u = dynamic_cast<User *>(entity)) {
-        t = prepare(R"(DELETE FROM "user" WHERE id = ?)");
-    } else if (auto *g = dynamic_cast<Group *>(entity)) {
-        t = prepare(R"(DELETE FROM "group" WHERE id = ?)");
+    std::string expr;
+    if (dynamic_cast<User *>(entity) != nullptr) {
+        expr = R"(DELETE FROM "user" WHERE id = ?)";
+    } else if (dynamic_cast<Group *>(entity) != nullptr) {
+        expr = R"(DELETE FROM "group" WHERE id = ?)";
     } else {
         throw std::runtime_error("unsupported entity type");
     }
-    t->bind_text(0, entity->get_id());
-    t->begin();
-    delete t;
+    write([&] {
+        auto t = prepare(expr);
+        t->bind_text(0, entity->get_id());
+        t->begin();
+        delete t;
+    });
+    retire(entity);
+}
+size_t TiOrm::get_retired_count() const {
+    std::lock_guard<std::mutex> lock(retiredmtx);
+    return retired.size() + kept.size();
+}
+void TiOrm::retire(Entity *entity) const {
+    {
+        std::lock_guard<std::mutex> lock(retiredmtx);
+        retired.push_back({epoch++, entity, false});
+    }
+    reclaim();
+}
+void TiOrm::reclaim() const {
+    std::unique_lock<std::mutex> reclaiming(reclaimmtx, std::try_to_lock);
+    if (!reclaiming.owns_lock()) {
+        // what it leaves due is for the next one
+        return;
+    }
+    while (true) {
+        std::vector<Entity *> due, unreferenced;
+        {
+            std::lock_guard<std::mutex> lock(retiredmtx);
+            auto oldest = readers.empty() ? epoch : *readers.begin();
+            while (!retired.empty() && retired.front().epoch < oldest) {
+                auto &r = retired.front();
+                (r.unreferenced ? unreferenced : due).push_back(r.entity);
+                retired.pop_front();
+            }
+            if (!due.empty()) {
+                due.insert(due.end(), kept.begin(), kept.end());
+                kept.clear();
+            }
+        }
+        for (auto e : unreferenced) {
+            delete e;
+        }
+        if (due.empty()) {
+            return;
+        }
+        auto held = referenced(due);
+        std::lock_guard<std::mutex> lock(retiredmtx);
+        for (auto e : due) {
+            if (held.count(e)) {
+                kept.push_back(e);
+            } else {
+                // a scope may have found it through what referred to
+                // it until now
+                retired.push_back({epoch++, e, true});
+            }
+        }
+        if (!readers.empty()) {
+            return;
+        }
+    }
+}
+std::unordered_set<const Entity *>
+TiOrm::referenced(const std::vector<Entity *> &among) const {
+    std::unordered_set<const Entity *> wanted(among.begin(), among.end()),
+        found;
+    auto see = [&](const Entity *e) {
+        if (e != nullptr && wanted.count(e)) {
+            found.insert(e);
+        }
+    };
+    auto see_members = [&](Entity *e) {
+        if (auto *g = dynamic_cast<Group *>(e)) {
+            for (auto m : g->get_members()) {
+                see(m);
+            }
+        }
+    };
+    auto see_message = [&](const Message *m) {
+        see(m->get_sender());
+        see(m->get_receiver());
+        see(m->get_forward_source());
+    };
+    for (auto &shard : shards) {
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+        for (const auto &e : shard.entities) {
+            see_members(e.second);
+        }
+        for (const auto &c : shard.contacts) {
+            for (auto e : c.second) {
+                see(e);
+            }
+        }
+        for (const auto &m : shard.messages) {
+            see_message(m.second);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(cachemtx);
+        for (const auto &c : cache) {
+            if (c.second.message != nullptr) {
+                see_message(c.second.message);
+            }
+        }
+        for (const auto &c : dropped) {
+            if (c.second.message != nullptr) {
+                see_message(c.second.message);
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(retiredmtx);
+        for (const auto &r : retired) {
+            see_members(r.entity);
+        }
+        for (auto e : kept) {
+            see_members(e);
+        }
+    }
+    // a group that stays keeps its members in turn
+    size_t before;
+    do {
+        before = found.size();
+        for (auto e : among) {
+            if (found.count(e)) {
+                see_members(e);
+            }
+        }
+    } while (found.size() > before);
+    return found;
+}
+std::vector<Entity *> TiOrm::get_entities() const {
+    std::vector<Entity *> r;
+    for (auto &shard : shards) {
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+        for (const auto &e : shard.entities) {
+            r.push_back(e.second);
+        }
+    }
+    return r;
 }
-std::vector<Entity *> TiOrm::get_entities() const { return entities; }
 Entity *TiOrm::get_entity(const std::string &id) const {
-    return *get_entity_in(entities.begin(), entities.end(), id);
+    auto &shard = shard_of(id);
+    std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+    auto find = shard.entities.find(id);
+    return find == shard.entities.end() ? nullptr : find->second;
 }
 void TiOrm::add_frames(const std::vector<Frame *> &frm, Message *parent) {
+    if (!is_lazy()) {
+        for (auto f : frm) {
+            auto &shard = shard_of(f->get_id());
+            std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+            shard.frames[f->get_id()] = f;
+        }
+    }
+    write([&] { insert_frames(frm, parent); });
+    if (is_lazy()) {
+        std::lock_guard<std::mutex> lock(cachemtx);
+        for (auto f : frm) {
+            cache_insert(f->get_id(), nullptr, f);
+        }
+    }
+}
+void TiOrm::insert_frames(const std::vector<Frame *> &frm, Message *parent) {
     for (auto f : frm) {
-        frames.push_back(f);
         if (parent != nullptr) {
             auto t = prepare(
                 R"(INSERT INTO "box"(container_id, contained_id) VALUES (?, ?))");
@@ -742,42 +1948,511 @@ void TiOrm::add_frames(const std::vector<Frame *> &frm, Message *parent) {
         }
     }
 }
-std::vector<Message *> TiOrm::get_messages() const { return messages; }
+Frame *TiOrm::get_frame(const std::string &id) const {
+    if (!is_lazy()) {
+        auto &shard = shard_of(id);
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+        auto find = shard.frames.find(id);
+        return find == shard.frames.end() ? nullptr : find->second;
+    }
+    // the entry holding a frame is touched, so a scope pins it
+    // whether it's the frame's own or its message's
+    auto cached = [&]() -> Frame * {
+        auto find = frame_index.find(id);
+        if (find == frame_index.end()) {
+            return nullptr;
+        }
+        auto entry = cache.find(find->second.second);
+        if (entry != cache.end()) {
+            cache_touch(entry->second);
+        }
+        return find->second.first;
+    };
+    while (true) {
+        unsigned long long version;
+        {
+            std::lock_guard<std::mutex> lock(cachemtx);
+            if (auto f = cached()) {
+                stats.hits++;
+                return f;
+            }
+            stats.misses++;
+            version = cache_version;
+        }
+        auto f = load_frame(id);
+        if (f == nullptr) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(cachemtx);
+        // someone else may have been quicker
+        if (auto other = cached()) {
+            delete f;
+            return other;
+        }
+        if (version != cache_version) {
+            // may have been deleted since it was read
+            delete f;
+            continue;
+        }
+        if (!cache_insert(id, nullptr, f)) {
+            delete f;
+            f = cache[id].frame;
+        }
+        return f;
+    }
+}
+std::vector<Message *> TiOrm::get_messages() const {
+    if (!is_lazy()) {
+        std::vector<Message *> r;
+        for (auto &shard : shards) {
+            std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+            for (const auto &m : shard.messages) {
+                r.push_back(m.second);
+            }
+        }
+        return r;
+    }
+    std::lock_guard<std::mutex> lock(cachemtx);
+    std::vector<Message *> r;
+    for (const auto &e : cache) {
+        if (e.second.message != nullptr) {
+            r.push_back(e.second.message);
+        }
+    }
+    return r;
+}
+std::vector<Message *> TiOrm::get_messages(const User *owner) const {
+    if (!is_lazy()) {
+        auto &shard = shard_of(owner->get_id());
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+        auto find = shard.inboxes.find(owner->get_id());
+        if (find == shard.inboxes.end()) {
+            return {};
+        }
+        return find->second;
+    }
+    auto t = prepare(
+        R"(SELECT id FROM "message" WHERE receiver_id = ?1 OR receiver_id IN (SELECT container_id FROM "box" WHERE contained_id = ?1) ORDER BY rowid)");
+    t->bind_text(0, owner->get_id());
+    std::vector<std::string> ids;
+    for (auto row : *t) {
+        ids.push_back(row.get_text(0));
+    }
+    delete t;
+    std::vector<Message *> r;
+    for (const auto &id : ids) {
+        if (auto m = lookup_message(id)) {
+            r.push_back(m);
+        }
+    }
+    return r;
+}
+std::vector<Message *> TiOrm::get_messages(const User *owner,
+                                           long long &after,
+                                           size_t limit) const {
+    if (!is_lazy()) {
+        // after counts messages into the inbox
+        auto &shard = shard_of(owner->get_id());
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+        auto find = shard.inboxes.find(owner->get_id());
+        if (find == shard.inboxes.end() ||
+            (size_t)after >= find->second.size()) {
+            return {};
+        }
+        auto first = find->second.begin() + after;
+        auto last = find->second.size() - after > limit
+                        ? first + limit
+                        : find->second.end();
+        after += last - first;
+        return {first, last};
+    }
+    // and here is a rowid
+    std::vector<Message *> r;
+    std::vector<std::string> ids;
+    do {
+        auto t = prepare_read(
+            R"(SELECT rowid, id FROM "message" WHERE (receiver_id = ?1 OR receiver_id IN (SELECT container_id FROM "box" WHERE contained_id = ?1)) AND rowid > ?2 ORDER BY rowid LIMIT ?3)");
+        t->bind_text(0, owner->get_id());
+        t->bind_int64(1, after);
+        t->bind_int64(2, limit);
+        ids.clear();
+        for (auto row : *t) {
+            after = row.get_int64(0);
+            ids.push_back(row.get_text(1));
+        }
+        delete t;
+        for (const auto &id : ids) {
+            if (auto m = lookup_message(id)) {
+                r.push_back(m);
+            }
+        }
+        // an empty page would end it early
+    } while (r.empty() && !ids.empty());
+    return r;
+}
+bool TiOrm::is_visible(const Message *msg, const User *user) const {
+    auto receiver = msg->get_receiver()->get_id();
+    if (receiver == user->get_id()) {
+        return true;
+    }
+    auto &shard = shard_of(receiver);
+    std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+    auto find = shard.members.find(receiver);
+    return find != shard.members.end() &&
+           find->second.count(user->get_id()) > 0;
+}
 Message *TiOrm::get_message(const std::string &id) {
-    return *get_entity_in(messages.begin(), messages.end(), id);
+    if (!is_lazy()) {
+        auto &shard = shard_of(id);
+        std::shared_lock<std::shared_timed_mutex> lock(shard.mtx);
+        auto find = shard.messages.find(id);
+        return find == shard.messages.end() ? nullptr : find->second;
+    }
+    return lookup_message(id);
 }
 void TiOrm::add_message(ti::Message *msg) {
-    messages.push_back(msg);
-    add_frames(msg->get_frames(), msg);
-    auto t = prepare(R"(INSERT INTO "message" VALUES (?, ?, ?, ?, ?))");
-    t->bind_text(0, msg->get_id());
-    t->bind_text(1, to_iso_time(msg->get_time()));
-    t->bind_text(2, msg->get_sender()->get_id());
-    t->bind_text(3, msg->get_receiver()->get_id());
-    t->bind_text(4, msg->get_receiver()->get_id());
-    t->begin();
-    delete t;
-    auto targets = msg->get_all_receivers();
-    for (auto target : targets) {
-        update_sync(target, "+" + msg->get_id(), "messages");
+    if (!is_lazy()) {
+        // frames first, so whoever finds the message finds them too
+        for (auto f : msg->get_frames()) {
+            auto &shard = shard_of(f->get_id());
+            std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+            shard.frames[f->get_id()] = f;
+        }
+        {
+            auto &shard = shard_of(msg->get_id());
+            std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+            shard.messages[msg->get_id()] = msg;
+        }
+        index_message(msg);
+    }
+    write([&] {
+        insert_frames(msg->get_frames(), msg);
+        auto t = prepare(R"(INSERT INTO "message" VALUES (?, ?, ?, ?, ?))");
+        t->bind_text(0, msg->get_id());
+        t->bind_text(1, to_iso_time(msg->get_time()));
+        t->bind_text(2, msg->get_sender()->get_id());
+        t->bind_text(3, msg->get_receiver()->get_id());
+        t->bind_text(4, msg->get_receiver()->get_id());
+        t->begin();
+        delete t;
+        auto targets = msg->get_all_receivers();
+        for (auto target : targets) {
+            update_sync(target, "+" + msg->get_id(), "messages");
+        }
+    });
+    if (is_lazy()) {
+        std::lock_guard<std::mutex> lock(cachemtx);
+        cache_insert(msg->get_id(), msg, nullptr);
     }
 }
 bool TiOrm::delete_message(ti::Message *msg) {
-    auto find = std::find(messages.begin(), messages.end(), msg);
-    if (find == messages.end()) {
-        return false;
+    if (is_lazy()) {
+        int changes;
+        write([&] {
+            auto t = prepare(R"(DELETE FROM message WHERE id = ?)");
+            t->bind_text(0, msg->get_id());
+            t->begin();
+            delete t;
+            changes = get_changes();
+            if (changes > 0) {
+                for (auto target : msg->get_all_receivers()) {
+                    update_sync(target, "-" + msg->get_id(), "messages");
+                }
+            }
+        });
+        std::lock_guard<std::mutex> lock(cachemtx);
+        cache_version++;
+        cache_drop(msg->get_id());
+        return changes > 0;
+    }
+    {
+        auto &shard = shard_of(msg->get_id());
+        std::lock_guard<std::shared_timed_mutex> lock(shard.mtx);
+        auto find = shard.messages.find(msg->get_id());
+        if (find == shard.messages.end() || find->second != msg) {
+            return false;
+        }
+        shard.messages.erase(find);
+    }
+    unindex_message(msg);
+    write([&] {
+        auto t = prepare(R"(DELETE FROM message WHERE id = ?)");
+        t->bind_text(0, msg->get_id());
+        t->begin();
+        delete t;
+        auto targets = msg->get_all_receivers();
+        for (auto target : targets) {
+            update_sync(target, "-" + msg->get_id(), "messages");
+        }
+    });
+    return true;
+}
+bool TiOrm::is_lazy() const { return cache_limit > 0; }
+void TiOrm::set_cache_limit(size_t bytes) {
+    std::lock_guard<std::mutex> lock(cachemtx);
+    cache_limit = bytes;
+    cache_evict();
+}
+CacheStats TiOrm::get_cache_stats() const {
+    std::lock_guard<std::mutex> lock(cachemtx);
+    auto r = stats;
+    r.limit = cache_limit;
+    return r;
+}
+Message *TiOrm::lookup_message(const std::string &id) const {
+    auto cached = [&]() -> Message * {
+        auto find = cache.find(id);
+        if (find == cache.end() || find->second.message == nullptr) {
+            return nullptr;
+        }
+        cache_touch(find->second);
+        return find->second.message;
+    };
+    auto discard = [](Message *m) {
+        for (auto f : m->get_frames()) {
+            delete f;
+        }
+        delete m;
+    };
+    // loaded without the lock, so that misses don't wait for each other
+    while (true) {
+        unsigned long long version;
+        {
+            std::lock_guard<std::mutex> lock(cachemtx);
+            if (auto m = cached()) {
+                stats.hits++;
+                return m;
+            }
+            stats.misses++;
+            version = cache_version;
+        }
+        auto m = load_message(id);
+        if (m == nullptr) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(cachemtx);
+        if (auto other = cached()) {
+            discard(m);
+            return other;
+        }
+        if (version != cache_version) {
+            // may have been deleted since it was read
+            discard(m);
+            continue;
+        }
+        if (!cache_insert(id, m, nullptr)) {
+            discard(m);
+            m = cache[id].message;
+        }
+        return m;
+    }
+}
+Message *TiOrm::load_message(const std::string &id) const {
+    auto t = prepare_read(
+        R"(SELECT time, sender_id, receiver_id, forwarded_id FROM "message" WHERE id = ?)");
+    t->bind_text(0, id);
+    auto row = t->begin();
+    if (row == t->end()) {
+        delete t;
+        return nullptr;
+    }
+    auto time = parse_iso_time((*row).get_text(0));
+    auto sender = get_entity((*row).get_text(1)),
+         receiver = get_entity((*row).get_text(2)),
+         forwarded = get_entity((*row).get_text(3));
+    delete t;
+
+    std::vector<Frame *> content;
+    t = prepare_read(
+        R"(SELECT f.id, f.content FROM "box" b JOIN "text_frame" f ON f.id = b.contained_id WHERE b.container_id = ? ORDER BY b.id)");
+    t->bind_text(0, id);
+    for (auto r : *t) {
+        content.push_back(new TextFrame(r.get_text(0), r.get_text(1)));
     }
-    messages.erase(find);
-    auto t = prepare(R"(DELETE FROM message WHERE id = ?)");
-    t->bind_text(0, msg->get_id());
-    t->begin();
     delete t;
-    auto targets = msg->get_all_receivers();
-    for (auto target : targets) {
-        update_sync(target, "-" + msg->get_id(), "messages");
+    return new Message(id, content, time, sender, receiver, forwarded);
+}
+Frame *TiOrm::load_frame(const std::string &id) const {
+    auto t = prepare_read(R"(SELECT content FROM "text_frame" WHERE id = ?)");
+    t->bind_text(0, id);
+    Frame *f = nullptr;
+    for (auto row : *t) {
+        f = new TextFrame(id, row.get_text(0));
+        break;
     }
+    delete t;
+    return f;
+}
+static size_t footprint(const Frame *frame) {
+    return sizeof(TextFrame) + frame->get_id().length() +
+           frame->to_string().length();
+}
+const void *TiOrm::held(const Cached &entry) {
+    return entry.message != nullptr ? (const void *)entry.message
+                                    : (const void *)entry.frame;
+}
+bool TiOrm::cache_insert(const std::string &id, Message *msg,
+                         Frame *frame) const {
+    auto find = cache.find(id);
+    if (find != cache.end()) {
+        if (find->second.message == msg && find->second.frame == frame) {
+            cache_touch(find->second);
+            return true;
+        }
+        if (find->second.pins > 0) {
+            // someone still uses it
+            cache_touch(find->second);
+            return false;
+        }
+        cache_drop(id);
+    }
+    size_t bytes;
+    if (msg != nullptr) {
+        message_index[id] = msg;
+        bytes = sizeof(Message) + id.length();
+        for (auto f : msg->get_frames()) {
+            frame_index[f->get_id()] = {f, id};
+            bytes += sizeof(Frame *) + footprint(f);
+        }
+    } else {
+        frame_index[id] = {frame, id};
+        bytes = footprint(frame);
+    }
+    lru.push_front(id);
+    auto &entry = cache[id] = {msg, frame, bytes, 0, lru.begin()};
+    stats.bytes += bytes;
+    stats.objects++;
+    cache_touch(entry);
+    cache_evict();
     return true;
 }
+void TiOrm::cache_touch(Cached &entry) const {
+    lru.splice(lru.begin(), lru, entry.lru);
+    for (auto scope = current_scope; scope != nullptr; scope = scope->outer) {
+        if (&scope->orm == this) {
+            if (entry.pins++ == 0) {
+                stats.pinned++;
+            }
+            scope->pinned.emplace_back(*entry.lru, held(entry));
+            break;
+        }
+    }
+}
+void TiOrm::cache_drop(std::string id) const {
+    auto find = cache.find(id);
+    if (find == cache.end()) {
+        return;
+    }
+    auto &entry = find->second;
+    if (entry.message != nullptr) {
+        message_index.erase(id);
+        for (auto f : entry.message->get_frames()) {
+            unindex_frame(f);
+        }
+    } else {
+        unindex_frame(entry.frame);
+    }
+    stats.bytes -= entry.bytes;
+    stats.objects--;
+    lru.erase(entry.lru);
+    if (entry.pins > 0) {
+        // stays pinned, see CacheScope
+        dropped.emplace(held(entry), entry);
+    } else {
+        cache_free(entry);
+    }
+    cache.erase(find);
+}
+void TiOrm::cache_free(Cached &entry) const {
+    if (entry.message != nullptr) {
+        for (auto f : entry.message->get_frames()) {
+            delete f;
+        }
+        delete entry.message;
+    } else {
+        delete entry.frame;
+    }
+}
+void TiOrm::unindex_frame(const Frame *frame) const {
+    auto find = frame_index.find(frame->get_id());
+    if (find == frame_index.end() || find->second.first != frame) {
+        return;
+    }
+    // a frame both cached on its own and in a message is indexed
+    // once, whichever goes first hands the index to the other
+    auto own = cache.find(frame->get_id());
+    if (own != cache.end() && own->second.frame != nullptr &&
+        own->second.frame != frame) {
+        find->second = {own->second.frame, frame->get_id()};
+    } else {
+        frame_index.erase(find);
+    }
+}
+void TiOrm::cache_evict() const {
+    // the most recent one is kept in any case, its caller is about
+    // to use it
+    auto it = lru.end();
+    while (stats.bytes > cache_limit && it != lru.begin()) {
+        auto victim = std::prev(it);
+        if (victim == lru.begin()) {
+            break;
+        }
+        if (cache[*victim].pins > 0) {
+            it = victim;
+            continue;
+        }
+        stats.evictions++;
+        cache_drop(*victim);
+    }
+}
+
+TiOrm::CacheScope::CacheScope(const TiOrm &orm)
+    : orm(orm), outer(current_scope), since(0), reading(true), pinned() {
+    for (auto scope = outer; scope != nullptr; scope = scope->outer) {
+        if (&scope->orm == &orm) {
+            // it covers this one
+            reading = false;
+            break;
+        }
+    }
+    if (reading) {
+        std::lock_guard<std::mutex> lock(orm.retiredmtx);
+        since = orm.epoch;
+        orm.readers.insert(since);
+    }
+    current_scope = this;
+}
+TiOrm::CacheScope::~CacheScope() {
+    current_scope = outer;
+    unpin();
+    if (reading) {
+        {
+            std::lock_guard<std::mutex> lock(orm.retiredmtx);
+            orm.readers.erase(orm.readers.find(since));
+        }
+        orm.reclaim();
+    }
+}
+void TiOrm::CacheScope::unpin() {
+    std::lock_guard<std::mutex> lock(orm.cachemtx);
+    for (const auto &pin : pinned) {
+        auto find = orm.cache.find(pin.first);
+        if (find != orm.cache.end() && held(find->second) == pin.second) {
+            if (find->second.pins > 0 && --find->second.pins == 0) {
+                orm.stats.pinned--;
+            }
+            continue;
+        }
+        auto gone = orm.dropped.find(pin.second);
+        if (gone != orm.dropped.end() && --gone->second.pins == 0) {
+            orm.stats.pinned--;
+            orm.cache_free(gone->second);
+            orm.dropped.erase(gone);
+        }
+    }
+    orm.cache_evict();
+}
+
 Sync TiOrm::get_sync(ti::User *owner) const {
     return {(SqlDatabase *)this, owner};
 }
@@ -0,0 +1,69 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ti {
+namespace server {
+/**
+ * Fixed-size work-stealing thread pool
+ */
+class Executor {
+  public:
+    using Task = std::function<void()>;
+
+  private:
+    struct Queue {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+    std::vector<Queue *> queues;
+    std::vector<std::thread> threads;
+    std::mutex mtx;
+    std::condition_variable has_work, has_room;
+    size_t depth, queued;
+    std::atomic<unsigned> next;
+    bool running, starved;
+    Task on_room;
+
+    /**
+     * Hand a task counted in queued to one of the queues
+     */
+    void enqueue(Task task);
+    bool pop(unsigned self, Task &task);
+    void work(unsigned self);
+
+  public:
+    /**
+     * @param threads number of workers. Zero means one per hardware thread
+     * @param depth how many tasks may wait before submit() blocks
+     */
+    explicit Executor(unsigned threads = 0, size_t depth = 1024);
+    /**
+     * Run what is left in the queues, then join the workers
+     */
+    ~Executor();
+    /**
+     * Queue a task, blocking the caller while the queues are full
+     */
+    void submit(Task task);
+    /**
+     * Queue a task unless the queues are full
+     * @return false if it wasn't queued. The room listener is called
+     * once there is room again
+     */
+    bool try_submit(Task task);
+    /**
+     * Call listener on a worker whenever a task is taken off the queues
+     * after try_submit() turned one down. Set before submitting anything
+     */
+    void set_room_listener(Task listener);
+    size_t get_depth() const;
+    unsigned get_thread_count() const;
+};
+} // namespace server
+} // namespace ti
@@ -0,0 +1,89 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define PASSWORD_HASH_BYTES 64
+#define HASHER_SLOT_COUNT 2
+#define HASHER_QUEUE_DEPTH 32
+#define HASHER_DEADLINE_MS 3000
+
+namespace ti {
+namespace server {
+/**
+ * A password wasn't hashed because too many were waiting
+ */
+class HasherBusy : public std::runtime_error {
+  public:
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * Hashes passwords with Argon2i on a fixed number of slots. Each slot
+ * is a thread with an Argon2 arena of its own, allocated once, so a
+ * login storm takes no more memory than one login per slot. Requests
+ * queue up to a depth and a deadline, and are turned down past either
+ */
+class PasswordHasher {
+  public:
+    struct Stats {
+        size_t hashed, rejected, expired;
+        /**
+         * Microseconds spent in the queue and hashing, over all hashes
+         */
+        uint64_t wait_us, hash_us;
+    };
+
+  private:
+    struct Job {
+        std::string passcode;
+        std::chrono::steady_clock::time_point queued;
+        std::promise<std::string> hash;
+    };
+    size_t depth;
+    std::chrono::milliseconds deadline;
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Job> queue;
+    std::vector<std::thread> slots;
+    size_t busy;
+    bool running;
+    Stats stats;
+
+    void work();
+    /**
+     * How long a request queued now would wait, going by the hashes
+     * done so far. Call with mtx held
+     */
+    std::chrono::microseconds expected_wait() const;
+
+  public:
+    /**
+     * @param slots how many passwords are hashed at once
+     * @param depth how many may wait for a slot
+     * @param deadline_ms how long one may wait
+     */
+    explicit PasswordHasher(unsigned slots = HASHER_SLOT_COUNT,
+                            size_t depth = HASHER_QUEUE_DEPTH,
+                            unsigned deadline_ms = HASHER_DEADLINE_MS);
+    /**
+     * Hash what is still queued, then join the slots
+     */
+    ~PasswordHasher();
+    /**
+     * Queue passcode for hashing
+     * @return the PASSWORD_HASH_BYTES long hash, or HasherBusy if the
+     * queue is full or it wouldn't be reached before the deadline
+     */
+    std::future<std::string> hash(std::string passcode);
+    Stats get_stats() const;
+};
+} // namespace server
+} // namespace ti
@@ -0,0 +1,146 @@
+#pragma once
+#include "executor.h"
+#include "server.h"
+#include <memory>
+#include <ringbuffer.h>
+#include <unordered_map>
+
+#define CONNECTION_READ_CHUNK 4096
+#define CONNECTION_BUFFER_MAX (1 << 20)
+// corked responses are written once this many bytes are held back
+#define CONNECTION_CORK_LIMIT (64 << 10)
+#define CONNECTION_STREAM_LIMIT (256 << 10)
+#define CONNECTION_STREAM_TIMEOUT_MS 30000
+#define CONNECTION_PUSH_LIMIT (1 << 20)
+
+namespace ti {
+namespace server {
+class Reactor;
+
+/**
+ * A non-blocking client socket driven by a Reactor.
+ * Requests are received into a ring buffer on the reactor thread and
+ * parsed in place by the executor, one connection at a time, so each
+ * client still sees its responses in request order. Responses to
+ * tagged requests carry the same tag back
+ */
+class Connection : public std::enable_shared_from_this<Connection> {
+    friend class Reactor;
+    Reactor &reactor;
+    SocketFd fd;
+    sockaddr_in addr;
+    Client *handler;
+    helper::RingBuffer inbuf;
+    std::vector<char> scratch, outbuf;
+    size_t outpos;
+    bool writable, corked;
+    std::atomic<bool> closing;
+    std::mutex mtx, outmtx;
+    std::condition_variable drained;
+    bool scheduled, stalled, reading, busy, parked;
+
+    /**
+     * Drain the socket until the kernel has nothing more to give,
+     * or the buffer is full while a worker still looks into it
+     * @return false if the peer is gone, or sent a frame too large
+     */
+    bool read_all();
+    /**
+     * Size of the frame at the front of the buffer, 0 if its header
+     * hasn't arrived yet. Call with mtx held
+     */
+    size_t next_frame_len() const;
+    /**
+     * Run the buffered requests on the calling worker
+     */
+    void drain();
+    /**
+     * Write the output buffer, followed by one more response if given,
+     * in a single syscall. Whatever the socket doesn't take is kept
+     * in the output buffer. Call with outmtx held
+     * @return false if the peer is gone
+     */
+    bool flush(const char *header = nullptr, size_t hlen = 0,
+               const void *data = nullptr, size_t len = 0);
+    /**
+     * Hold responses back in the output buffer until uncork()
+     */
+    void cork();
+    void uncork();
+
+  public:
+    Connection(Reactor &reactor, SocketFd fd, sockaddr_in addr);
+    ~Connection();
+    /**
+     * Queue a response. A CHUNK waits for the peer to take most of
+     * what is queued first, so a streamed response holds the worker
+     * rather than piling up in memory. A peer that takes nothing for
+     * CONNECTION_STREAM_TIMEOUT_MS is dropped
+     */
+    void send(ResponseCode res, void *data, size_t len);
+    /**
+     * Queue an untagged frame from any thread, unless more than
+     * CONNECTION_PUSH_LIMIT bytes are still waiting for the peer
+     * @return false if it was dropped
+     */
+    bool push(ResponseCode res, const void *data, size_t len);
+};
+
+/**
+ * Edge-triggered epoll event loop. Each reactor accepts on
+ * its own SO_REUSEPORT listener, so the kernel balances
+ * incoming connections between them
+ */
+class Reactor {
+    friend class Connection;
+    Server &server;
+    Executor &executor;
+    SocketFd listenfd;
+    int epollfd, wakefd;
+    std::atomic<bool> running;
+    std::unordered_map<Connection *, std::shared_ptr<Connection>> connections;
+    std::mutex postmtx;
+    std::vector<std::shared_ptr<Connection>> posted;
+    /**
+     * Connections with requests the executor had no room for. They
+     * aren't read from until it takes them
+     */
+    std::vector<std::shared_ptr<Connection>> parked;
+    std::atomic<bool> unparking;
+
+    void accept_all();
+    void receive(const std::shared_ptr<Connection> &conn);
+    /**
+     * Hand a connection to the executor, or park it if it is full
+     */
+    void dispatch(const std::shared_ptr<Connection> &conn);
+    void unpark();
+    void watch(Connection *conn, bool write);
+    void close(Connection *conn);
+    /**
+     * Hand a connection back to the event loop from a worker,
+     * either to resume reading or to close it
+     */
+    void post(std::shared_ptr<Connection> conn);
+    void handle_posted();
+
+  public:
+    Reactor(Server &server, Executor &executor, SocketFd listenfd);
+    ~Reactor();
+    /**
+     * Run the event loop on the calling thread until stop() is called
+     */
+    void run();
+    /**
+     * Wake the event loop and make it return. Safe to call from
+     * any thread, or a signal handler
+     */
+    void stop();
+    /**
+     * Try the parked connections again. Safe to call from any thread
+     */
+    void retry_parked();
+    size_t get_connection_count() const;
+};
+} // namespace server
+} // namespace ti
@@ -1,39 +1,106 @@
+#pragma once
 #include "ti.h"
 #include <functional>
+#include <helper.h>
 
 #define SendFn std::function<void(ti::ResponseCode, void *, size_t)>
+#define PushFn std::function<bool(ti::ResponseCode, const void *, size_t)>
 
 namespace ti {
 namespace server {
 class Client {
     SendFn sendfn;
+    PushFn pushfn;
 
   public:
     virtual ~Client() = default;
-    void initialize(SendFn fn);
+    /**
+     * @param push see push(), none if the transport can't
+     */
+    void initialize(SendFn fn, PushFn push = nullptr);
     void send(ResponseCode res, void *content, size_t len) const;
     void send(ResponseCode res) const;
+    /**
+     * Send a frame that doesn't answer any request. Unlike send, safe
+     * to call from any thread, and never waits: if the peer is too
+     * far behind, the frame is dropped instead
+     * @return false if it was dropped
+     */
+    bool push(ResponseCode res, const void *content, size_t len) const;
     virtual void on_connect(sockaddr_in addr) = 0;
     virtual void on_message(RequestCode req, char *content, size_t len) = 0;
     virtual void on_disconnect() = 0;
 };
+/**
+ * Sends a response as CHUNK frames while it's being written, each
+ * made of whole blocks (see helper::append_block), so that neither
+ * end holds all of it at once. Must be used from inside
+ * Client::on_message, like Client::send
+ */
+class ChunkWriter {
+    const Client &client;
+    std::string buf;
+    size_t chunk_len;
+
+  public:
+    explicit ChunkWriter(const Client &client,
+                         size_t chunk_len = STREAM_CHUNK_LEN);
+    void append_block(size_t len, const char *data = nullptr);
+    /**
+     * Send what has been appended so far as one chunk
+     */
+    void flush();
+    /**
+     * Flush, then end the response with an OK frame
+     */
+    void end();
+};
+class Reactor;
+class Executor;
 class Server {
     bool running;
     std::string addr;
     short port;
     SocketFd socketfd;
+    unsigned reactor_count, worker_count;
+    size_t queue_depth;
+    bool corking;
+    std::vector<Reactor *> reactors;
+    Executor *executor;
+    SocketFd listen_socket() const;
     void handleconn(sockaddr_in addr, SocketFd clientfd);
 
   public:
-    Server(std::string addr, short port);
+    /**
+     * @param reactors number of event loops to run, each on its own
+     * thread. Zero means one per hardware thread
+     * @param workers number of threads running Client::on_message.
+     * Zero means one per hardware thread
+     * @param queue_depth how many connections may wait for a worker
+     * before the reactors stop reading
+     */
+    Server(std::string addr, short port, unsigned reactors = 0,
+           unsigned workers = 0, size_t queue_depth = 1024);
     ~Server();
-    static void send(SocketFd clientfd, ResponseCode res, void *data, size_t len);
+    /**
+     * Write one response frame
+     * @param tag correlation tag of the request it answers, if any
+     */
+    static void send(SocketFd clientfd, ResponseCode res, void *data, size_t len,
+                     const uint32_t *tag = nullptr);
     virtual Client *on_connect(sockaddr_in addr) = 0;
     void start();
     void stop();
     std::string get_addr() const;
     short get_port() const;
     bool is_running() const;
+    /**
+     * Coalesce the responses to a batch of pipelined requests
+     * into as few writes as possible, instead of sending each
+     * as soon as it is ready
+     */
+    void set_corking(bool enabled);
+    bool is_corking() const;
 };
 } // namespace server
 } // namespace ti
@@ -1,34 +1,115 @@
+#include "hasher.h"
 #include "server.h"
+#include "tokens.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#define SESSION_SHARD_COUNT 16
 
 namespace ti {
 namespace server {
+class TiClient;
+/**
+ * The connections each user is logged in on, so that new messages
+ * reach them as they are sent rather than at their next sync.
+ * Sharded by user, so fan-outs to different users rarely contend
+ */
+class SessionRegistry {
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<std::string, std::vector<TiClient *>> sessions;
+    };
+    Shard shards[SESSION_SHARD_COUNT];
+    Shard &shard_of(const std::string &user_id);
+
+  public:
+    void add(const std::string &user_id, TiClient *client);
+    void remove(const std::string &user_id, TiClient *client);
+    /**
+     * Push a stored message to every connection its sender and
+     * receivers are logged in on, except the one it came from,
+     * serializing it once per wire format in use. A connection too
+     * far behind misses the push and gets the message at its next
+     * sync instead
+     * @return how many connections it was pushed to
+     */
+    size_t fan_out(const Message *msg, const TiClient *origin);
+};
 class ServerOrm : public orm::TiOrm {
-    std::vector<std::pair<User *, std::string>> tokens;
+    mutable TokenIndex tokens;
+    mutable PasswordHasher hasher;
+
+    /**
+     * Delete the rows of sessions the token index let go of
+     */
+    void drop_tokens(const std::vector<TokenSession> &expired) const;
 
   public:
-    explicit ServerOrm(const std::string &dbfile);
+    explicit ServerOrm(const std::string &dbfile,
+                       const orm::SqlOptions &options = orm::SqlOptions());
     void pull() override;
     bool check_password(const std::string &user_id, const std::string &passcode) const;
+    /**
+     * @return the owner of a token that hasn't expired, which is then
+     * kept for another TOKEN_TTL_S
+     */
     User *check_token(const std::string &token) const;
-    void add_token(ti::User *owner, const std::string &token);
+    /**
+     * @param identifier where the session logged in from
+     */
+    void add_token(ti::User *owner, const std::string &token,
+                   const std::string &identifier = "");
+    /**
+     * @param token_id the row id of a token, see TokenSession
+     */
     bool invalidate_token(int token_id, User *owner = nullptr);
     bool invalidate_token(const std::string &token, User *owner = nullptr);
+    size_t get_token_count() const;
+    /**
+     * Hashing a password for check_password or add_user may throw
+     * HasherBusy when there are too many of them at once
+     */
     void add_user(User *user, const std::string &passcode);
-    std::vector<Message *> get_messages(User *owner) const;
+    const PasswordHasher &get_hasher() const;
 };
 class TiServer : public Server {
     ServerOrm db;
+    SessionRegistry sessions;
 
   public:
-    TiServer(std::string addr, short port, const std::string &dbfile);
+    /**
+     * @param cache_bytes if not 0, keep message history on disk and
+     * only this much of it in memory, see TiOrm::set_cache_limit
+     */
+    TiServer(std::string addr, short port, const std::string &dbfile,
+             size_t cache_bytes = 0);
     ~TiServer();
     Client *on_connect(sockaddr_in addr) override;
 };
 class TiClient : public Client {
+    friend class SessionRegistry;
     ServerOrm &db;
-    std::string id;
+    SessionRegistry &sessions;
+    std::string id, peer;
+    /**
+     * Valid for the request at hand, looked up again by logged_in
+     * for each one
+     */
     User *user;
-    std::string token;
+    std::string logged_in, token, subscribed;
+    /** Also read by fan_out, on whichever thread sends a message */
+    std::atomic<WireFormat> format;
+    /**
+     * Take pushes for next instead of whoever was logged in before,
+     * or none if nullptr
+     */
+    void subscribe(User *next);
+    /**
+     * Serialize for this connection in the newest format both ends
+     * read, but no newer than max_format. No response
+     */
+    void hello(const std::string &max_format);
     /**
      * Response code: OK, NOT_FOUND
      * @param user_id
@@ -47,6 +128,45 @@ class TiClient : public Client {
      * @param selector
      */
     void sync(const std::string &curr_token, const std::string &selector);
+    /**
+     * Answer <field>/since/<cursor> with the cursor to continue from
+     * and the ids removed after the given one, then for contacts the
+     * contacts added, and for messages the messages added in pages
+     * with the entities they refer to, see write_pages. Each section
+     * is a count followed by length-prefixed blocks. Cursor 0 asks
+     * for everything, which is also the answer to a cursor older than
+     * the change log keeps. Streamed, see ChunkWriter
+     */
+    void sync_since(const std::string &field, const std::string &cursor);
+    /**
+     * Write the inbox of the user, see write_pages
+     */
+    void write_inbox(ChunkWriter &out, bool entities = false);
+    /**
+     * Write messages a page at a time, loading a page only once the
+     * last one is written, then end the response. A page is the
+     * entities its messages refer to that no earlier page carried,
+     * with the members of a group before it, if entities is set, then
+     * its frames, then its messages. A page with nothing in it is the
+     * last
+     * @param next_page called in a CacheScope of its own for each page
+     * until it returns no messages
+     */
+    void write_pages(ChunkWriter &out, bool entities,
+                     const std::function<std::vector<Message *>()> &next_page);
+    /**
+     * Answer entities/<id>,<id>,... with a count followed by each
+     * serialized entity in a block, an empty one for those not found.
+     * Streamed, see ChunkWriter
+     */
+    void sync_entities(const std::string &ids);
+    /**
+     * Answer <field>/tree/<prefix> with the count and hash of each child
+     * of a sync tree node, or <field>/range/<prefix> with the ids below
+     * it. See orm::TiOrm::get_sync_children
+     */
+    void sync_tree(const std::string &field, bool range,
+                   const std::string &prefix);
     /**
      * Unregister current account
      * Response code: TOKEN_EXPIRED, OK, NOT_FOUND
@@ -71,9 +191,15 @@ class TiClient : public Client {
      * @param passcode
      */
     void user_register(const std::string &user_name, const std::string &passcode);
+    /**
+     * Store a message from the current user and push it to its
+     * receivers, see RequestCode::SEND_MESSAGE
+     * Response code: OK, TOKEN_EXPIRED, BAD_REQUEST
+     */
+    void send_message(const char *data, size_t len);
 
   public:
-    explicit TiClient(ServerOrm &db);
+    TiClient(ServerOrm &db, SessionRegistry &sessions);
     ~TiClient() override;
     void on_connect(sockaddr_in addr) override;
     void on_disconnect() override;
@@ -0,0 +1,97 @@
+#pragma once
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define TOKEN_SHARD_COUNT 16
+#define TOKEN_WHEEL_SLOTS 64
+// how long a token lasts without being used
+#define TOKEN_TTL_S (30l * 24 * 3600)
+
+namespace ti {
+class User;
+namespace server {
+/**
+ * A login, as remembered by its token
+ */
+struct TokenSession {
+    /** Looked up again on use, the User may have been replaced since */
+    std::string user_id;
+    /** rowid in the token table, the id DETERMINE takes */
+    long long row_id;
+    time_t created, last_seen;
+    /** Where it logged in from */
+    std::string identifier;
+};
+
+/**
+ * Tokens and the sessions they stand for, sharded by token. Tokens
+ * unused for the TTL are dropped by a timer wheel each shard turns as
+ * it is used, so an operation costs no more than the tokens it finds
+ * expired. Nothing here touches the database: what expired is handed
+ * back for the caller to delete
+ */
+class TokenIndex {
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<std::string, TokenSession> sessions;
+        /**
+         * Tokens by the tick their TTL ends at, as of when they were
+         * put in. One used since is moved on when its slot comes up
+         */
+        std::vector<std::string> wheel[TOKEN_WHEEL_SLOTS];
+        time_t swept = 0;
+    };
+    time_t ttl, tick;
+    Shard shards[TOKEN_SHARD_COUNT];
+    std::mutex rowmtx;
+    std::unordered_map<long long, std::string> rows;
+
+    Shard &shard_of(const std::string &token);
+    void schedule(Shard &shard, const std::string &token, time_t deadline);
+    /**
+     * Turn the wheel up to now. Call with shard.mtx held
+     */
+    void sweep(Shard &shard, time_t now, std::vector<TokenSession> &expired);
+    void forget_rows(const std::vector<TokenSession> &sessions);
+
+  public:
+    explicit TokenIndex(time_t ttl = TOKEN_TTL_S);
+    /**
+     * Start remembering a session, which expires ttl after its last_seen
+     * @param expired receives the sessions swept out meanwhile
+     */
+    void put(const std::string &token, const TokenSession &session,
+             time_t now, std::vector<TokenSession> &expired);
+    /**
+     * Look a token up and mark it as seen now
+     * @param found receives the session, with last_seen as it was before
+     * @return false if there is no such token or it expired
+     */
+    bool touch(const std::string &token, time_t now, TokenSession &found,
+               std::vector<TokenSession> &expired);
+    /**
+     * Forget a token, if owner is nullptr or owns it
+     * @param removed receives the session
+     */
+    bool remove(const std::string &token, const User *owner,
+                TokenSession &removed);
+    /**
+     * Forget the token of a session by its row id, see remove()
+     */
+    bool remove(long long row_id, const User *owner, TokenSession &removed);
+    /**
+     * Turn the wheel of every shard up to now
+     */
+    void expire(time_t now, std::vector<TokenSession> &expired);
+    void clear();
+    size_t size();
+    /**
+     * How long a touched session goes without being stored again
+     */
+    time_t get_tick() const;
+};
+} // namespace server
+} // namespace ti
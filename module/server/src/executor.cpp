@@ -0,0 +1,122 @@
+#include "executor.h"
+#include <log.h>
+
+using namespace ti::server;
+
+Executor::Executor(unsigned threads, size_t depth)
+    : depth(std::max<size_t>(1, depth)), queued(0), next(0), running(true),
+      starved(false), on_room() {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < threads; ++i) {
+        queues.push_back(new Queue);
+    }
+    for (unsigned i = 0; i < threads; ++i) {
+        this->threads.emplace_back(&Executor::work, this, i);
+    }
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        running = false;
+    }
+    has_work.notify_all();
+    has_room.notify_all();
+    for (auto &t : threads) {
+        t.join();
+    }
+    for (auto q : queues) {
+        delete q;
+    }
+}
+
+void Executor::enqueue(Task task) {
+    auto q = queues[next++ % queues.size()];
+    {
+        std::lock_guard<std::mutex> lock(q->mtx);
+        q->tasks.push_back(std::move(task));
+    }
+    has_work.notify_one();
+}
+
+void Executor::submit(Task task) {
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        has_room.wait(lock, [&] { return queued < depth || !running; });
+        queued++;
+    }
+    enqueue(std::move(task));
+}
+
+bool Executor::try_submit(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (queued >= depth || !running) {
+            starved = true;
+            return false;
+        }
+        queued++;
+    }
+    enqueue(std::move(task));
+    return true;
+}
+
+void Executor::set_room_listener(Task listener) {
+    on_room = std::move(listener);
+}
+
+bool Executor::pop(unsigned self, Task &task) {
+    // own queue from the front, everyone else's from the back
+    for (size_t i = 0; i < queues.size(); ++i) {
+        auto q = queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(q->mtx);
+        if (q->tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            task = std::move(q->tasks.front());
+            q->tasks.pop_front();
+        } else {
+            task = std::move(q->tasks.back());
+            q->tasks.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void Executor::work(unsigned self) {
+    while (true) {
+        Task task;
+        if (pop(self, task)) {
+            bool room;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                queued--;
+                room = starved;
+                starved = false;
+            }
+            has_room.notify_one();
+            if (room && on_room) {
+                on_room();
+            }
+            try {
+                task();
+            } catch (const std::exception &e) {
+                logD("[executor] task failed: %s", e.what());
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mtx);
+        if (!running && queued == 0) {
+            break;
+        }
+        has_work.wait(lock, [&] { return queued > 0 || !running; });
+    }
+}
+
+size_t Executor::get_depth() const { return depth; }
+
+unsigned Executor::get_thread_count() const { return threads.size(); }
@@ -0,0 +1,130 @@
+#include "hasher.h"
+#include <algorithm>
+#include <argon2.h>
+#include <cstdlib>
+#include <log.h>
+
+#define PASSWORD_HASH_SALT "DIuL4dPTcL3q1a7EFOF9f"
+#define PASSWORD_HASH_SALT_LEN 21
+#define PASSWORD_HASH_T_COST 4
+// in KiB
+#define PASSWORD_HASH_M_COST (1 << 16)
+
+using namespace ti::server;
+using namespace std::chrono;
+
+// the arena of the slot running on the calling thread
+static thread_local uint8_t *arena = nullptr;
+
+static int lend_arena(uint8_t **memory, size_t bytes) {
+    if (arena == nullptr || bytes > (size_t)PASSWORD_HASH_M_COST * 1024) {
+        return ARGON2_MEMORY_ALLOCATION_ERROR;
+    }
+    *memory = arena;
+    return ARGON2_OK;
+}
+static void keep_arena(uint8_t *, size_t) {}
+
+PasswordHasher::PasswordHasher(unsigned slots, size_t depth,
+                               unsigned deadline_ms)
+    : depth(depth), deadline(deadline_ms), busy(0), running(true),
+      stats{0, 0, 0, 0, 0} {
+    for (unsigned i = 0; i < std::max(slots, 1u); ++i) {
+        this->slots.emplace_back([this] { work(); });
+    }
+}
+PasswordHasher::~PasswordHasher() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        running = false;
+    }
+    cv.notify_all();
+    for (auto &t : slots) {
+        t.join();
+    }
+}
+
+microseconds PasswordHasher::expected_wait() const {
+    if (stats.hashed == 0) {
+        return microseconds(0);
+    }
+    auto rounds = (queue.size() + busy) / slots.size();
+    return microseconds(stats.hash_us / stats.hashed * rounds);
+}
+
+std::future<std::string> PasswordHasher::hash(std::string passcode) {
+    std::promise<std::string> turned_down;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (running && queue.size() < depth && expected_wait() < deadline) {
+            queue.push_back({std::move(passcode), steady_clock::now(),
+                             std::promise<std::string>()});
+            auto f = queue.back().hash.get_future();
+            cv.notify_one();
+            return f;
+        }
+        stats.rejected++;
+        logD("[hasher] turned down a request, %zu queued", queue.size());
+    }
+    turned_down.set_exception(std::make_exception_ptr(
+        HasherBusy("too many passwords to hash, try again later")));
+    return turned_down.get_future();
+}
+
+void PasswordHasher::work() {
+    arena = (uint8_t *)malloc((size_t)PASSWORD_HASH_M_COST * 1024);
+    char salt[] = PASSWORD_HASH_SALT;
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&] { return !queue.empty() || !running; });
+            if (queue.empty()) {
+                break;
+            }
+            job = std::move(queue.front());
+            queue.pop_front();
+            if (steady_clock::now() - job.queued > deadline) {
+                stats.expired++;
+                lock.unlock();
+                job.hash.set_exception(std::make_exception_ptr(
+                    HasherBusy("password waited too long to be hashed")));
+                continue;
+            }
+            busy++;
+        }
+
+        auto start = steady_clock::now();
+        std::string out(PASSWORD_HASH_BYTES, '\0');
+        Argon2_Context context(
+            (uint8_t *)&out[0], PASSWORD_HASH_BYTES,
+            (uint8_t *)&job.passcode[0], (uint32_t)job.passcode.length(),
+            (uint8_t *)salt, PASSWORD_HASH_SALT_LEN, nullptr, 0, nullptr, 0,
+            PASSWORD_HASH_T_COST, PASSWORD_HASH_M_COST, 1, 1, lend_arena,
+            keep_arena, true, false, false, false);
+        int rc = Argon2i(&context);
+        auto end = steady_clock::now();
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            busy--;
+            stats.hashed++;
+            stats.wait_us +=
+                duration_cast<microseconds>(start - job.queued).count();
+            stats.hash_us += duration_cast<microseconds>(end - start).count();
+        }
+        if (rc != ARGON2_OK) {
+            job.hash.set_exception(
+                std::make_exception_ptr(std::runtime_error(ErrorMessage(rc))));
+        } else {
+            job.hash.set_value(std::move(out));
+        }
+    }
+    free(arena);
+    arena = nullptr;
+}
+
+PasswordHasher::Stats PasswordHasher::get_stats() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return stats;
+}
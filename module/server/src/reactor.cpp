@@ -0,0 +1,586 @@
+#ifdef __linux__
+#include "reactor.h"
+#include <cerrno>
+#include <helper.h>
+#include <log.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#define REACTOR_MAX_EVENTS 256
+
+using namespace ti::server;
+
+namespace {
+/**
+ * The request a worker is currently answering, so responses sent
+ * from inside on_message can carry its correlation tag
+ */
+struct Reply {
+    const Connection *conn;
+    bool tagged;
+    uint32_t tag;
+};
+thread_local Reply replying{};
+} // namespace
+
+Connection::Connection(Reactor &reactor, SocketFd fd, sockaddr_in addr)
+    : reactor(reactor), fd(fd), addr(addr), handler(nullptr), inbuf(),
+      scratch(), outbuf(), outpos(0), writable(true), corked(false),
+      closing(false), drained(), scheduled(false), stalled(false),
+      reading(false), busy(false), parked(false) {}
+
+Connection::~Connection() {
+    if (handler != nullptr) {
+        handler->on_disconnect();
+        delete handler;
+    }
+    closesocketfd(fd);
+}
+
+bool Connection::read_all() {
+    while (true) {
+        helper::RingBuffer::Region regions[2];
+        int count;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (inbuf.space() == 0) {
+                size_t frame = next_frame_len();
+                if (frame == SIZE_MAX) {
+                    // never grown for a frame that is turned down anyway,
+                    // receive() logs it
+                    return false;
+                }
+                bool complete = frame > 0 && frame <= inbuf.size();
+                if (busy ||
+                    (complete && inbuf.capacity() >= CONNECTION_BUFFER_MAX)) {
+                    // a worker is looking into the buffer, or has enough
+                    // to chew on. It posts us back once there is room
+                    stalled = true;
+                    return true;
+                }
+                inbuf.reserve(std::max(
+                    {inbuf.capacity() * 2, (size_t)CONNECTION_READ_CHUNK,
+                     std::min(frame, (size_t)TAGGED_FRAME_HEADER_LEN +
+                                         MAX_FRAME_LEN)}));
+            }
+            count = inbuf.free_regions(regions);
+            reading = true;
+        }
+        iovec iov[2];
+        for (int i = 0; i < count; ++i) {
+            iov[i] = {regions[i].data, regions[i].len};
+        }
+        ssize_t n = readv(fd, iov, count);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            reading = false;
+            if (n > 0) {
+                inbuf.commit(n);
+            }
+        }
+        if (n > 0) {
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+size_t Connection::next_frame_len() const {
+    if (inbuf.size() < FRAME_HEADER_LEN) {
+        return 0;
+    }
+    char header[FRAME_HEADER_LEN];
+    inbuf.peek(0, header, FRAME_HEADER_LEN);
+    size_t msize = ti::helper::read_len_header(header + 1);
+    if (msize > MAX_FRAME_LEN) {
+        return SIZE_MAX;
+    }
+    if (header[0] & FRAME_TAGGED) {
+        return TAGGED_FRAME_HEADER_LEN + msize;
+    }
+    return FRAME_HEADER_LEN + msize;
+}
+
+void Connection::drain() {
+    bool corking = reactor.server.is_corking();
+    if (corking) {
+        cork();
+    }
+    while (true) {
+        char header[TAGGED_FRAME_HEADER_LEN];
+        char *body;
+        size_t frame, hlen;
+        bool ready, resume;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            frame = next_frame_len();
+            ready = !closing && frame > 0 && frame <= inbuf.size();
+            if (!ready) {
+                scheduled = false;
+                if (inbuf.size() == 0 && !reading) {
+                    // idle connections shouldn't hold on to their buffers
+                    inbuf.release();
+                    std::vector<char>().swap(scratch);
+                }
+                resume = stalled;
+                stalled = false;
+            } else {
+                inbuf.peek(0, header, FRAME_HEADER_LEN);
+                hlen = FRAME_HEADER_LEN;
+                if (header[0] & FRAME_TAGGED) {
+                    hlen = TAGGED_FRAME_HEADER_LEN;
+                    inbuf.peek(FRAME_HEADER_LEN, header + FRAME_HEADER_LEN,
+                               BYTES_TAG_HEADER);
+                }
+                body = inbuf.view(hlen, frame - hlen, scratch);
+                busy = true;
+                resume = false;
+            }
+        }
+        if (!ready) {
+            if (corking) {
+                uncork();
+            }
+            if (resume) {
+                reactor.post(shared_from_this());
+            }
+            return;
+        }
+        replying = {this, hlen > FRAME_HEADER_LEN, 0};
+        if (replying.tagged) {
+            replying.tag =
+                ti::helper::read_tag_header(header + FRAME_HEADER_LEN);
+        }
+        try {
+            handler->on_message(
+                (RequestCode)((unsigned char)header[0] & ~FRAME_TAGGED), body,
+                frame - hlen);
+        } catch (const std::exception &e) {
+            logD("[reactor] dropping connection %d: %s", fd, e.what());
+            closing = true;
+            reactor.post(shared_from_this());
+        }
+        replying = {};
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            inbuf.consume(frame);
+            busy = false;
+            resume = stalled;
+            stalled = false;
+        }
+        if (resume) {
+            reactor.post(shared_from_this());
+        }
+    }
+}
+
+bool Connection::flush(const char *header, size_t hlen, const void *data,
+                       size_t len) {
+    iovec iov[3];
+    int count = 0;
+    size_t pending = outbuf.size() - outpos;
+    if (pending > 0) {
+        iov[count++] = {outbuf.data() + outpos, pending};
+    }
+    if (header != nullptr) {
+        iov[count++] = {(void *)header, hlen};
+        if (len > 0) {
+            iov[count++] = {(void *)data, len};
+        }
+    }
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    size_t sent = 0;
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return false;
+        }
+        sent += n;
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    // keep whatever the kernel didn't take
+    if (sent < pending) {
+        outpos += sent;
+        sent = 0;
+    } else {
+        sent -= pending;
+        outbuf.clear();
+        outpos = 0;
+    }
+    if (header != nullptr && sent < hlen + len) {
+        if (sent < hlen) {
+            outbuf.insert(outbuf.end(), header + sent, header + hlen);
+            sent = hlen;
+        }
+        outbuf.insert(outbuf.end(), (const char *)data + (sent - hlen),
+                      (const char *)data + len);
+    }
+    if (outbuf.empty()) {
+        std::vector<char>().swap(outbuf);
+    }
+    if (outbuf.size() - outpos < CONNECTION_STREAM_LIMIT) {
+        drained.notify_all();
+    }
+
+    bool blocked = !outbuf.empty();
+    if (blocked == writable) {
+        // only ask for EPOLLOUT while the kernel buffer is full
+        writable = !blocked;
+        reactor.watch(this, blocked);
+    }
+    return true;
+}
+
+void Connection::send(ResponseCode res, void *data, size_t len) {
+    if (closing) {
+        return;
+    }
+    char header[TAGGED_FRAME_HEADER_LEN];
+    size_t hlen = FRAME_HEADER_LEN;
+    header[0] = res;
+    if (replying.conn == this && replying.tagged) {
+        header[0] |= FRAME_TAGGED;
+        ti::helper::write_tag_header(replying.tag, header + FRAME_HEADER_LEN);
+        hlen = TAGGED_FRAME_HEADER_LEN;
+    }
+    ti::helper::write_len_header(len, header + 1);
+    std::unique_lock<std::mutex> lock(outmtx);
+    if (res == ResponseCode::CHUNK) {
+        bool drained_in_time = drained.wait_for(
+            lock, std::chrono::milliseconds(CONNECTION_STREAM_TIMEOUT_MS),
+            [&] {
+                return closing ||
+                       outbuf.size() - outpos < CONNECTION_STREAM_LIMIT;
+            });
+        if (!drained_in_time) {
+            // the peer stopped reading, don't hold the worker for it
+            logD("[reactor] dropping connection %d: stream stalled", fd);
+            closing = true;
+            reactor.post(shared_from_this());
+        }
+        if (closing) {
+            return;
+        }
+    }
+    bool alive;
+    if (!writable ||
+        (corked && outbuf.size() - outpos + len < CONNECTION_CORK_LIMIT)) {
+        // either waiting for EPOLLOUT anyway, or told to hold back
+        outbuf.insert(outbuf.end(), header, header + hlen);
+        outbuf.insert(outbuf.end(), (char *)data, (char *)data + len);
+        alive = true;
+    } else {
+        alive = flush(header, hlen, data, len);
+    }
+    if (!alive) {
+        closing = true;
+        reactor.post(shared_from_this());
+    }
+}
+
+bool Connection::push(ResponseCode res, const void *data, size_t len) {
+    char header[FRAME_HEADER_LEN];
+    header[0] = res;
+    ti::helper::write_len_header(len, header + 1);
+    std::lock_guard<std::mutex> lock(outmtx);
+    if (closing || outbuf.size() - outpos + len > CONNECTION_PUSH_LIMIT) {
+        return false;
+    }
+    if (!writable || corked) {
+        // whoever holds the cork, or EPOLLOUT, flushes it soon enough
+        outbuf.insert(outbuf.end(), header, header + FRAME_HEADER_LEN);
+        outbuf.insert(outbuf.end(), (const char *)data,
+                      (const char *)data + len);
+        return true;
+    }
+    if (!flush(header, FRAME_HEADER_LEN, data, len)) {
+        closing = true;
+        reactor.post(shared_from_this());
+        return false;
+    }
+    return true;
+}
+
+void Connection::cork() {
+    std::lock_guard<std::mutex> lock(outmtx);
+    corked = true;
+}
+
+void Connection::uncork() {
+    std::lock_guard<std::mutex> lock(outmtx);
+    corked = false;
+    if (writable && outbuf.size() > outpos && !flush()) {
+        closing = true;
+        reactor.post(shared_from_this());
+    }
+}
+
+Reactor::Reactor(Server &server, Executor &executor, SocketFd listenfd)
+    : server(server), executor(executor), listenfd(listenfd), running(false),
+      connections(), posted(), parked(), unparking(false) {
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0) {
+        throw std::runtime_error("failed to create epoll instance");
+    }
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd < 0) {
+        ::close(epollfd);
+        throw std::runtime_error("failed to create eventfd");
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &this->listenfd;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.data.ptr = &wakefd;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, wakefd, &ev);
+}
+
+Reactor::~Reactor() {
+    posted.clear();
+    connections.clear();
+    ::close(wakefd);
+    ::close(epollfd);
+    ::closesocketfd(listenfd);
+}
+
+void Reactor::run() {
+    running = true;
+    epoll_event events[REACTOR_MAX_EVENTS];
+    while (running) {
+        int n = epoll_wait(epollfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("epoll_wait failed");
+        }
+        bool woken = false;
+        for (int i = 0; i < n; ++i) {
+            auto &ev = events[i];
+            if (ev.data.ptr == &listenfd) {
+                accept_all();
+                continue;
+            }
+            if (ev.data.ptr == &wakefd) {
+                woken = true;
+                continue;
+            }
+            auto it = connections.find((Connection *)ev.data.ptr);
+            if (it == connections.end()) {
+                continue;
+            }
+            auto conn = it->second;
+            bool alive = !(ev.events & (EPOLLERR | EPOLLHUP));
+            if (alive && (ev.events & EPOLLOUT)) {
+                std::lock_guard<std::mutex> lock(conn->outmtx);
+                alive = conn->flush();
+            }
+            if (!alive) {
+                close(conn.get());
+            } else if (ev.events & (EPOLLIN | EPOLLRDHUP)) {
+                receive(conn);
+            }
+        }
+        if (woken) {
+            // after the batch, so no event above refers to a freed connection
+            handle_posted();
+        }
+    }
+    // workers still streaming to a connection needn't wait for it
+    for (auto &c : connections) {
+        {
+            std::lock_guard<std::mutex> lock(c.second->outmtx);
+            c.second->closing = true;
+        }
+        c.second->drained.notify_all();
+    }
+}
+
+void Reactor::stop() {
+    running = false;
+    uint64_t one = 1;
+    ::write(wakefd, &one, sizeof one);
+}
+
+void Reactor::retry_parked() {
+    unparking = true;
+    uint64_t one = 1;
+    ::write(wakefd, &one, sizeof one);
+}
+
+size_t Reactor::get_connection_count() const { return connections.size(); }
+
+void Reactor::accept_all() {
+    while (true) {
+        sockaddr_in clientaddr{};
+        socklen_t clientaddrlen = sizeof(clientaddr);
+        SocketFd clientfd =
+            accept4(listenfd, (struct sockaddr *)&clientaddr, &clientaddrlen,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // EAGAIN, or out of descriptors: wait for the next edge
+            return;
+        }
+        // responses leave in one write each, Nagle would only delay them
+        int on = 1;
+        setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+        auto conn = std::make_shared<Connection>(*this, clientfd, clientaddr);
+        auto raw = conn.get();
+        conn->handler = server.on_connect(clientaddr);
+        conn->handler->initialize(
+            [raw](ResponseCode res, void *content, size_t len) {
+                raw->send(res, content, len);
+            },
+            [raw](ResponseCode res, const void *content, size_t len) {
+                return raw->push(res, content, len);
+            });
+        connections[raw] = conn;
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = raw;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, clientfd, &ev);
+        conn->handler->on_connect(clientaddr);
+    }
+}
+
+void Reactor::receive(const std::shared_ptr<Connection> &conn) {
+    {
+        std::lock_guard<std::mutex> lock(conn->mtx);
+        if (conn->stalled || conn->parked) {
+            // the worker posts the connection back once it has room,
+            // and the executor once it takes the parked one
+            return;
+        }
+    }
+    bool alive = conn->read_all(), schedule = false;
+    {
+        std::lock_guard<std::mutex> lock(conn->mtx);
+        size_t frame = conn->next_frame_len();
+        if (frame == SIZE_MAX) {
+            logD("[reactor] dropping connection %d: frame too large", conn->fd);
+            conn->closing = true;
+        } else if (!conn->scheduled && frame > 0 &&
+                   frame <= conn->inbuf.size()) {
+            conn->scheduled = schedule = true;
+        }
+    }
+    if (!alive || conn->closing) {
+        close(conn.get());
+    } else if (schedule) {
+        dispatch(conn);
+    }
+}
+
+void Reactor::dispatch(const std::shared_ptr<Connection> &conn) {
+    if (executor.try_submit([conn] { conn->drain(); })) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(conn->mtx);
+        conn->scheduled = false;
+        conn->parked = true;
+    }
+    parked.push_back(conn);
+}
+
+void Reactor::unpark() {
+    std::vector<std::shared_ptr<Connection>> batch;
+    batch.swap(parked);
+    for (auto &conn : batch) {
+        if (connections.find(conn.get()) == connections.end()) {
+            continue;
+        }
+        bool stalled;
+        {
+            std::lock_guard<std::mutex> lock(conn->mtx);
+            conn->parked = false;
+            stalled = conn->stalled;
+            // a stalled one has complete requests, and is only read
+            // again once a worker made room for more
+            conn->scheduled = stalled;
+        }
+        if (stalled) {
+            dispatch(conn);
+        } else {
+            receive(conn);
+        }
+    }
+}
+
+void Reactor::watch(Connection *conn, bool write) {
+    epoll_event ev{};
+    ev.events =
+        EPOLLIN | EPOLLRDHUP | EPOLLET | (write ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.ptr = conn;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+void Reactor::close(Connection *conn) {
+    {
+        std::lock_guard<std::mutex> lock(conn->outmtx);
+        conn->closing = true;
+    }
+    // a worker streaming a response mustn't wait for this one forever
+    conn->drained.notify_all();
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    // a worker may still hold the connection; the last owner frees it
+    connections.erase(conn);
+}
+
+void Reactor::post(std::shared_ptr<Connection> conn) {
+    {
+        std::lock_guard<std::mutex> lock(postmtx);
+        posted.push_back(std::move(conn));
+    }
+    uint64_t one = 1;
+    ::write(wakefd, &one, sizeof one);
+}
+
+void Reactor::handle_posted() {
+    uint64_t count;
+    ::read(wakefd, &count, sizeof count);
+    if (unparking.exchange(false)) {
+        unpark();
+    }
+    std::vector<std::shared_ptr<Connection>> batch;
+    {
+        std::lock_guard<std::mutex> lock(postmtx);
+        batch.swap(posted);
+    }
+    for (auto &conn : batch) {
+        if (connections.find(conn.get()) == connections.end()) {
+            continue;
+        }
+        if (conn->closing) {
+            close(conn.get());
+        } else {
+            receive(conn);
+        }
+    }
+}
+#endif
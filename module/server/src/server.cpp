@@ -1,42 +1,93 @@
-#include "server.h"
-#include <thread>
+#include "reactor.h"
 #include <helper.h>
+#include <ringbuffer.h>
+#include <thread>
 
 using namespace ti::server;
 
-void Client::initialize(SendFn fn) { sendfn = std::move(fn); }
+void Client::initialize(SendFn fn, PushFn push) {
+    sendfn = std::move(fn);
+    pushfn = std::move(push);
+}
 void Client::send(ti::ResponseCode res, void *content, size_t len) const {
     sendfn(res, content, len);
 }
 void Client::send(ti::ResponseCode res) const { sendfn(res, nullptr, 0); }
+bool Client::push(ti::ResponseCode res, const void *content,
+                  size_t len) const {
+    return pushfn && pushfn(res, content, len);
+}
+
+ChunkWriter::ChunkWriter(const Client &client, size_t chunk_len)
+    : client(client), buf(), chunk_len(chunk_len) {}
+
+void ChunkWriter::append_block(size_t len, const char *data) {
+    ti::helper::append_block(buf, len, data);
+    if (buf.size() >= chunk_len) {
+        flush();
+    }
+}
 
-Server::Server(std::string addr, short port)
-    : addr(std::move(addr)), port(port), running(false) {}
+void ChunkWriter::flush() {
+    if (!buf.empty()) {
+        client.send(ResponseCode::CHUNK, (void *)buf.data(), buf.size());
+        buf.clear();
+    }
+}
+
+void ChunkWriter::end() {
+    flush();
+    client.send(ResponseCode::OK);
+}
+
+Server::Server(std::string addr, short port, unsigned reactors,
+               unsigned workers, size_t queue_depth)
+    : addr(std::move(addr)), port(port), running(false),
+      reactor_count(reactors), worker_count(workers),
+      queue_depth(queue_depth), corking(false), reactors(),
+      executor(nullptr) {
+    if (reactor_count == 0) {
+        reactor_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
 
 Server::~Server() {
+#ifdef __linux__
+    delete executor;
+    for (auto r : reactors) {
+        delete r;
+    }
+#else
     if (running) {
         closesocketfd(socketfd);
     }
+#endif
 }
 
-void Server::start() {
+SocketFd Server::listen_socket() const {
 #ifdef _WIN32
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-        throw std::runtime_error("failed to initialize winsock");
-    }
-    socketfd = socket(PF_INET, SOCK_STREAM, 0);
-    if (socketfd == INVALID_SOCKET) {
+    SocketFd fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET) {
         WSACleanup();
         throw std::runtime_error("failed to create socket");
     }
     sockaddr_in servaddr;
     ZeroMemory(&servaddr, sizeof(servaddr));
 #else
-    socketfd = socket(PF_INET, SOCK_STREAM, IPPROTO_IP);
-    if (socketfd < 0) {
+#ifdef __linux__
+    SocketFd fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         IPPROTO_IP);
+#else
+    SocketFd fd = socket(PF_INET, SOCK_STREAM, IPPROTO_IP);
+#endif
+    if (fd < 0) {
         throw std::runtime_error("failed to create socket");
     }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+#ifdef SO_REUSEPORT
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on);
+#endif
     sockaddr_in servaddr;
     std::memset(&servaddr, 0, sizeof servaddr);
 #endif
@@ -44,14 +95,70 @@ void Server::start() {
     servaddr.sin_family = PF_INET;
     servaddr.sin_port = htons(port);
     if (inet_pton(PF_INET, addr.c_str(), &servaddr.sin_addr) <= 0) {
+        closesocketfd(fd);
         throw std::runtime_error("invalid address");
     }
-    if (bind(socketfd, (struct sockaddr *)&servaddr, sizeof servaddr) < 0) {
+    if (bind(fd, (struct sockaddr *)&servaddr, sizeof servaddr) < 0) {
+        closesocketfd(fd);
         throw std::runtime_error("failed to bind");
     }
-    if (listen(socketfd, 10) < 0) {
+    if (listen(fd, SOMAXCONN) < 0) {
+        closesocketfd(fd);
         throw std::runtime_error("failed to listen");
     }
+    return fd;
+}
+
+#ifdef __linux__
+void Server::start() {
+    executor = new Executor(worker_count, queue_depth);
+    for (unsigned i = 0; i < reactor_count; ++i) {
+        reactors.push_back(new Reactor(*this, *executor, listen_socket()));
+    }
+    executor->set_room_listener([this] {
+        for (auto r : reactors) {
+            r->retry_parked();
+        }
+    });
+
+    running = true;
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < reactors.size(); ++i) {
+        threads.emplace_back(&Reactor::run, reactors[i]);
+    }
+    reactors[0]->run();
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    // let the workers finish before their connections go away
+    delete executor;
+    executor = nullptr;
+    for (auto r : reactors) {
+        delete r;
+    }
+    reactors.clear();
+    running = false;
+}
+
+void Server::stop() {
+    if (!running) {
+        throw std::runtime_error("the server is currently not running");
+    }
+    running = false;
+    for (auto r : reactors) {
+        r->stop();
+    }
+}
+#else
+void Server::start() {
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        throw std::runtime_error("failed to initialize winsock");
+    }
+#endif
+    socketfd = listen_socket();
 
     running = true;
     while (running) {
@@ -76,56 +183,85 @@ void Server::stop() {
     running = false;
     closesocketfd(socketfd);
 }
+#endif
 
 void Server::handleconn(sockaddr_in addr, SocketFd clientfd) {
-    std::thread([&] {
+    std::thread([this, addr, clientfd] {
+        // tag of the request being answered, null if it has none
+        uint32_t tag;
+        const uint32_t *replying = nullptr;
         auto *handler = this->on_connect(addr);
-        handler->initialize([&](ResponseCode res, void *content, int len) {
-            ti::server::Server::send(clientfd, res, content, len);
+        handler->initialize([clientfd, &replying](ResponseCode res,
+                                                  void *content, size_t len) {
+            ti::server::Server::send(clientfd, res, content, len, replying);
         });
         handler->on_connect(addr);
 
-        char *tsize = (char *)calloc(BYTES_LEN_HEADER, sizeof(char)),
-             *treq = (char *)calloc(1, sizeof(char)), *buff = nullptr;
-        size_t msize;
+        ti::helper::RingBuffer inbuf;
+        ti::helper::RingBuffer::Region regions[2];
+        std::vector<char> scratch;
+        char header[TAGGED_FRAME_HEADER_LEN];
+        bool alive = true;
 
-        while (true) {
-            size_t n = recv(clientfd, treq, 1, 0);
-            if (n <= 0) {
-                break;
+        while (alive) {
+            if (inbuf.space() == 0) {
+                inbuf.reserve(std::max<size_t>(inbuf.capacity() * 2, 4096));
             }
-            n = recv(clientfd, tsize, BYTES_LEN_HEADER * sizeof(char), 0);
+            inbuf.free_regions(regions);
+            auto n = recv(clientfd, regions[0].data, regions[0].len, 0);
             if (n <= 0) {
                 break;
             }
-            msize = ti::helper::read_len_header(tsize);
-            buff = (char *)malloc(msize);
-            n = recv(clientfd, buff, msize, 0);
-            if (n <= 0) {
-                break;
+            inbuf.commit(n);
+            while (inbuf.size() >= FRAME_HEADER_LEN) {
+                inbuf.peek(0, header, FRAME_HEADER_LEN);
+                size_t msize = ti::helper::read_len_header(header + 1);
+                if (msize > MAX_FRAME_LEN) {
+                    alive = false;
+                    break;
+                }
+                size_t hlen = (header[0] & FRAME_TAGGED)
+                                  ? TAGGED_FRAME_HEADER_LEN
+                                  : FRAME_HEADER_LEN;
+                // a tagged header may not be all here yet
+                if (inbuf.size() < hlen || inbuf.size() - hlen < msize) {
+                    inbuf.reserve(hlen + msize);
+                    break;
+                }
+                if (hlen > FRAME_HEADER_LEN) {
+                    inbuf.peek(FRAME_HEADER_LEN, header + FRAME_HEADER_LEN,
+                               BYTES_TAG_HEADER);
+                    tag = ti::helper::read_tag_header(header +
+                                                      FRAME_HEADER_LEN);
+                    replying = &tag;
+                }
+                handler->on_message(
+                    (RequestCode)((unsigned char)header[0] & ~FRAME_TAGGED),
+                    inbuf.view(hlen, msize, scratch), msize);
+                replying = nullptr;
+                inbuf.consume(hlen + msize);
             }
-            handler->on_message((RequestCode)*treq, buff, msize);
         }
 
         closesocketfd(clientfd);
         handler->on_disconnect();
         delete handler;
-        delete tsize;
-        delete buff;
     }).detach();
 }
 
-void Server::send(SocketFd clientfd, ResponseCode res, void *data, size_t len) {
-    auto *tres = (char *)calloc(1, sizeof(char));
-    tres[0] = res;
-    compat::socket::send(clientfd, tres, sizeof(char), 0);
-    char *tsize = ti::helper::write_len_header(len);
-    compat::socket::send(clientfd, tsize, sizeof(char) * BYTES_LEN_HEADER, 0);
-    if (len > 0) {
-        compat::socket::send(clientfd, data, len, 0);
-    }
-    delete tsize;
-    delete tres;
+void Server::send(SocketFd clientfd, ResponseCode res, void *data, size_t len,
+                  const uint32_t *tag) {
+    char header[TAGGED_FRAME_HEADER_LEN];
+    size_t hlen = FRAME_HEADER_LEN;
+    header[0] = res;
+    if (tag != nullptr) {
+        header[0] |= FRAME_TAGGED;
+        ti::helper::write_tag_header(*tag, header + FRAME_HEADER_LEN);
+        hlen = TAGGED_FRAME_HEADER_LEN;
+    }
+    ti::helper::write_len_header(len, header + 1);
+    compat::socket::Buffer bufs[] = {{header, hlen}, {data, len}};
+    compat::socket::sendv(clientfd, bufs, len > 0 ? 2 : 1);
 }
 
 std::string Server::get_addr() const { return addr; }
@@ -133,3 +269,7 @@ std::string Server::get_addr() const { return addr; }
 short Server::get_port() const { return port; }
 
 bool Server::is_running() const { return running; }
+
+void Server::set_corking(bool enabled) { corking = enabled; }
+
+bool Server::is_corking() const { return corking; }
@@ -1,28 +1,26 @@
 #include "ti_server.h"
-#include <argon2.h>
 #include <helper.h>
 #include <log.h>
 #include <nanoid.h>
 
-#define PASSWORD_HASH_BYTES 64
-#define PASSWORD_HASH_SALT "DIuL4dPTcL3q1a7EFOF9f"
-#define PASSWORD_HASH_SALT_LEN 21
+#define SERVER_GROUP_COMMIT_MS 2
+// messages loaded at a time for a response that may hold a whole inbox
+#define SYNC_PAGE_MESSAGES 128
 
 using namespace ti::server;
 using namespace ti;
 
-#pragma clang diagnostic push
-#pragma ide diagnostic ignored "performance-unnecessary-value-param"
-char *hash_password(std::string passcode) {
-    char *encryption = (char *)calloc(PASSWORD_HASH_BYTES, sizeof(char));
-    hash_argon2i(encryption, PASSWORD_HASH_BYTES, passcode.c_str(),
-                 passcode.length(), PASSWORD_HASH_SALT, PASSWORD_HASH_SALT_LEN,
-                 4, 1 << 16);
-    return encryption;
-}
-#pragma clang diagnostic pop
+/**
+ * nanoid::generate() draws from one generator shared by all threads
+ */
+static std::string generate_id() {
+    thread_local nanoid::crypto_random<std::random_device> random;
+    return nanoid::generate(random);
+}
 
-ServerOrm::ServerOrm(const std::string &dbfile) : TiOrm(dbfile) {
+ServerOrm::ServerOrm(const std::string &dbfile,
+                     const orm::SqlOptions &options)
+    : TiOrm(dbfile, options) {
     logD("[server orm] executing initializing SQL");
     exec_sql(
         R"(CREATE TABLE IF NOT EXISTS "password"
@@ -39,135 +37,269 @@ CREATE TABLE IF NOT EXISTS "token"
     user_id    varchar(21) not null,
     token      varchar(21) not null,
     identifier varchar     not null,
+    created    int         not null default 0,
+    last_seen  int         not null default 0,
     FOREIGN KEY (user_id)
         REFERENCES user (id)
         ON DELETE CASCADE
 );)");
+    auto t = prepare("SELECT count(*) FROM pragma_table_info('token') "
+                     "WHERE name = 'last_seen'");
+    auto migrated = (*t->begin()).get_int(0) > 0;
+    delete t;
+    if (!migrated) {
+        // their sessions count as new when pulled
+        exec_sql("ALTER TABLE token ADD created int not null default 0;"
+                 "ALTER TABLE token ADD last_seen int not null default 0;");
+    }
 }
 void ServerOrm::pull() {
     orm::TiOrm::pull();
     tokens.clear();
-    auto t = prepare("SELECT user_id, token FROM \"token\"");
+    auto now = time(nullptr);
+    std::vector<TokenSession> expired;
+    auto t = prepare("SELECT rowid, user_id, token, identifier, created, "
+                     "last_seen FROM token");
     for (auto e : *t) {
-        tokens.emplace_back(get_user(e.get_text(0)), e.get_text(1));
+        TokenSession s{e.get_text(1), e.get_int64(0), e.get_int64(4),
+                       e.get_int64(5), e.get_text(3)};
+        if (get_user(s.user_id) == nullptr) {
+            continue;
+        }
+        if (s.last_seen == 0) {
+            s.created = s.last_seen = now;
+        }
+        tokens.put(e.get_text(2), s, now, expired);
     }
     delete t;
+    tokens.expire(now, expired);
+    drop_tokens(expired);
+}
+void ServerOrm::drop_tokens(const std::vector<TokenSession> &expired) const {
+    if (expired.empty()) {
+        return;
+    }
+    write([&] {
+        for (const auto &s : expired) {
+            auto t = prepare("DELETE FROM token WHERE rowid = ?");
+            t->bind_int64(0, s.row_id);
+            t->begin();
+            delete t;
+        }
+    });
 }
 bool ServerOrm::check_password(const std::string &user_id,
                                const std::string &passcode) const {
-    auto t = prepare("SELECT hash FROM password WHERE user_id = ?");
+    auto t = prepare_read("SELECT hash FROM password WHERE user_id = ?");
     t->bind_text(0, user_id);
     auto beg = t->begin();
     if (beg == t->end()) {
+        delete t;
         return false;
     }
     void *buf;
     auto n = (*beg).get_blob(0, &buf);
     if (n != PASSWORD_HASH_BYTES) {
+        delete t;
         throw std::runtime_error("corrupt password database");
     }
-    auto hashed = hash_password(passcode);
-    for (int i = 0; i < PASSWORD_HASH_BYTES; ++i) {
-        if (hashed[i] != ((char *)buf)[i]) {
-            return false;
-        }
-    }
+    char stored[PASSWORD_HASH_BYTES];
+    std::memcpy(stored, buf, PASSWORD_HASH_BYTES);
     delete t;
-    return true;
+    auto hashed = hasher.hash(passcode).get();
+    return std::memcmp(hashed.data(), stored, PASSWORD_HASH_BYTES) == 0;
 }
 User *ServerOrm::check_token(const std::string &token) const {
-    for (const auto &t : tokens) {
-        if (t.second == token) {
-            return t.first;
-        }
+    auto now = time(nullptr);
+    TokenSession s;
+    std::vector<TokenSession> expired;
+    auto alive = tokens.touch(token, now, s, expired);
+    drop_tokens(expired);
+    if (!alive) {
+        return nullptr;
     }
-    return nullptr;
-}
-void ServerOrm::add_token(User *owner, const std::string &token) {
-    tokens.emplace_back(owner, token);
-    auto t = prepare("INSERT INTO \"token\"(user_id, token) VALUES (?, ?)");
-    t->bind_text(0, owner->get_id());
-    t->bind_text(1, token);
-    t->begin();
-    delete t;
+    // stored at most once a tick, so reconnecting rarely writes
+    if (s.last_seen / tokens.get_tick() != now / tokens.get_tick()) {
+        write([&] {
+            auto t = prepare("UPDATE token SET last_seen = ? WHERE rowid = ?");
+            t->bind_int64(0, now);
+            t->bind_int64(1, s.row_id);
+            t->begin();
+            delete t;
+        });
+    }
+    return get_user(s.user_id);
 }
-bool ServerOrm::invalidate_token(int token_id, User *owner) {
-    if (owner == nullptr) {
-        auto t = prepare("DELETE FROM token WHERE id = ?");
-        t->bind_int(0, token_id);
+void ServerOrm::add_token(User *owner, const std::string &token,
+                          const std::string &identifier) {
+    auto now = time(nullptr);
+    TokenSession s{owner->get_id(), 0, now, now, identifier};
+    write([&] {
+        auto t = prepare("INSERT INTO token(user_id, token, identifier, "
+                         "created, last_seen) VALUES (?, ?, ?, ?, ?)");
+        t->bind_text(0, owner->get_id());
+        t->bind_text(1, token);
+        t->bind_text(2, identifier);
+        t->bind_int64(3, now);
+        t->bind_int64(4, now);
         t->begin();
         delete t;
-    } else {
-        auto t = prepare("DELETE FROM token WHERE id = ? AND user_id = ?");
-        t->bind_int(0, token_id);
-        t->bind_text(1, owner->get_id());
-        t->begin();
+        t = prepare("SELECT last_insert_rowid()");
+        s.row_id = (*t->begin()).get_int64(0);
         delete t;
+    });
+    std::vector<TokenSession> expired;
+    tokens.put(token, s, now, expired);
+    drop_tokens(expired);
+}
+bool ServerOrm::invalidate_token(int token_id, User *owner) {
+    TokenSession s;
+    if (!tokens.remove(token_id, owner, s)) {
+        return false;
     }
-    return get_changes() > 0;
+    drop_tokens({s});
+    return true;
 }
 bool ServerOrm::invalidate_token(const std::string &token, User *owner) {
-    int i;
-    bool found = false;
-    for (i = 0; i < tokens.size(); i++) {
-        if (owner == nullptr ||
-            *tokens[i].first == *owner && tokens[i].second == token) {
-            found = true;
-            break;
-        }
-    }
-    if (found) {
-        tokens.erase(tokens.begin() + i);
-        auto t = prepare("DELETE FROM token WHERE token = ?");
-        t->bind_text(0, token);
-        delete t;
+    TokenSession s;
+    if (!tokens.remove(token, owner, s)) {
+        return false;
     }
-    return found;
+    drop_tokens({s});
+    return true;
 }
+size_t ServerOrm::get_token_count() const { return tokens.size(); }
 
 void ServerOrm::add_user(ti::User *user, const std::string &passcode) {
-    add_entity(user);
-    auto t = prepare("INSERT INTO password VALUES (?, ?)");
-    t->bind_text(0, user->get_id());
-    auto hash = hash_password(passcode);
-    t->bind_blob(1, (void *)hash, PASSWORD_HASH_BYTES);
-    t->begin();
-    delete t;
-    delete hash;
-}
-std::vector<Message *> ServerOrm::get_messages(User *owner) const {
-    auto contacts = get_contacts(owner);
-    std::vector<std::string> group_ids;
-    std::transform(std::find_if(contacts.begin(), contacts.end(),
-                                [&](Entity *ctc) {
-                                    return (dynamic_cast<Group *>(ctc) !=
-                                            nullptr);
-                                }),
-                   contacts.end(), std::back_inserter(group_ids),
-                   [&](Entity *e) { return e->get_id(); });
-    std::vector<Message *> r;
-    for (auto msg : TiOrm::get_messages()) {
-        if (msg->is_visible_by(owner)) {
-            r.push_back(msg);
-        }
+    std::string hash;
+    try {
+        hash = hasher.hash(passcode).get();
+    } catch (...) {
+        delete user;
+        throw;
     }
-    return r;
+    add_entity(user);
+    write([&] {
+        auto t = prepare("INSERT INTO password VALUES (?, ?)");
+        t->bind_text(0, user->get_id());
+        t->bind_blob(1, (void *)hash.data(), PASSWORD_HASH_BYTES);
+        t->begin();
+        delete t;
+    });
 }
-
-TiServer::TiServer(std::string addr, short port, const std::string &dbfile)
+const PasswordHasher &ServerOrm::get_hasher() const { return hasher; }
+TiServer::TiServer(std::string addr, short port, const std::string &dbfile,
+                   size_t cache_bytes)
     : Server(std::move(addr), port), db(dbfile) {
+    db.set_cache_limit(cache_bytes);
     db.pull();
+    db.set_group_commit(SERVER_GROUP_COMMIT_MS);
+}
+TiServer::~TiServer() {
+    auto s = db.get_hasher().get_stats();
+    auto n = std::max<size_t>(s.hashed, 1);
+    logD("[server] hashed %zu passwords, %.1f ms queued and %.1f ms hashing "
+         "on average. %zu turned down, %zu timed out",
+         s.hashed, s.wait_us / 1000.0 / n, s.hash_us / 1000.0 / n, s.rejected,
+         s.expired);
+}
+Client *TiServer::on_connect(sockaddr_in) {
+    return new TiClient(db, sessions);
+}
+
+SessionRegistry::Shard &SessionRegistry::shard_of(const std::string &user_id) {
+    return shards[std::hash<std::string>()(user_id) % SESSION_SHARD_COUNT];
+}
+void SessionRegistry::add(const std::string &user_id, TiClient *client) {
+    auto &shard = shard_of(user_id);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    shard.sessions[user_id].push_back(client);
+}
+void SessionRegistry::remove(const std::string &user_id, TiClient *client) {
+    auto &shard = shard_of(user_id);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto find = shard.sessions.find(user_id);
+    if (find == shard.sessions.end()) {
+        return;
+    }
+    auto &clients = find->second;
+    clients.erase(std::remove(clients.begin(), clients.end(), client),
+                  clients.end());
+    if (clients.empty()) {
+        shard.sessions.erase(find);
+    }
+}
+size_t SessionRegistry::fan_out(const Message *msg, const TiClient *origin) {
+    std::unordered_set<std::string> targets{msg->get_sender()->get_id()};
+    for (auto u : msg->get_all_receivers()) {
+        targets.insert(u->get_id());
+    }
+    // at most one serialization per format, however many receive it
+    std::string payloads[WIRE_BINARY_V1 + 1];
+    size_t reached = 0, dropped = 0;
+    for (const auto &target : targets) {
+        auto &shard = shard_of(target);
+        // held while pushing, so that none of these clients go away.
+        // Pushing never waits for the network
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto find = shard.sessions.find(target);
+        if (find == shard.sessions.end()) {
+            continue;
+        }
+        for (auto client : find->second) {
+            if (client == origin) {
+                continue;
+            }
+            WireFormat format = client->format;
+            auto &payload = payloads[format];
+            if (payload.empty()) {
+                msg->serialize_with_frames(payload, format);
+            }
+            if (client->push(ResponseCode::MESSAGE, payload.data(),
+                             payload.size())) {
+                reached++;
+            } else {
+                dropped++;
+            }
+        }
+    }
+    if (dropped > 0) {
+        logD("[sessions] %zu connections too slow for message %s",
+             dropped, msg->get_id().c_str());
+    }
+    return reached;
 }
-TiServer::~TiServer() = default;
-Client *TiServer::on_connect(sockaddr_in addr) { return new TiClient(db); }
 
-TiClient::TiClient(ServerOrm &db)
-    : db(db), user(nullptr), token(), id(nanoid::generate()) {}
+TiClient::TiClient(ServerOrm &db, SessionRegistry &sessions)
+    : db(db), sessions(sessions), id(generate_id()), user(nullptr),
+      logged_in(), token(), subscribed(), format(WIRE_TEXT) {}
 TiClient::~TiClient() = default;
+void TiClient::subscribe(User *next) {
+    if (!subscribed.empty()) {
+        sessions.remove(subscribed, this);
+        subscribed.clear();
+    }
+    if (next != nullptr) {
+        subscribed = next->get_id();
+        sessions.add(subscribed, this);
+    }
+}
 void TiClient::on_connect(sockaddr_in addr) {
-    logD("[client %s] connected to %s", id.c_str(), inet_ntoa(addr.sin_addr));
+    char ip[INET_ADDRSTRLEN];
+    peer = inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    logD("[client %s] connected to %s", id.c_str(), peer.c_str());
 }
 void TiClient::on_message(ti::RequestCode req, char *data, size_t len) {
+    // whatever the request faults in stays put until it's answered
+    orm::TiOrm::CacheScope scope(db);
+    // the one from the last request may have been replaced or deleted
+    user = logged_in.empty() ? nullptr : db.get_user(logged_in);
+    if (req == SEND_MESSAGE) {
+        // the message isn't made of NUL-terminated strings
+        logD("[client %s] send_message(%zu bytes)", id.c_str(), len);
+        send_message(data, len);
+        return;
+    }
     auto body = ti::helper::read_message_body(data, len);
     switch (req) {
     case LOGIN:
@@ -202,16 +334,34 @@ void TiClient::on_message(ti::RequestCode req, char *data, size_t len) {
         logD("[client %s] reconnect(%s)", id.c_str(), body[0].c_str());
         reconnect(body[0]);
         break;
+    case HELLO:
+        hello(body.empty() ? "" : body[0]);
+        logD("[client %s] hello, wire format %d", id.c_str(),
+             format.load());
+        break;
+    case SEND_MESSAGE:
+        // answered above
+        break;
     }
 }
 
 void TiClient::user_login(const std::string &user_id,
                           const std::string &password) {
-    if (db.check_password(user_id, password)) {
-        token = nanoid::generate();
+    bool match;
+    try {
+        match = db.check_password(user_id, password);
+    } catch (const HasherBusy &e) {
+        send(ResponseCode::BUSY);
+        return;
+    }
+    if (match) {
+        token = generate_id();
         user = db.get_user(user_id);
+        logged_in = user_id;
+        // indexed before the client may reconnect with it
+        db.add_token(user, token, peer);
         send(ResponseCode::OK, (void *)token.c_str(), token.length());
-        db.add_token(user, token);
+        subscribe(user);
         logD("[client %s] logged in as %s", id.c_str(), user_id.c_str());
     } else {
         send(ResponseCode::NOT_FOUND);
@@ -223,6 +373,7 @@ void TiClient::user_delete(const std::string &curr_token) {
         send(ResponseCode::TOKEN_EXPIRED);
     } else {
         try {
+            subscribe(nullptr);
             db.delete_entity(user);
             send(ResponseCode::OK);
         } catch (std::runtime_error &e) {
@@ -231,86 +382,59 @@ void TiClient::user_delete(const std::string &curr_token) {
     }
 }
 
+void TiClient::hello(const std::string &max_format) {
+    int max;
+    try {
+        max = std::stoi(max_format);
+    } catch (const std::exception &e) {
+        max = WIRE_TEXT;
+    }
+    format = max >= WIRE_BINARY_V1 ? WIRE_BINARY_V1 : WIRE_TEXT;
+}
+
 void TiClient::reconnect(const std::string &old_token) {
     user = db.check_token(old_token);
     if (user == nullptr) {
+        logged_in.clear();
         send(ti::ResponseCode::NOT_FOUND);
     } else {
+        logged_in = user->get_id();
         token = old_token;
+        subscribe(user);
         auto res = user->get_id();
         send(ti::ResponseCode::OK, (void *)res.c_str(), res.length());
     }
 }
 
-size_t memappend(char **src, size_t src_count, size_t *src_len, char *dest) {
-    size_t sum = 0;
-    for (size_t i = 0; i < src_count; ++i) {
-        std::memcpy(dest + sum, src, src_len[i]);
-        sum += src_len[0];
+/**
+ * Stream the given sections, each a count followed by one block per
+ * serialized object, serializing them one at a time as they are sent
+ * @param end whether they end the response
+ */
+void write_sync_response(ChunkWriter &out, WireFormat format,
+                         std::vector<Entity *> *contacts,
+                         std::vector<Frame *> *frames,
+                         std::vector<Message *> *messages, bool end = true) {
+    auto write_section = [&](auto *objects) {
+        if (objects == nullptr) {
+            return;
+        }
+        out.append_block(objects->size());
+        for (auto o : *objects) {
+            char *bs;
+            auto len = o->serialize(&bs, format);
+            out.append_block(len, bs);
+            delete bs;
+        }
+    };
+    write_section(contacts);
+    write_section(frames);
+    write_section(messages);
+    if (end) {
+        out.end();
     }
-    return sum;
 }
 
-#pragma clang diagnostic push
-#pragma ide diagnostic ignored "NullDereference"
-size_t write_sync_response(char **buf, std::vector<Entity *> *contacts,
-                           std::vector<Frame *> *frames,
-                           std::vector<Message *> *messages) {
-    int frames_mask = frames != nullptr ? 1 : 0,
-        messages_mask = messages != nullptr ? 1 : 0,
-        contacts_mask = contacts != nullptr ? 1 : 0;
-    char *frame_bufs[frames_mask * frames->size()],
-        *msg_bufs[messages_mask * messages->size()],
-        *entity_bufs[contacts_mask * contacts->size()];
-    size_t frame_lens[frames_mask * frames->size()],
-        msg_lens[messages_mask * messages->size()],
-        entity_lens[contacts_mask * contacts->size()];
-    size_t sending_len = 0;
-    for (int i = 0; i < contacts_mask * contacts->size(); i++) {
-        entity_lens[i] = (*contacts)[i]->serialize(&entity_bufs[i]);
-        sending_len += entity_lens[i];
-    }
-    for (int i = 0; i < frames_mask * frames->size(); i++) {
-        frame_lens[i] = (*frames)[i]->serialize(&frame_bufs[i]);
-        sending_len += frame_lens[i];
-    }
-    for (int i = 0; i < messages_mask * messages->size(); i++) {
-        msg_lens[i] = (*messages)[i]->serialize(&msg_bufs[i]);
-        sending_len += msg_lens[i];
-    }
-
-    char *sending_buf = (char *)calloc(
-        sending_len +
-            (contacts_mask + frames_mask + messages_mask) * BYTES_LEN_HEADER,
-        sizeof(char));
-    sending_len = 0;
-    if (contacts_mask) {
-        auto len_header = ti::helper::write_len_header(contacts->size());
-        std::memcpy(sending_buf, len_header, BYTES_LEN_HEADER);
-        sending_len += BYTES_LEN_HEADER;
-        sending_len +=
-            memappend(entity_bufs, contacts->size(), entity_lens, sending_buf);
-        delete len_header;
-    }
-    if (frames_mask) {
-        auto len_header = ti::helper::write_len_header(frames->size());
-        std::memcpy(sending_buf + sending_len, len_header, BYTES_LEN_HEADER);
-        sending_len += memappend(frame_bufs, frames->size(), frame_lens,
-                                 sending_buf + sending_len);
-        delete len_header;
-    }
-    if (messages_mask) {
-        auto len_header = ti::helper::write_len_header(messages->size());
-        std::memcpy(sending_buf + sending_len, len_header, BYTES_LEN_HEADER);
-        memappend(msg_bufs, messages->size(), msg_lens,
-                  sending_buf + sending_len);
-        delete len_header;
-    }
-    *buf = sending_buf;
-    return sending_len;
-}
-#pragma clang diagnostic pop
-
 template <typename Iterator>
 size_t write_strings(Iterator first, Iterator last, char **buf) {
     size_t len = std::accumulate(
@@ -348,28 +472,14 @@ void TiClient::sync(const std::string &curr_token,
                                                    selector.length(), '/');
         if (paths[0] == "*") {
             auto contacts = db.get_contacts(user);
-            std::vector<Frame *> frames;
-            auto messages = db.get_messages(user);
-            for (auto msg : messages) {
-                std::copy_if(msg->get_frames().begin(), msg->get_frames().end(),
-                             std::back_inserter(frames), [&](Frame *frame) {
-                                 return std::find(frames.begin(), frames.end(),
-                                                  frame) == frames.end();
-                             });
-            }
-            char *buf;
-            size_t len =
-                write_sync_response(&buf, &contacts, &frames, &messages);
-            send(ResponseCode::OK, buf, len);
-            delete buf;
+            ChunkWriter out(*this);
+            write_sync_response(out, format, &contacts, nullptr, nullptr,
+                                false);
+            write_inbox(out);
         } else if (paths[0] == "messages") {
             if (paths.size() < 2 || paths[1] == "*") {
-                auto messages = db.get_messages(user);
-                char *buf;
-                auto len =
-                    write_sync_response(&buf, nullptr, nullptr, &messages);
-                send(ResponseCode::OK, (void *)buf, len);
-                delete buf;
+                ChunkWriter out(*this);
+                write_inbox(out);
             } else if (paths[1] == "id") {
                 auto messages = db.get_messages(user);
                 char *buf;
@@ -381,15 +491,19 @@ void TiClient::sync(const std::string &curr_token,
                 auto sync = db.get_sync(user);
                 auto hash = sync.get_messages_hash();
                 send(ResponseCode::OK, hash->hash, hash->len);
+            } else if (paths[1] == "since" && paths.size() > 2) {
+                sync_since(paths[0], paths[2]);
+            } else if (paths[1] == "tree" || paths[1] == "range") {
+                sync_tree(paths[0], paths[1] == "range",
+                          paths.size() > 2 ? paths[2] : "");
+            } else {
+                send(ResponseCode::BAD_REQUEST);
             }
         } else if (paths[0] == "contacts") {
             if (paths.size() < 2 || paths[1] == "*") {
                 auto contacts = db.get_contacts(user);
-                char *buf;
-                auto len =
-                    write_sync_response(&buf, &contacts, nullptr, nullptr);
-                send(ResponseCode::OK, (void *)buf, len);
-                delete buf;
+                ChunkWriter out(*this);
+                write_sync_response(out, format, &contacts, nullptr, nullptr);
             } else if (paths[1] == "id") {
                 auto contacts = db.get_contacts(user);
                 char *buf;
@@ -401,11 +515,20 @@ void TiClient::sync(const std::string &curr_token,
                 auto sync = db.get_sync(user);
                 auto hash = sync.get_contacts_hash();
                 send(ResponseCode::OK, hash->hash, hash->len);
+            } else if (paths[1] == "since" && paths.size() > 2) {
+                sync_since(paths[0], paths[2]);
+            } else if (paths[1] == "tree" || paths[1] == "range") {
+                sync_tree(paths[0], paths[1] == "range",
+                          paths.size() > 2 ? paths[2] : "");
+            } else {
+                send(ResponseCode::BAD_REQUEST);
             }
+        } else if (paths[0] == "entities" && paths.size() > 1) {
+            sync_entities(paths[1]);
         } else if (Entity *entity = db.get_entity(paths[0])) {
             if (paths.size() < 2 || paths[1] == "*") {
                 char *buf;
-                size_t len = entity->serialize(&buf);
+                size_t len = entity->serialize(&buf, format);
                 send(ResponseCode::OK, buf, len);
                 delete buf;
             } else if (paths[1] == "id") {
@@ -440,38 +563,28 @@ void TiClient::sync(const std::string &curr_token,
                 } else {
                     send(ResponseCode::BAD_REQUEST);
                 }
+            } else {
+                send(ResponseCode::BAD_REQUEST);
             }
         } else if (Message *message = db.get_message(paths[0])) {
-            auto messages = db.get_messages(user);
-            if (std::find(messages.begin(), messages.end(), message) ==
-                messages.end()) {
+            if (!db.is_visible(message, user)) {
                 send(ResponseCode::NOT_FOUND);
             } else if (paths.size() < 2 || paths[1] == "*") {
                 char *bs;
-                auto len = message->serialize(&bs);
+                auto len = message->serialize(&bs, format);
                 send(ResponseCode::OK, (void *)bs, len);
+                delete bs;
             } else if (paths[1] == "frames") {
-                auto frames = message->get_frames();
-                char *frmbs[message->get_frames().size()];
-                size_t frmlens[message->get_frames().size()], frmstotallen = 0;
-                for (int i = 0; i < frames.size(); ++i) {
-                    frmlens[i] = frames[i]->serialize(frmbs + i);
-                    frmstotallen += frmlens[i];
-                }
-
-                char *bs = (char *)calloc(BYTES_LEN_HEADER + frmstotallen,
-                                          sizeof(char));
-                char *bf = ti::helper::write_len_header(frames.size());
-                std::memcpy(bs, bf, BYTES_LEN_HEADER);
-                delete bf;
-                size_t ptr = BYTES_LEN_HEADER;
-                for (int i = 0; i < frames.size(); ++i) {
-                    std::memcpy(bs + ptr, frmbs[i], frmlens[i]);
-                    ptr += frmlens[i];
+                // frames don't carry their length, so each gets a header
+                std::string out;
+                ti::helper::append_block(out, message->get_frames().size());
+                for (auto f : message->get_frames()) {
+                    char *bs;
+                    auto len = f->serialize(&bs, format);
+                    ti::helper::append_block(out, len, bs);
+                    delete bs;
                 }
-                send(ResponseCode::OK, (void *)bs,
-                     BYTES_LEN_HEADER + frmstotallen);
-                delete bs;
+                send(ResponseCode::OK, (void *)out.data(), out.size());
             } else if (paths[1] == "id") {
                 send(ResponseCode::OK, (void *)paths[0].c_str(),
                      paths[0].length());
@@ -485,6 +598,8 @@ void TiClient::sync(const std::string &curr_token,
                 auto src = message->get_forward_source();
                 auto cid = src == nullptr ? "" : src->get_id();
                 send(ResponseCode::OK, (void *)cid.c_str(), cid.length());
+            } else {
+                send(ResponseCode::BAD_REQUEST);
             }
         } else {
             send(ResponseCode::NOT_FOUND);
@@ -492,6 +607,162 @@ void TiClient::sync(const std::string &curr_token,
     }
 }
 
+void TiClient::sync_since(const std::string &field,
+                          const std::string &cursor) {
+    long since;
+    try {
+        since = std::stol(cursor);
+    } catch (const std::exception &e) {
+        send(ResponseCode::BAD_REQUEST);
+        return;
+    }
+    // a cursor from the future means the client is ahead of this
+    // database, so it gets everything again
+    auto seq = db.get_sync_seq(user);
+    if (since > seq) {
+        since = 0;
+    }
+    std::vector<std::string> removed, added;
+    if (since > 0) {
+        auto changes = db.get_changelog(user, field, since);
+        // read after the log, so that a compaction in between shows.
+        // A cursor behind the floor may have missed what was forgotten
+        if (since < db.get_changelog_floor(user)) {
+            since = 0;
+        } else {
+            seq = since;
+            for (const auto &change : changes) {
+                seq = change.seq;
+                (change.removed ? removed : added).push_back(change.id);
+            }
+        }
+    }
+
+    ChunkWriter out(*this);
+    out.append_block(seq);
+    out.append_block(removed.size());
+    for (const auto &id : removed) {
+        out.append_block(id.length(), id.c_str());
+    }
+    if (field == "contacts") {
+        auto contacts = since == 0 ? db.get_contacts(user)
+                                   : std::vector<Entity *>();
+        for (const auto &id : added) {
+            if (auto e = db.get_entity(id)) {
+                contacts.push_back(e);
+            }
+        }
+        write_sync_response(out, format, &contacts, nullptr, nullptr);
+    } else if (since == 0) {
+        // whatever was stored before the change log existed isn't in
+        // there, so start from a snapshot. Changes logged after seq was
+        // read are sent again next time, which the client tolerates
+        write_inbox(out, true);
+    } else {
+        size_t next = 0;
+        write_pages(out, true, [&] {
+            std::vector<Message *> page;
+            for (; next < added.size() && page.size() < SYNC_PAGE_MESSAGES;
+                 ++next) {
+                if (auto m = db.get_message(added[next])) {
+                    page.push_back(m);
+                }
+            }
+            return page;
+        });
+    }
+}
+
+void TiClient::write_inbox(ChunkWriter &out, bool entities) {
+    long long after = 0;
+    write_pages(out, entities, [&] {
+        return db.get_messages(user, after, SYNC_PAGE_MESSAGES);
+    });
+}
+
+void TiClient::write_pages(
+    ChunkWriter &out, bool entities,
+    const std::function<std::vector<Message *>()> &next_page) {
+    std::unordered_set<std::string> carried;
+    std::vector<Entity *> referred;
+    std::function<void(Entity *)> carry = [&](Entity *e) {
+        if (e == nullptr || !carried.insert(e->get_id()).second) {
+            return;
+        }
+        if (auto *g = dynamic_cast<Group *>(e)) {
+            for (auto m : g->get_members()) {
+                carry(m);
+            }
+        }
+        referred.push_back(e);
+    };
+    while (true) {
+        // what the page loads is let go before the next one
+        orm::TiOrm::CacheScope scope(db);
+        auto messages = next_page();
+        std::vector<Frame *> frames;
+        std::unordered_set<Frame *> seen;
+        referred.clear();
+        for (auto m : messages) {
+            if (entities) {
+                carry(m->get_sender());
+                carry(m->get_receiver());
+                carry(m->get_forward_source());
+            }
+            std::copy_if(m->get_frames().begin(), m->get_frames().end(),
+                         std::back_inserter(frames), [&](Frame *frame) {
+                             return seen.insert(frame).second;
+                         });
+        }
+        write_sync_response(out, format, entities ? &referred : nullptr,
+                            &frames, &messages, messages.empty());
+        if (messages.empty()) {
+            return;
+        }
+    }
+}
+
+void TiClient::sync_entities(const std::string &ids) {
+    auto list = ti::helper::read_message_body(ids.c_str(), ids.length(), ',');
+    ChunkWriter out(*this);
+    out.append_block(list.size());
+    for (const auto &id : list) {
+        auto entity = db.get_entity(id);
+        if (entity == nullptr) {
+            out.append_block(0);
+            continue;
+        }
+        char *bs;
+        auto len = entity->serialize(&bs, format);
+        out.append_block(len, bs);
+        delete bs;
+    }
+    out.end();
+}
+
+void TiClient::sync_tree(const std::string &field, bool range,
+                         const std::string &prefix) {
+    std::string out;
+    try {
+        if (range) {
+            auto ids = db.get_sync_range(user, field, prefix);
+            ti::helper::append_block(out, ids.size());
+            for (const auto &id : ids) {
+                ti::helper::append_block(out, id.length(), id.c_str());
+            }
+        } else {
+            for (const auto &node : db.get_sync_children(user, field, prefix)) {
+                ti::helper::append_block(out, node.count);
+                out.append(node.hash);
+            }
+        }
+    } catch (const std::runtime_error &e) {
+        send(ResponseCode::BAD_REQUEST);
+        return;
+    }
+    send(ResponseCode::OK, (void *)out.data(), out.size());
+}
+
 void TiClient::determine(const std::string &curr_token, int token_id) {
     if (curr_token != token || user == nullptr) {
         send(ResponseCode::TOKEN_EXPIRED);
@@ -506,6 +777,7 @@ void TiClient::logout(const std::string &curr_token) {
     if (token != curr_token || user == nullptr) {
         send(ResponseCode::TOKEN_EXPIRED);
     } else if (db.invalidate_token(token, user)) {
+        subscribe(nullptr);
         send(ResponseCode::OK);
     } else {
         send(ResponseCode::NOT_FOUND);
@@ -519,10 +791,71 @@ void TiClient::user_register(const std::string &user_name,
     if (invalid != user_name.end()) {
         send(ResponseCode::BAD_REQUEST);
     } else {
-        auto user_id = nanoid::generate();
-        db.add_user(new User(user_id, user_name, {}, 0), passcode);
+        auto user_id = generate_id();
+        try {
+            db.add_user(new User(user_id, user_name, {}, 0), passcode);
+        } catch (const HasherBusy &e) {
+            send(ResponseCode::BUSY);
+            return;
+        }
         send(ResponseCode::OK, (void *)user_id.c_str(), user_id.length());
     }
 }
 
-void TiClient::on_disconnect() { logD("%s disconnected", id.c_str()); }
+void TiClient::send_message(const char *data, size_t len) {
+    auto end = (const char *)std::memchr(data, '\0', len);
+    if (end == nullptr) {
+        send(ResponseCode::BAD_REQUEST);
+        return;
+    }
+    if (std::string(data, end) != token || user == nullptr) {
+        send(ResponseCode::TOKEN_EXPIRED);
+        return;
+    }
+    size_t ptr = end - data + 1;
+    Message *msg;
+    try {
+        msg = Message::deserialize_with_frames(
+            data + ptr, len - ptr,
+            [&](StringView eid) { return db.get_entity(eid.str()); });
+    } catch (const std::runtime_error &e) {
+        logD("[client %s] bad message: %s", id.c_str(), e.what());
+        send(ResponseCode::BAD_REQUEST);
+        return;
+    }
+    auto discard = [&] {
+        for (auto f : msg->get_frames()) {
+            delete f;
+        }
+        delete msg;
+    };
+    if (msg->get_sender() != user) {
+        discard();
+        send(ResponseCode::BAD_REQUEST);
+        return;
+    }
+    if (db.get_message(msg->get_id()) != nullptr) {
+        // sent again after the answer got lost
+        discard();
+        send(ResponseCode::OK);
+        return;
+    }
+    for (auto f : msg->get_frames()) {
+        if (db.get_frame(f->get_id()) != nullptr) {
+            discard();
+            send(ResponseCode::BAD_REQUEST);
+            return;
+        }
+    }
+    // stored first, so whoever misses the push finds it by syncing
+    db.add_message(msg);
+    send(ResponseCode::OK);
+    auto reached = sessions.fan_out(msg, this);
+    logD("[client %s] pushed %s to %zu connections", id.c_str(),
+         msg->get_id().c_str(), reached);
+}
+
+void TiClient::on_disconnect() {
+    subscribe(nullptr);
+    logD("%s disconnected", id.c_str());
+}
@@ -0,0 +1,166 @@
+#include "tokens.h"
+#include "ti.h"
+#include <algorithm>
+
+using namespace ti::server;
+
+TokenIndex::TokenIndex(time_t ttl)
+    : ttl(ttl), tick(ttl / TOKEN_WHEEL_SLOTS + 1) {}
+
+TokenIndex::Shard &TokenIndex::shard_of(const std::string &token) {
+    return shards[std::hash<std::string>()(token) % TOKEN_SHARD_COUNT];
+}
+
+void TokenIndex::schedule(Shard &shard, const std::string &token,
+                          time_t deadline) {
+    // the first tick at or after the deadline, so that whatever
+    // comes up in a slot is due
+    auto due = (deadline + tick - 1) / tick;
+    shard.wheel[due % TOKEN_WHEEL_SLOTS].push_back(token);
+}
+
+void TokenIndex::sweep(Shard &shard, time_t now,
+                       std::vector<TokenSession> &expired) {
+    auto target = now / tick;
+    auto steps = std::min<time_t>(target - shard.swept, TOKEN_WHEEL_SLOTS);
+    for (time_t i = 1; i <= steps; ++i) {
+        std::vector<std::string> due;
+        due.swap(shard.wheel[(shard.swept + i) % TOKEN_WHEEL_SLOTS]);
+        for (const auto &token : due) {
+            auto find = shard.sessions.find(token);
+            if (find == shard.sessions.end()) {
+                // removed since
+                continue;
+            }
+            auto deadline = find->second.last_seen + ttl;
+            if (deadline <= now) {
+                expired.push_back(std::move(find->second));
+                shard.sessions.erase(find);
+            } else {
+                schedule(shard, token, deadline);
+            }
+        }
+    }
+    shard.swept = std::max(shard.swept, target);
+}
+
+void TokenIndex::forget_rows(const std::vector<TokenSession> &sessions) {
+    if (sessions.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(rowmtx);
+    for (const auto &s : sessions) {
+        rows.erase(s.row_id);
+    }
+}
+
+void TokenIndex::put(const std::string &token, const TokenSession &session,
+                     time_t now, std::vector<TokenSession> &expired) {
+    size_t before = expired.size();
+    {
+        auto &shard = shard_of(token);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        sweep(shard, now, expired);
+        shard.sessions[token] = session;
+        schedule(shard, token, session.last_seen + ttl);
+    }
+    forget_rows(std::vector<TokenSession>(expired.begin() + before,
+                                          expired.end()));
+    std::lock_guard<std::mutex> lock(rowmtx);
+    rows[session.row_id] = token;
+}
+
+bool TokenIndex::touch(const std::string &token, time_t now,
+                       TokenSession &found,
+                       std::vector<TokenSession> &expired) {
+    size_t before = expired.size();
+    bool alive = false;
+    {
+        auto &shard = shard_of(token);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        sweep(shard, now, expired);
+        auto find = shard.sessions.find(token);
+        if (find != shard.sessions.end()) {
+            if (find->second.last_seen + ttl <= now) {
+                // due, but its slot hasn't come up yet
+                expired.push_back(std::move(find->second));
+                shard.sessions.erase(find);
+            } else {
+                found = find->second;
+                find->second.last_seen = now;
+                alive = true;
+            }
+        }
+    }
+    forget_rows(std::vector<TokenSession>(expired.begin() + before,
+                                          expired.end()));
+    return alive;
+}
+
+bool TokenIndex::remove(const std::string &token, const User *owner,
+                        TokenSession &removed) {
+    {
+        auto &shard = shard_of(token);
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto find = shard.sessions.find(token);
+        if (find == shard.sessions.end() ||
+            (owner != nullptr && find->second.user_id != owner->get_id())) {
+            return false;
+        }
+        removed = std::move(find->second);
+        shard.sessions.erase(find);
+    }
+    std::lock_guard<std::mutex> lock(rowmtx);
+    auto row = rows.find(removed.row_id);
+    if (row != rows.end() && row->second == token) {
+        rows.erase(row);
+    }
+    return true;
+}
+
+bool TokenIndex::remove(long long row_id, const User *owner,
+                        TokenSession &removed) {
+    std::string token;
+    {
+        std::lock_guard<std::mutex> lock(rowmtx);
+        auto find = rows.find(row_id);
+        if (find == rows.end()) {
+            return false;
+        }
+        token = find->second;
+    }
+    return remove(token, owner, removed);
+}
+
+void TokenIndex::expire(time_t now, std::vector<TokenSession> &expired) {
+    size_t before = expired.size();
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        sweep(shard, now, expired);
+    }
+    forget_rows(std::vector<TokenSession>(expired.begin() + before,
+                                          expired.end()));
+}
+
+void TokenIndex::clear() {
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        shard.sessions.clear();
+        for (auto &slot : shard.wheel) {
+            slot.clear();
+        }
+    }
+    std::lock_guard<std::mutex> lock(rowmtx);
+    rows.clear();
+}
+
+size_t TokenIndex::size() {
+    size_t n = 0;
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        n += shard.sessions.size();
+    }
+    return n;
+}
+
+time_t TokenIndex::get_tick() const { return tick; }
@@ -0,0 +1,18 @@
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <kat.h>
+
+// what the server hashes passwords with
+#define BENCH_T_COST 4
+#define BENCH_M_COST (1 << 16)
+#define BENCH_LANES 1
+
+int main(int argc, char const *argv[]) {
+    uint32_t t_cost = argc > 1 ? std::atoi(argv[1]) : BENCH_T_COST;
+    uint32_t m_cost = argc > 2 ? std::atoi(argv[2]) : BENCH_M_COST;
+    uint32_t lanes = argc > 3 ? std::atoi(argv[3]) : BENCH_LANES;
+    std::cout << "Argon2i, " << t_cost << " passes over " << m_cost
+              << " KiB in " << lanes << " lanes" << std::endl;
+    return BenchmarkKernels(t_cost, m_cost, lanes) ? 0 : 1;
+}
@@ -34,6 +34,7 @@ class DueClientTest : public ClientTest {
         client2->stop();
         delete client2;
         std::remove(dbfile2.c_str());
+        ClientTest::TearDown();
     }
 };
 
@@ -45,4 +46,45 @@ TEST_F(ClientTest, Login) {
 
 TEST_F(ClientTest, Sync) {
 
+}
+
+TEST_F(ClientTest, Async) {
+    std::vector<std::future<client::Response>> futures;
+    for (int i = 0; i < 256; ++i) {
+        futures.push_back(client->send_async(RequestCode::RECONNECT,
+                                             client::req_body(nanoid::generate())));
+    }
+    for (auto &f : futures) {
+        auto res = f.get();
+        ASSERT_EQ(res.code, ResponseCode::NOT_FOUND);
+        delete res.buff;
+    }
+}
+
+TEST_F(DueClientTest, Push) {
+    client2->start();
+    auto id = client->user_reg(user_name, password),
+         id2 = client2->user_reg("testificate_woman", password);
+    ASSERT_TRUE(client->user_login(id, password));
+    ASSERT_TRUE(client2->user_login(id2, password));
+    ASSERT_NE(client->get_entity_or_download(id2), nullptr);
+
+    time_t now;
+    time(&now);
+    auto frame = new TextFrame(nanoid::generate(), "pushed");
+    auto msg = new Message(nanoid::generate(), {frame}, now,
+                           client->get_entity_or_download(id),
+                           client->get_entity_or_download(id2), nullptr);
+    ASSERT_TRUE(client->send(msg));
+    ASSERT_TRUE(client2->wait_for_message(5000));
+    // what a sync would have cached
+    ASSERT_NE(client2->get_entity_or_download(id), nullptr);
+    ASSERT_NE(client2->get_entity_or_download(id2), nullptr);
+    auto received = client2->receive();
+    ASSERT_EQ(received.size(), 1);
+    ASSERT_EQ(received[0]->get_id(), msg->get_id());
+    ASSERT_EQ(received[0]->get_frames()[0]->to_string(), "pushed");
+
+    ASSERT_TRUE(client->user_delete());
+    ASSERT_TRUE(client2->user_delete());
 }
\ No newline at end of file
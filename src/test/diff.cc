@@ -1,3 +1,4 @@
+#include <chrono>
 #include <gtest/gtest.h>
 #include <helper.h>
 #include <nanoid.h>
@@ -21,4 +22,72 @@ TEST(Diff, Diff) {
     Diff<std::string> diff(a.begin(), a.end(), b.begin(), b.end());
     ASSERT_EQ(diff.plus, plus);
     ASSERT_EQ(diff.minus, minus);
-}
\ No newline at end of file
+}
+
+TEST(Diff, Strategies) {
+    std::vector<std::string> a, b;
+    for (int i = 0; i < 200; ++i) {
+        auto id = nanoid::generate();
+        if (i % 10 != 0) {
+            a.push_back(id);
+        }
+        if (i % 10 != 5) {
+            b.push_back(id);
+        }
+    }
+    Diff<std::string> linear(a.begin(), a.end(), b.begin(), b.end(),
+                             linear_search_tag());
+    Diff<std::string> hashed(a.begin(), a.end(), b.begin(), b.end());
+    Diff<std::string> sorted(a.begin(), a.end(), b.begin(), b.end(),
+                             sorted_merge_tag());
+    ASSERT_EQ(linear.plus.size(), 20);
+    ASSERT_EQ(linear.minus.size(), 20);
+    ASSERT_EQ(hashed.plus, linear.plus);
+    ASSERT_EQ(hashed.minus, linear.minus);
+    std::sort(linear.plus.begin(), linear.plus.end());
+    std::sort(linear.minus.begin(), linear.minus.end());
+    ASSERT_EQ(sorted.plus, linear.plus);
+    ASSERT_EQ(sorted.minus, linear.minus);
+
+    // ids of other lengths are hashed as they are
+    a.push_back("short");
+    Diff<std::string> mixed(a.begin(), a.end(), b.begin(), b.end(),
+                            hash_set_tag());
+    ASSERT_EQ(mixed.plus.size(), 21);
+    ASSERT_EQ(mixed.plus.back(), "short");
+
+    std::vector<int> x{1, 2, 3, 4}, y{3, 4, 5};
+    Diff<int> ints(x.begin(), x.end(), y.begin(), y.end(), hash_set_tag());
+    ASSERT_EQ(ints.plus, (std::vector<int>{1, 2}));
+    ASSERT_EQ(ints.minus, std::vector<int>{5});
+}
+
+// run with --gtest_also_run_disabled_tests
+TEST(Diff, DISABLED_Benchmark) {
+    const int n = 1000000;
+    std::vector<std::string> a, b;
+    a.reserve(n);
+    b.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        auto id = nanoid::generate();
+        if (i % 100 != 0) {
+            a.push_back(id);
+        }
+        if (i % 100 != 50) {
+            b.push_back(id);
+        }
+    }
+    auto measure = [&](const char *name, auto strategy) {
+        auto start = std::chrono::steady_clock::now();
+        Diff<std::string> diff(a.begin(), a.end(), b.begin(), b.end(),
+                               strategy);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+        std::cout << name << ": " << ms << " ms" << std::endl;
+        ASSERT_EQ(diff.plus.size(), n / 100);
+        ASSERT_EQ(diff.minus.size(), n / 100);
+    };
+    measure("sorted merge", sorted_merge_tag());
+    measure("hash set", hash_set_tag());
+}
@@ -0,0 +1,107 @@
+#include <executor.h>
+#include <future>
+#include <gtest/gtest.h>
+
+using ti::server::Executor;
+
+namespace {
+/**
+ * Counts the tasks that ran, so a test can wait for some of them
+ */
+class Counter {
+    std::mutex mtx;
+    std::condition_variable cv;
+    int count = 0;
+
+  public:
+    void add() {
+        std::lock_guard<std::mutex> lock(mtx);
+        count++;
+        cv.notify_all();
+    }
+    bool wait_for(int n) {
+        std::unique_lock<std::mutex> lock(mtx);
+        return cv.wait_for(lock, std::chrono::seconds(5),
+                           [&] { return count >= n; });
+    }
+    int get() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return count;
+    }
+};
+} // namespace
+
+TEST(Executor, Bounded) {
+    std::promise<void> started, release;
+    auto released = release.get_future().share();
+    std::atomic<int> rooms{0};
+    Executor executor(1, 2);
+    executor.set_room_listener([&] { rooms++; });
+    executor.submit([&] {
+        started.set_value();
+        released.wait();
+    });
+    // taken off the queue, so it doesn't count against the depth
+    started.get_future().wait();
+
+    Counter ran;
+    // the first task waits for release, so nothing here may return early
+    EXPECT_TRUE(executor.try_submit([&] { ran.add(); }));
+    EXPECT_TRUE(executor.try_submit([&] { ran.add(); }));
+    EXPECT_FALSE(executor.try_submit([&] { ran.add(); }));
+    EXPECT_EQ(rooms, 0);
+
+    std::atomic<bool> submitted{false};
+    std::thread blocked([&] {
+        executor.submit([&] { ran.add(); });
+        submitted = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(submitted);
+
+    release.set_value();
+    blocked.join();
+    ASSERT_TRUE(ran.wait_for(3));
+    // told once for the task turned down
+    ASSERT_EQ(rooms, 1);
+}
+
+TEST(Executor, Stealing) {
+    std::promise<void> started, release;
+    auto released = release.get_future().share();
+    Executor executor(2, 64);
+    executor.submit([&] {
+        started.set_value();
+        released.wait();
+    });
+    started.get_future().wait();
+
+    // half of these land in the queue of the worker that is stuck
+    Counter ran;
+    for (int i = 0; i < 16; ++i) {
+        executor.submit([&] { ran.add(); });
+    }
+    bool stolen = ran.wait_for(16);
+    release.set_value();
+    ASSERT_TRUE(stolen);
+}
+
+TEST(Executor, ShutdownRunsQueued) {
+    Counter ran;
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    std::thread releaser([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        release.set_value();
+    });
+    {
+        Executor executor(1, 64);
+        executor.submit([=] { released.wait(); });
+        for (int i = 0; i < 32; ++i) {
+            executor.submit([&] { ran.add(); });
+        }
+        // gone while all of them still wait behind the first
+    }
+    releaser.join();
+    ASSERT_EQ(ran.get(), 32);
+}
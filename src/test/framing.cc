@@ -0,0 +1,133 @@
+#include <gtest/gtest.h>
+#include <helper.h>
+#include <ringbuffer.h>
+#include <server.h>
+
+using namespace ti::helper;
+
+TEST(Framing, LenHeader) {
+    for (size_t len : {0ul, 1ul, 127ul, 128ul, 255ul, 4096ul, 1ul << 40}) {
+        char *header = write_len_header(len);
+        ASSERT_EQ(read_len_header(header), len);
+        delete header;
+    }
+}
+
+TEST(Framing, Blocks) {
+    std::string out;
+    append_block(out, 2);
+    append_block(out, 5, "hello");
+    append_block(out, 0, "");
+    size_t ptr = 0;
+    ASSERT_EQ(read_len_header(out.data(), out.size(), ptr), 2);
+    ASSERT_EQ(read_block(out.data(), out.size(), ptr), "hello");
+    ASSERT_EQ(read_block(out.data(), out.size(), ptr), "");
+    ASSERT_EQ(ptr, out.size());
+    ASSERT_THROW(read_block(out.data(), out.size(), ptr), std::runtime_error);
+    ptr = BYTES_LEN_HEADER;
+    ASSERT_THROW(read_block(out.data(), BYTES_LEN_HEADER * 2 + 4, ptr),
+                 std::runtime_error);
+}
+
+namespace {
+class Recorder : public ti::server::Client {
+  public:
+    std::vector<std::pair<ti::ResponseCode, std::string>> frames;
+    Recorder() {
+        initialize([this](ti::ResponseCode res, void *data, size_t len) {
+            frames.emplace_back(res, std::string((char *)data, len));
+        });
+    }
+    void on_connect(sockaddr_in addr) override {}
+    void on_message(ti::RequestCode req, char *data, size_t len) override {}
+    void on_disconnect() override {}
+};
+} // namespace
+
+TEST(Framing, ChunkWriter) {
+    Recorder client;
+    ti::server::ChunkWriter out(client, 32);
+    std::string expected;
+    out.append_block(3);
+    append_block(expected, 3);
+    for (auto block : {"first block", "second block", "third"}) {
+        out.append_block(std::strlen(block), block);
+        append_block(expected, std::strlen(block), block);
+    }
+    out.end();
+
+    ASSERT_EQ(client.frames.size(), 3);
+    ASSERT_EQ(client.frames.back().first, ti::ResponseCode::OK);
+    ASSERT_TRUE(client.frames.back().second.empty());
+    std::string joined;
+    for (size_t i = 0; i + 1 < client.frames.size(); ++i) {
+        ASSERT_EQ(client.frames[i].first, ti::ResponseCode::CHUNK);
+        // every chunk reads on its own
+        auto &chunk = client.frames[i].second;
+        size_t ptr = i == 0 ? BYTES_LEN_HEADER : 0;
+        while (ptr < chunk.size()) {
+            read_block(chunk.data(), chunk.size(), ptr);
+        }
+        joined += chunk;
+    }
+    ASSERT_EQ(joined, expected);
+}
+
+TEST(Framing, RingBufferWrap) {
+    RingBuffer ring;
+    ring.reserve(64);
+    ASSERT_EQ(ring.capacity(), 64);
+
+    RingBuffer::Region regions[2];
+    ASSERT_EQ(ring.free_regions(regions), 1);
+    std::memset(regions[0].data, 'a', 48);
+    ring.commit(48);
+    ring.consume(40);
+
+    // the next 40 bytes wrap around the end
+    ASSERT_EQ(ring.free_regions(regions), 2);
+    ASSERT_EQ(regions[0].len + regions[1].len, 56);
+    std::memset(regions[0].data, 'b', regions[0].len);
+    std::memset(regions[1].data, 'b', 40 - regions[0].len);
+    ring.commit(40);
+    ASSERT_EQ(ring.size(), 48);
+
+    std::vector<char> scratch;
+    char *view = ring.view(8, 40, scratch);
+    ASSERT_EQ(view, scratch.data());
+    ASSERT_EQ(std::string(view, 40), std::string(40, 'b'));
+    view = ring.view(0, 8, scratch);
+    ASSERT_EQ(std::string(view, 8), std::string(8, 'a'));
+}
+
+TEST(Framing, RingBufferGrow) {
+    RingBuffer ring;
+    ring.reserve(64);
+    RingBuffer::Region regions[2];
+    ring.free_regions(regions);
+    for (int i = 0; i < 64; ++i) {
+        regions[0].data[i] = (char)i;
+    }
+    ring.commit(64);
+    ring.consume(32);
+    ASSERT_EQ(ring.free_regions(regions), 1);
+    for (int i = 0; i < 32; ++i) {
+        regions[0].data[i] = (char)(i + 64);
+    }
+    ring.commit(32);
+    ASSERT_EQ(ring.free_regions(regions), 0);
+
+    ring.reserve(100);
+    ASSERT_EQ(ring.capacity(), 128);
+    ASSERT_EQ(ring.size(), 64);
+    std::vector<char> scratch;
+    char *view = ring.view(0, 64, scratch);
+    ASSERT_TRUE(scratch.empty());
+    for (int i = 0; i < 64; ++i) {
+        ASSERT_EQ(view[i], (char)(i + 32));
+    }
+
+    ring.consume(64);
+    ring.release();
+    ASSERT_EQ(ring.capacity(), 0);
+}
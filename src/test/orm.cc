@@ -59,6 +59,22 @@ TEST_F(ServerOrmTest, AddGroup) {
     ASSERT_EQ(gb->get_members()[1]->get_id(), testificate_woman.get_id());
 }
 
+TEST_F(ServerOrmTest, NestedGroup) {
+    sorm->add_entity(new ti::User(testificate_man));
+    sorm->add_entity(new ti::User(testificate_woman));
+    // stored ahead of the group it contains
+    const std::string outer_id = "rHK4kFJhyN2vCjOZJ6bB9";
+    sorm->add_entity(
+        new ti::Group(outer_id, "Outer", {&testificate_man, &group}));
+    sorm->add_entity(new ti::Group(group));
+
+    sorm->pull();
+    auto gb = dynamic_cast<ti::Group *>(sorm->get_entity(outer_id));
+    ASSERT_NE(gb, nullptr);
+    ASSERT_EQ(gb->get_members().size(), 2);
+    ASSERT_EQ(gb->get_members()[1], sorm->get_entity(group.get_id()));
+}
+
 TEST_F(ServerOrmTest, AddMessage) {
     time_t now;
     time(&now);
@@ -100,4 +116,573 @@ TEST_F(ServerOrmTest, AddContact) {
         sorm->get_contacts(sorm->get_user(testificate_man.get_id()));
     ASSERT_EQ(contacts[0]->get_id(), testificate_woman.get_id());
     ASSERT_EQ(contacts[1]->get_id(), group.get_id());
-}
\ No newline at end of file
+}
+TEST_F(ServerOrmTest, Lookup) {
+    auto tm = new ti::User(testificate_man);
+    sorm->add_entity(tm);
+    ASSERT_EQ(sorm->get_entity(testificate_man.get_id()), tm);
+    ASSERT_EQ(sorm->get_entity(testificate_woman.get_id()), nullptr);
+    ASSERT_EQ(sorm->get_message(testificate_man.get_id()), nullptr);
+
+    auto replaced = new ti::User(testificate_man);
+    sorm->add_entity(replaced);
+    ASSERT_EQ(sorm->get_entity(testificate_man.get_id()), replaced);
+    ASSERT_EQ(sorm->get_entities().size(), 1);
+
+    sorm->delete_entity(replaced);
+    ASSERT_EQ(sorm->get_entity(testificate_man.get_id()), nullptr);
+    ASSERT_TRUE(sorm->get_entities().empty());
+    ASSERT_EQ(sorm->get_retired_count(), 0);
+}
+
+TEST_F(ServerOrmTest, Retire) {
+    auto tm = new ti::User(testificate_man),
+         tw = new ti::User(testificate_woman);
+    sorm->add_entity(tm);
+    sorm->add_entity(tw);
+    {
+        ti::orm::TiOrm::CacheScope scope(*sorm);
+        auto man = sorm->get_user(testificate_man.get_id());
+        std::thread([&] {
+            sorm->add_entity(
+                new ti::User(testificate_man.get_id(), "Renamed", "", 0));
+        }).join();
+        // still there for the scope that found it
+        ASSERT_EQ(man->get_name(), testificate_man.get_name());
+        ASSERT_EQ(sorm->get_retired_count(), 1);
+    }
+    ASSERT_EQ(sorm->get_retired_count(), 0);
+
+    // kept while a stored message refers to it
+    auto msg = new ti::Message(nanoid::generate(),
+                               {new ti::TextFrame(nanoid::generate(), "hi")},
+                               0, tw, sorm->get_user(testificate_man.get_id()),
+                               nullptr);
+    sorm->add_message(msg);
+    sorm->delete_entity(tw);
+    ASSERT_EQ(sorm->get_retired_count(), 1);
+    ASSERT_EQ(msg->get_sender()->get_id(), testificate_woman.get_id());
+    ASSERT_TRUE(sorm->delete_message(msg));
+    // looked at again once another one goes
+    sorm->delete_entity(sorm->get_user(testificate_man.get_id()));
+    ASSERT_EQ(sorm->get_retired_count(), 0);
+}
+
+TEST_F(ServerOrmTest, Inbox) {
+    auto tm = new ti::User(testificate_man),
+         tw = new ti::User(testificate_woman);
+    sorm->add_entity(tm);
+    sorm->add_entity(tw);
+    auto g = new ti::Group(group.get_id(), group.get_name(), {tm, tw});
+    sorm->add_entity(g);
+    auto direct = new ti::Message(
+        nanoid::generate(), {new ti::TextFrame(nanoid::generate(), "hi")}, 0,
+        tm, tw, nullptr);
+    auto grouped = new ti::Message(
+        nanoid::generate(), {new ti::TextFrame(nanoid::generate(), "all")},
+        0, tw, g, nullptr);
+    sorm->add_message(direct);
+    sorm->add_message(grouped);
+    sorm->add_contact(tm, tw);
+
+    ASSERT_EQ(sorm->get_messages(tm), std::vector<ti::Message *>{grouped});
+    ASSERT_EQ(sorm->get_messages(tw),
+              (std::vector<ti::Message *>{direct, grouped}));
+    ASSERT_TRUE(sorm->is_visible(grouped, tm));
+    ASSERT_FALSE(sorm->is_visible(direct, tm));
+
+    sorm->pull();
+    auto man = sorm->get_user(testificate_man.get_id());
+    ASSERT_EQ(sorm->get_messages(man).size(), 1);
+    ASSERT_EQ(sorm->get_contacts(man).size(), 1);
+    ASSERT_TRUE(sorm->delete_contact(man, sorm->get_contacts(man)[0]));
+    ASSERT_TRUE(sorm->get_contacts(man).empty());
+}
+
+TEST_F(ServerOrmTest, Regroup) {
+    auto tm = new ti::User(testificate_man),
+         tw = new ti::User(testificate_woman),
+         tx = new ti::User("Xq3vJ9kLmN0pQrStUvWx1", "Testificate X", "", 0);
+    sorm->add_entity(tm);
+    sorm->add_entity(tw);
+    sorm->add_entity(tx);
+    sorm->add_entity(new ti::Group(group.get_id(), group.get_name(), {tm, tw}));
+    std::vector<std::string> sent;
+    for (auto receiver : std::vector<ti::Entity *>{
+             tx, sorm->get_entity(group.get_id()), tx}) {
+        auto msg = new ti::Message(
+            nanoid::generate(), {new ti::TextFrame(nanoid::generate(), "hi")},
+            0, tm, receiver, nullptr);
+        sent.push_back(msg->get_id());
+        sorm->add_message(msg);
+    }
+    auto inbox = [](ti::orm::TiOrm &orm, const std::string &id) {
+        std::vector<std::string> ids;
+        for (auto m : orm.get_messages(orm.get_user(id))) {
+            ids.push_back(m->get_id());
+        }
+        return ids;
+    };
+
+    // x takes woman's place
+    sorm->add_entity(new ti::Group(group.get_id(), group.get_name(), {tm, tx}));
+    ASSERT_EQ(inbox(*sorm, tx->get_id()), sent);
+    ASSERT_TRUE(inbox(*sorm, testificate_woman.get_id()).empty());
+    auto joined = sorm->get_changelog(tx, "messages", 0);
+    ASSERT_EQ(joined.back().id, sent[1]);
+    ASSERT_FALSE(joined.back().removed);
+    auto left = sorm->get_changelog(tw, "messages", 0);
+    ASSERT_EQ(left.size(), 1);
+    ASSERT_TRUE(left[0].removed);
+    {
+        // read the same from the database
+        ti::server::ServerOrm lazy(dbfile);
+        lazy.set_cache_limit(1 << 16);
+        lazy.pull();
+        ASSERT_EQ(inbox(lazy, tx->get_id()), sent);
+        ASSERT_TRUE(inbox(lazy, testificate_woman.get_id()).empty());
+    }
+
+    ASSERT_TRUE(sorm->delete_message(sorm->get_message(sent[1])));
+    ASSERT_EQ(inbox(*sorm, tx->get_id()),
+              (std::vector<std::string>{sent[0], sent[2]}));
+}
+
+TEST_F(ServerOrmTest, ChangeLog) {
+    auto tm = new ti::User(testificate_man),
+         tw = new ti::User(testificate_woman);
+    sorm->add_entity(tm);
+    sorm->add_entity(tw);
+    ASSERT_EQ(sorm->get_sync_seq(tw), 0);
+    auto first = new ti::Message(
+        nanoid::generate(), {new ti::TextFrame(nanoid::generate(), "1")}, 0,
+        tm, tw, nullptr);
+    sorm->add_message(first);
+    auto cursor = sorm->get_sync_seq(tw);
+    ASSERT_GT(cursor, 0);
+
+    auto second = new ti::Message(
+        nanoid::generate(), {new ti::TextFrame(nanoid::generate(), "2")}, 0,
+        tm, tw, nullptr);
+    auto third = new ti::Message(
+        nanoid::generate(), {new ti::TextFrame(nanoid::generate(), "3")}, 0,
+        tm, tw, nullptr);
+    sorm->add_message(second);
+    sorm->add_message(third);
+    sorm->delete_message(first);
+    sorm->delete_message(third);
+    ASSERT_GT(sorm->get_sync_seq(tw), cursor);
+    ASSERT_EQ(sorm->get_sync_seq(tm), 0);
+
+    // third came and went after the cursor, only its removal is left
+    auto changes = sorm->get_changelog(tw, "messages", cursor);
+    ASSERT_EQ(changes.size(), 3);
+    ASSERT_EQ(changes[0].id, second->get_id());
+    ASSERT_FALSE(changes[0].removed);
+    ASSERT_EQ(changes[1].id, first->get_id());
+    ASSERT_TRUE(changes[1].removed);
+    ASSERT_EQ(changes[2].id, third->get_id());
+    ASSERT_TRUE(changes[2].removed);
+    ASSERT_EQ(changes[2].seq, sorm->get_sync_seq(tw));
+    ASSERT_TRUE(sorm->get_changelog(tw, "messages", changes[2].seq).empty());
+    ASSERT_TRUE(sorm->get_changelog(tw, "contacts", 0).empty());
+
+    // the cursor at the first change is the only one left behind
+    ASSERT_EQ(sorm->get_changelog_floor(tw), cursor);
+    sorm->compact_changelog(tw, 2);
+    ASSERT_GT(sorm->get_changelog_floor(tw), cursor);
+    ASSERT_EQ(sorm->get_changelog_floor(tw), changes[1].seq);
+    ASSERT_EQ(sorm->get_changelog(tw, "messages", changes[1].seq).size(), 1);
+    ASSERT_EQ(sorm->get_sync_seq(tw), changes[2].seq);
+    ASSERT_EQ(sorm->get_changelog_floor(tm), 0);
+}
+
+TEST_F(ServerOrmTest, SyncTree) {
+    auto other_file = nanoid::generate() + ".db";
+    auto other = new ti::server::ServerOrm(other_file);
+    std::vector<ti::User *> man, woman;
+    for (auto orm : {(ti::orm::TiOrm *)sorm, (ti::orm::TiOrm *)other}) {
+        man.push_back(new ti::User(testificate_man));
+        woman.push_back(new ti::User(testificate_woman));
+        orm->add_entity(man.back());
+        orm->add_entity(woman.back());
+    }
+    std::vector<std::string> ids;
+    for (int i = 0; i < 100; ++i) {
+        ids.push_back(nanoid::generate());
+    }
+    // the same messages, added in opposite orders
+    for (size_t i = 0; i < ids.size(); ++i) {
+        sorm->add_message(new ti::Message(ids[i], {}, 0, man[0], woman[0],
+                                          nullptr));
+        auto j = ids.size() - 1 - i;
+        other->add_message(new ti::Message(ids[j], {}, 0, man[1], woman[1],
+                                           nullptr));
+    }
+    auto hash = [](ti::orm::TiOrm *orm, ti::User *u) {
+        auto sync = orm->get_sync(u);
+        auto h = sync.get_messages_hash();
+        return std::string(h->hash, h->len);
+    };
+    ASSERT_EQ(hash(sorm, woman[0]), hash(other, woman[1]));
+    ASSERT_NE(hash(sorm, woman[0]), hash(sorm, man[0]));
+
+    auto extra = nanoid::generate();
+    other->add_message(new ti::Message(extra, {}, 0, man[1], woman[1],
+                                       nullptr));
+    ASSERT_NE(hash(sorm, woman[0]), hash(other, woman[1]));
+    // walk down to where the trees disagree
+    std::string prefix;
+    while (true) {
+        auto mine = sorm->get_sync_children(woman[0], "messages", prefix);
+        auto theirs = other->get_sync_children(woman[1], "messages", prefix);
+        std::vector<int> differ;
+        size_t total = 0;
+        for (int c = 0; c < 16; ++c) {
+            total += theirs[c].count;
+            if (mine[c].hash != theirs[c].hash) {
+                differ.push_back(c);
+            }
+        }
+        ASSERT_EQ(differ.size(), 1);
+        prefix += "0123456789abcdef"[differ[0]];
+        if (theirs[differ[0]].count == 1) {
+            break;
+        }
+        ASSERT_LT(prefix.length(), 64);
+    }
+    ASSERT_EQ(other->get_sync_range(woman[1], "messages", prefix),
+              std::vector<std::string>{extra});
+    ASSERT_EQ(other->get_sync_range(woman[1], "messages", "").size(), 101);
+    ASSERT_THROW(sorm->get_sync_children(woman[0], "messages", "xyz"),
+                 std::runtime_error);
+
+    other->delete_message(other->get_message(extra));
+    ASSERT_EQ(hash(sorm, woman[0]), hash(other, woman[1]));
+    delete other;
+    std::remove(other_file.c_str());
+}
+
+TEST_F(ServerOrmTest, Backfill) {
+    auto tm = new ti::User(testificate_man),
+         tw = new ti::User(testificate_woman);
+    auto g = new ti::Group(group.get_id(), group.get_name(), {tm, tw});
+    sorm->add_entity(tm);
+    sorm->add_entity(tw);
+    sorm->add_entity(g);
+    sorm->add_contact(tm, tw);
+    sorm->add_contact(tm, g);
+    for (auto receiver : std::vector<ti::Entity *>{tw, g, tm}) {
+        sorm->add_message(new ti::Message(nanoid::generate(), {}, 0, tm,
+                                          receiver, nullptr));
+    }
+    auto hashes = [](ti::orm::TiOrm *orm, const std::string &id) {
+        auto sync = orm->get_sync(orm->get_user(id));
+        auto m = sync.get_messages_hash();
+        auto c = sync.get_contacts_hash();
+        return std::string(m->hash, m->len) + std::string(c->hash, c->len);
+    };
+    auto man = hashes(sorm, testificate_man.get_id()),
+         woman = hashes(sorm, testificate_woman.get_id());
+
+    // as a database from before the sync trees looks
+    sorm->exec_sql(R"(DROP TABLE "sync_item";
+DROP TABLE "sync_bucket";
+DROP TABLE "change";)");
+    delete sorm;
+    sorm = new ti::server::ServerOrm(dbfile);
+    sorm->pull();
+    ASSERT_EQ(hashes(sorm, testificate_man.get_id()), man);
+    ASSERT_EQ(hashes(sorm, testificate_woman.get_id()), woman);
+    auto tw2 = sorm->get_user(testificate_woman.get_id());
+    ASSERT_EQ(sorm->get_sync_range(tw2, "messages", "").size(), 2);
+    auto changes = sorm->get_changelog(tw2, "messages", 0);
+    ASSERT_EQ(changes.size(), 2);
+    ASSERT_EQ(sorm->get_changelog_floor(tw2), changes[0].seq);
+    ASSERT_EQ(sorm->get_sync_seq(tw2), changes[1].seq);
+
+    // and only once
+    sorm->pull();
+    ASSERT_EQ(hashes(sorm, testificate_man.get_id()), man);
+}
+
+TEST_F(ServerOrmTest, StatementCache) {
+    sorm->add_entity(new ti::User(testificate_man));
+    auto hits = sorm->get_statement_hits();
+    sorm->add_entity(new ti::User(testificate_woman));
+    ASSERT_GT(sorm->get_statement_hits(), hits);
+
+    // a reused statement must not keep the previous bindings or rows
+    sorm->pull();
+    ASSERT_EQ(sorm->get_users().size(), 2);
+    sorm->pull();
+    ASSERT_EQ(sorm->get_users().size(), 2);
+    ASSERT_NE(sorm->get_user(testificate_woman.get_id()), nullptr);
+}
+
+TEST_F(ServerOrmTest, GroupCommit) {
+    sorm->set_group_commit(5);
+    std::vector<std::thread> writers;
+    for (int i = 0; i < 8; ++i) {
+        writers.emplace_back([&, i] {
+            for (int j = 0; j < 16; ++j) {
+                sorm->write([&] {
+                    auto t = sorm->prepare(
+                        R"(INSERT INTO "contact"(owner_id, contact_id) VALUES (?, ?))");
+                    t->bind_text(0, std::to_string(i));
+                    t->bind_text(1, std::to_string(j));
+                    t->begin();
+                    delete t;
+                });
+            }
+        });
+    }
+    for (auto &w : writers) {
+        w.join();
+    }
+    ASSERT_THROW(sorm->write([&] {
+        sorm->exec_sql(R"(DELETE FROM "contact")");
+        throw std::runtime_error("rolled back");
+    }),
+                 std::runtime_error);
+    sorm->set_group_commit(0);
+
+    auto t = sorm->prepare(R"(SELECT count(*) FROM "contact")");
+    ASSERT_EQ((*t->begin()).get_int(0), 8 * 16);
+    delete t;
+}
+
+TEST_F(ServerOrmTest, ReaderPool) {
+    ASSERT_EQ(sorm->get_reader_count(), SQL_READER_COUNT);
+    ASSERT_EQ(ti::orm::SqlDatabase(":memory:").get_reader_count(), 0);
+    auto count = [&] {
+        auto t = sorm->prepare_read(R"(SELECT count(*) FROM "contact")");
+        auto n = (*t->begin()).get_int(0);
+        delete t;
+        return n;
+    };
+    sorm->transaction([&] {
+        sorm->exec_sql(
+            R"(INSERT INTO "contact"(owner_id, contact_id) VALUES ('a', 'b'))");
+        ASSERT_EQ(count(), 1);
+        // other threads read what was committed, without waiting
+        int n = -1;
+        std::thread([&] { n = count(); }).join();
+        ASSERT_EQ(n, 0);
+    });
+    ASSERT_EQ(count(), 1);
+
+    // with every reader lent out, reads go to the writer
+    std::vector<ti::orm::SqlTransaction *> held;
+    for (int i = 0; i <= SQL_READER_COUNT; ++i) {
+        held.push_back(sorm->prepare_read(R"(SELECT * FROM "contact")"));
+        held.back()->begin();
+    }
+    ASSERT_EQ(count(), 1);
+    for (auto t : held) {
+        delete t;
+    }
+}
+
+TEST_F(ServerOrmTest, Concurrent) {
+    sorm->set_group_commit(2);
+    auto tm = new ti::User(testificate_man),
+         tw = new ti::User(testificate_woman);
+    sorm->add_entity(tm);
+    sorm->add_entity(tw);
+
+    // nanoid::generate() isn't safe to share between threads
+    std::vector<std::string> ids(4 * 32 * 3);
+    std::generate(ids.begin(), ids.end(), [] { return nanoid::generate(); });
+    std::atomic<bool> writing{true};
+    std::vector<std::thread> writers, readers;
+    for (int i = 0; i < 4; ++i) {
+        writers.emplace_back([&, i] {
+            for (int j = 0; j < 32; ++j) {
+                auto id = &ids[(i * 32 + j) * 3];
+                auto u = new ti::User(id[0], "Guy", "", 0);
+                sorm->add_entity(u);
+                sorm->add_contact(tm, u);
+                sorm->add_message(new ti::Message(
+                    id[1], {new ti::TextFrame(id[2], "hi")}, 0, u, tw,
+                    nullptr));
+            }
+        });
+    }
+    for (int i = 0; i < 4; ++i) {
+        readers.emplace_back([&] {
+            while (writing) {
+                for (auto c : sorm->get_contacts(tm)) {
+                    ASSERT_EQ(sorm->get_entity(c->get_id()), c);
+                }
+                for (auto m : sorm->get_messages(tw)) {
+                    ASSERT_TRUE(sorm->is_visible(m, tw));
+                    ASSERT_EQ(sorm->get_frame(m->get_frames()[0]->get_id()),
+                              m->get_frames()[0]);
+                }
+            }
+        });
+    }
+    for (auto &w : writers) {
+        w.join();
+    }
+    writing = false;
+    for (auto &r : readers) {
+        r.join();
+    }
+    sorm->set_group_commit(0);
+
+    ASSERT_EQ(sorm->get_users().size(), 2 + 4 * 32);
+    ASSERT_EQ(sorm->get_contacts(tm).size(), 4 * 32);
+    ASSERT_EQ(sorm->get_messages(tw).size(), 4 * 32);
+    sorm->pull();
+    auto man = sorm->get_user(testificate_man.get_id());
+    ASSERT_EQ(sorm->get_contacts(man).size(), 4 * 32);
+}
+
+TEST_F(ServerOrmTest, LazyCache) {
+    auto tm = new ti::User(testificate_man),
+         tw = new ti::User(testificate_woman);
+    sorm->add_entity(tm);
+    sorm->add_entity(tw);
+    std::vector<std::string> ids, frame_ids;
+    for (int i = 0; i < 64; ++i) {
+        auto msg = new ti::Message(
+            nanoid::generate(),
+            {new ti::TextFrame(nanoid::generate(), std::string(1024, 'x'))},
+            0, tm, tw, nullptr);
+        ids.push_back(msg->get_id());
+        frame_ids.push_back(msg->get_frames()[0]->get_id());
+        sorm->add_message(msg);
+    }
+
+    delete sorm;
+    sorm = new ti::server::ServerOrm(dbfile);
+    sorm->set_cache_limit(16 << 10);
+    sorm->pull();
+    ASSERT_EQ(sorm->get_cache_stats().objects, 0);
+
+    auto woman = sorm->get_user(testificate_woman.get_id());
+    {
+        ti::orm::TiOrm::CacheScope scope(*sorm);
+        auto inbox = sorm->get_messages(woman);
+        ASSERT_EQ(inbox.size(), ids.size());
+        // everything the scope has seen is still there
+        for (int i = 0; i < ids.size(); ++i) {
+            ASSERT_EQ(inbox[i]->get_id(), ids[i]);
+            ASSERT_EQ(inbox[i]->get_frames()[0]->to_string().length(), 1024);
+        }
+        ASSERT_GT(sorm->get_cache_stats().bytes, 16 << 10);
+    }
+    auto stats = sorm->get_cache_stats();
+    ASSERT_LE(stats.bytes, 16 << 10);
+    ASSERT_GT(stats.evictions, 0);
+    ASSERT_EQ(stats.pinned, 0);
+
+    // a page at a time, each let go before the next
+    long long after = 0;
+    std::vector<std::string> paged;
+    while (true) {
+        ti::orm::TiOrm::CacheScope scope(*sorm);
+        auto page = sorm->get_messages(woman, after, 10);
+        if (page.empty()) {
+            break;
+        }
+        ASSERT_LE(page.size(), 10);
+        for (auto msg : page) {
+            paged.push_back(msg->get_id());
+        }
+        ASSERT_LE(sorm->get_cache_stats().bytes, 16 << 10);
+    }
+    ASSERT_EQ(paged, ids);
+
+    {
+        // found through its message, which the scope then holds
+        ASSERT_NE(sorm->get_message(ids[5]), nullptr);
+        ti::orm::TiOrm::CacheScope scope(*sorm);
+        auto frame = sorm->get_frame(frame_ids[5]);
+        ASSERT_NE(frame, nullptr);
+        auto misses = sorm->get_cache_stats().misses;
+        for (int i = 32; i < ids.size(); ++i) {
+            sorm->get_message(ids[i]);
+        }
+        ASSERT_GT(sorm->get_cache_stats().misses, misses);
+        ASSERT_EQ(frame->to_string().length(), 1024);
+        ASSERT_EQ(sorm->get_frame(frame_ids[5]), frame);
+    }
+
+    auto m = sorm->get_message(ids[0]);
+    ASSERT_NE(m, nullptr);
+    ASSERT_EQ(m->get_sender()->get_id(), testificate_man.get_id());
+    ASSERT_EQ(sorm->get_message(ids[0]), m);
+    ASSERT_EQ(sorm->get_message("nonexistent"), nullptr);
+    ASSERT_TRUE(sorm->delete_message(m));
+    ASSERT_EQ(sorm->get_message(ids[0]), nullptr);
+
+    {
+        // a frame cached on its own and again in its message
+        ti::orm::TiOrm::CacheScope scope(*sorm);
+        auto alone = sorm->get_frame(frame_ids[1]);
+        auto msg = sorm->get_message(ids[1]);
+        ASSERT_NE(msg->get_frames()[0], alone);
+        ASSERT_TRUE(sorm->delete_message(msg));
+        // both still there while the scope lasts
+        ASSERT_EQ(msg->get_frames()[0]->to_string(), alone->to_string());
+        ASSERT_EQ(sorm->get_frame(frame_ids[1]), alone);
+        ASSERT_EQ(sorm->get_message(ids[1]), nullptr);
+    }
+    ASSERT_EQ(sorm->get_cache_stats().pinned, 0);
+}
+
+TEST(TokenIndex, Expiry) {
+    ti::User man("l1mITy-T1UBWsGeqLszsL", "Testificate Man", "", 0),
+        woman("Z0RSddx7esE8lmT0fZ1Yc", "Testificate Woman", "", 0);
+    ti::server::TokenIndex index(640);
+    std::vector<ti::server::TokenSession> expired;
+    index.put("a", {man.get_id(), 1, 1000, 1000, ""}, 1000, expired);
+    index.put("b", {woman.get_id(), 2, 1000, 1000, ""}, 1000, expired);
+    ti::server::TokenSession s;
+    // kept alive by using it
+    ASSERT_TRUE(index.touch("a", 1500, s, expired));
+    ASSERT_EQ(s.row_id, 1);
+    ASSERT_EQ(s.last_seen, 1000);
+    ASSERT_FALSE(index.remove(2, &man, s));
+
+    index.expire(1700, expired);
+    ASSERT_EQ(expired.size(), 1);
+    ASSERT_EQ(expired[0].row_id, 2);
+    ASSERT_FALSE(index.touch("b", 1700, s, expired));
+    ASSERT_FALSE(index.remove(2, nullptr, s));
+    ASSERT_EQ(index.size(), 1);
+
+    ASSERT_TRUE(index.touch("a", 2000, s, expired));
+    ASSERT_FALSE(index.touch("a", 2640, s, expired));
+    ASSERT_EQ(expired.size(), 2);
+    ASSERT_EQ(index.size(), 0);
+}
+
+TEST_F(ServerOrmTest, Tokens) {
+    auto man = new ti::User(testificate_man);
+    sorm->add_entity(man);
+    sorm->add_token(man, "token-a", "127.0.0.1");
+    sorm->add_token(man, "token-b", "127.0.0.1");
+    ASSERT_EQ(sorm->check_token("token-a"), man);
+    ASSERT_EQ(sorm->check_token("nonexistent"), nullptr);
+
+    delete sorm;
+    sorm = new ti::server::ServerOrm(dbfile);
+    sorm->pull();
+    ASSERT_EQ(sorm->get_token_count(), 2);
+    man = sorm->get_user(testificate_man.get_id());
+    ASSERT_EQ(sorm->check_token("token-b"), man);
+    ASSERT_FALSE(sorm->invalidate_token("token-a", &testificate_woman));
+    ASSERT_TRUE(sorm->invalidate_token("token-a", man));
+    // rows are numbered in the order they were added
+    ASSERT_TRUE(sorm->invalidate_token(2, man));
+    ASSERT_EQ(sorm->check_token("token-b"), nullptr);
+
+    delete sorm;
+    sorm = new ti::server::ServerOrm(dbfile);
+    sorm->pull();
+    ASSERT_EQ(sorm->get_token_count(), 0);
+}
@@ -1,4 +1,5 @@
 #include <gtest/gtest.h>
+#include <kat.h>
 #include <nanoid.h>
 #include <ti_server.h>
 
@@ -19,4 +20,35 @@ class PasswordTest : public testing::Test {
 TEST_F(PasswordTest, Hashing) {
     ASSERT_TRUE(sorm->check_password(user->get_id(), passcode));
     ASSERT_FALSE(sorm->check_password(user->get_id(), "toor"));
-}
\ No newline at end of file
+}
+
+TEST(PasswordHasher, Admission) {
+    // one slot with room for one more, so a burst is partly turned down
+    ti::server::PasswordHasher hasher(1, 1);
+    std::vector<std::future<std::string>> hashes;
+    for (auto passcode : {"root", "toor", "1234"}) {
+        hashes.push_back(hasher.hash(passcode));
+    }
+    ASSERT_EQ(hashes[0].get().length(), PASSWORD_HASH_BYTES);
+    size_t busy = 0;
+    for (size_t i = 1; i < hashes.size(); ++i) {
+        try {
+            hashes[i].get();
+        } catch (const ti::server::HasherBusy &e) {
+            busy++;
+        }
+    }
+    auto stats = hasher.get_stats();
+    ASSERT_GE(busy, 1);
+    // the one queued may still run out of time behind the first
+    ASSERT_EQ(stats.rejected + stats.expired, busy);
+    ASSERT_EQ(stats.hashed + busy, hashes.size());
+    ASSERT_GT(stats.hash_us, 0);
+}
+
+TEST(Argon2, Kernels) {
+    auto selected = SelectedKernel();
+    ASSERT_NE(GetKernel(selected), nullptr);
+    ASSERT_TRUE(VerifyKernels());
+    ASSERT_EQ(SelectedKernel(), selected);
+}
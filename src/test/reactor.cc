@@ -0,0 +1,229 @@
+#ifdef __linux__
+#include <future>
+#include <gtest/gtest.h>
+#include <helper.h>
+#include <reactor.h>
+
+using namespace ti::server;
+
+namespace {
+using Answer = std::function<void(const Client &, const std::string &)>;
+
+class Echo : public Client {
+    Answer answer;
+
+  public:
+    explicit Echo(Answer answer) : answer(std::move(answer)) {}
+    void on_connect(sockaddr_in addr) override {}
+    void on_message(ti::RequestCode req, char *data, size_t len) override {
+        answer(*this, std::string(data, len));
+    }
+    void on_disconnect() override {}
+};
+
+/**
+ * Answers each request with its body, unless told otherwise. Only
+ * lends itself to a Reactor, it is never started
+ */
+class EchoServer : public Server {
+  public:
+    Answer answer = [](const Client &client, const std::string &body) {
+        client.send(ti::ResponseCode::OK, (void *)body.data(), body.size());
+    };
+    EchoServer() : Server("127.0.0.1", 0, 1, 2) {}
+    Client *on_connect(sockaddr_in addr) override { return new Echo(answer); }
+};
+
+class ReactorTest : public testing::Test {
+  protected:
+    EchoServer server;
+    Executor *executor{};
+    Reactor *reactor{};
+    std::thread loop;
+    sockaddr_in addr{};
+
+    void SetUp() override {
+        SocketFd fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        addr.sin_family = PF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof addr;
+        ASSERT_EQ(bind(fd, (sockaddr *)&addr, len), 0);
+        ASSERT_EQ(listen(fd, SOMAXCONN), 0);
+        getsockname(fd, (sockaddr *)&addr, &len);
+        executor = new Executor(2, 16);
+        reactor = new Reactor(server, *executor, fd);
+        loop = std::thread(&Reactor::run, reactor);
+    }
+    void TearDown() override {
+        reactor->stop();
+        loop.join();
+        // workers first, as Server::start does
+        delete executor;
+        delete reactor;
+    }
+
+    SocketFd connect_client() {
+        SocketFd fd = socket(PF_INET, SOCK_STREAM, 0);
+        timeval timeout{5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        EXPECT_EQ(connect(fd, (sockaddr *)&addr, sizeof addr), 0);
+        return fd;
+    }
+    static std::string frame(const std::string &body, uint32_t tag) {
+        char header[TAGGED_FRAME_HEADER_LEN];
+        header[0] = (char)(ti::RequestCode::SYNC | FRAME_TAGGED);
+        ti::helper::write_len_header(body.length(), header + 1);
+        ti::helper::write_tag_header(tag, header + FRAME_HEADER_LEN);
+        return std::string(header, TAGGED_FRAME_HEADER_LEN) + body;
+    }
+    static bool recv_all(SocketFd fd, char *buf, size_t len) {
+        while (len > 0) {
+            auto n = recv(fd, buf, len, 0);
+            if (n <= 0) {
+                return false;
+            }
+            buf += n;
+            len -= n;
+        }
+        return true;
+    }
+    /**
+     * Read a tagged response
+     * @return false if the connection closed first
+     */
+    static bool read_frame(SocketFd fd, ti::ResponseCode &code,
+                           uint32_t &tag, std::string &body) {
+        char header[TAGGED_FRAME_HEADER_LEN];
+        if (!recv_all(fd, header, TAGGED_FRAME_HEADER_LEN)) {
+            return false;
+        }
+        code = (ti::ResponseCode)((unsigned char)header[0] & ~FRAME_TAGGED);
+        tag = ti::helper::read_tag_header(header + FRAME_HEADER_LEN);
+        body.resize(ti::helper::read_len_header(header + 1));
+        return body.empty() || recv_all(fd, &body[0], body.size());
+    }
+};
+} // namespace
+
+TEST_F(ReactorTest, SplitFrame) {
+    auto fd = connect_client();
+    auto request = frame(std::string(10000, 'x'), 7);
+    // a byte at a time through the header, then the body in two
+    for (size_t i = 0; i < TAGGED_FRAME_HEADER_LEN; ++i) {
+        ASSERT_EQ(send(fd, &request[i], 1, 0), 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    size_t half = TAGGED_FRAME_HEADER_LEN + 5000;
+    send(fd, &request[TAGGED_FRAME_HEADER_LEN],
+         half - TAGGED_FRAME_HEADER_LEN, 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    send(fd, &request[half], request.size() - half, 0);
+
+    ti::ResponseCode code;
+    uint32_t tag;
+    std::string body;
+    ASSERT_TRUE(read_frame(fd, code, tag, body));
+    ASSERT_EQ(code, ti::ResponseCode::OK);
+    ASSERT_EQ(tag, 7);
+    ASSERT_EQ(body, std::string(10000, 'x'));
+    closesocketfd(fd);
+}
+
+TEST_F(ReactorTest, Pipelined) {
+    auto fd = connect_client();
+    std::string requests;
+    for (uint32_t i = 0; i < 64; ++i) {
+        requests += frame(std::to_string(i), i);
+    }
+    ASSERT_EQ(send(fd, requests.data(), requests.size(), 0),
+              (ssize_t)requests.size());
+
+    // answered in order
+    for (uint32_t i = 0; i < 64; ++i) {
+        ti::ResponseCode code;
+        uint32_t tag;
+        std::string body;
+        ASSERT_TRUE(read_frame(fd, code, tag, body));
+        ASSERT_EQ(tag, i);
+        ASSERT_EQ(body, std::to_string(i));
+    }
+    closesocketfd(fd);
+}
+
+TEST_F(ReactorTest, TooLarge) {
+    auto fd = connect_client();
+    char header[TAGGED_FRAME_HEADER_LEN];
+    header[0] = (char)(ti::RequestCode::SYNC | FRAME_TAGGED);
+    ti::helper::write_len_header((size_t)MAX_FRAME_LEN + 1, header + 1);
+    ti::helper::write_tag_header(0, header + FRAME_HEADER_LEN);
+    send(fd, header, TAGGED_FRAME_HEADER_LEN, 0);
+
+    // dropped without an answer, and without waiting for the body
+    char c;
+    ASSERT_EQ(recv(fd, &c, 1, 0), 0);
+    closesocketfd(fd);
+
+    // nor with more of it than the first read takes
+    fd = connect_client();
+    std::string body(4 * CONNECTION_READ_CHUNK, 'x');
+    send(fd, header, TAGGED_FRAME_HEADER_LEN, MSG_NOSIGNAL);
+    send(fd, body.data(), body.size(), MSG_NOSIGNAL);
+    ASSERT_LE(recv(fd, &c, 1, 0), 0);
+    closesocketfd(fd);
+}
+
+TEST_F(ReactorTest, Cork) {
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    server.set_corking(true);
+    server.answer = [=](const Client &client, const std::string &body) {
+        std::string data(std::stoul(body), 'x');
+        client.send(ti::ResponseCode::OK, &data[0], data.size());
+        released.wait();
+    };
+    auto fd = connect_client();
+    auto small = frame("16", 1);
+    send(fd, small.data(), small.size(), 0);
+
+    // held back while the worker is still at it
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    char c;
+    EXPECT_EQ(recv(fd, &c, 1, MSG_DONTWAIT), -1);
+    release.set_value();
+    ti::ResponseCode code;
+    uint32_t tag;
+    std::string body;
+    ASSERT_TRUE(read_frame(fd, code, tag, body));
+    ASSERT_EQ(body.size(), 16);
+    closesocketfd(fd);
+}
+
+TEST_F(ReactorTest, CorkLimit) {
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    server.set_corking(true);
+    server.answer = [=](const Client &client, const std::string &body) {
+        std::string data(std::stoul(body), 'x');
+        client.send(ti::ResponseCode::OK, &data[0], data.size());
+        if (data.size() >= CONNECTION_CORK_LIMIT) {
+            released.wait();
+        }
+    };
+    auto fd = connect_client();
+    auto requests =
+        frame("16", 1) + frame(std::to_string(CONNECTION_CORK_LIMIT), 2);
+    send(fd, requests.data(), requests.size(), 0);
+
+    // out before the worker is done, the held one first
+    ti::ResponseCode code;
+    uint32_t tag;
+    std::string body;
+    bool first = read_frame(fd, code, tag, body);
+    bool second = first && tag == 1 && read_frame(fd, code, tag, body);
+    release.set_value();
+    ASSERT_TRUE(second);
+    ASSERT_EQ(tag, 2);
+    ASSERT_EQ(body.size(), CONNECTION_CORK_LIMIT);
+    closesocketfd(fd);
+}
+#endif
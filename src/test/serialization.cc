@@ -118,4 +118,176 @@ TEST_F(SerializationTest, Message) {
     ASSERT_EQ(smsg_f->get_forward_source(), msg_f.get_forward_source());
     delete smsg_f;
     delete bs;
-}
\ No newline at end of file
+}
+
+TEST_F(SerializationTest, MessageWithFrames) {
+    time_t now;
+    time(&now);
+    Message msg(nanoid::generate(), {tf, frames[0]}, now, user, group, nullptr);
+    auto lookup = [&](StringView id) -> Entity * {
+        for (auto e : entities) {
+            if (id == e->get_id()) {
+                return e;
+            }
+        }
+        return nullptr;
+    };
+
+    for (auto format : {WIRE_TEXT, WIRE_BINARY_V1}) {
+        std::string bs;
+        msg.serialize_with_frames(bs, format);
+        auto smsg = Message::deserialize_with_frames(bs.data(), bs.size(),
+                                                     lookup);
+        ASSERT_EQ(smsg->get_id(), msg.get_id());
+        ASSERT_EQ(smsg->get_frames().size(), 2);
+        ASSERT_EQ(smsg->get_frames()[0]->to_string(), tf->to_string());
+        ASSERT_EQ(smsg->get_frames()[1]->get_id(), frames[0]->get_id());
+        ASSERT_EQ(smsg->get_sender(), user);
+        ASSERT_EQ(smsg->get_receiver(), group);
+        for (auto f : smsg->get_frames()) {
+            delete f;
+        }
+        delete smsg;
+
+        ASSERT_THROW(Message::deserialize_with_frames(
+                         bs.data(), bs.size(),
+                         [](StringView) -> Entity * { return nullptr; }),
+                     std::runtime_error);
+        ASSERT_THROW(Message::deserialize_with_frames(bs.data(),
+                                                      bs.size() - 1, lookup),
+                     std::runtime_error);
+    }
+}
+
+TEST_F(SerializationTest, Binary) {
+    char *bs;
+    size_t text_len = 0, binary_len = 0;
+    auto measure = [&](const BinarySerializable &o) {
+        char *buf;
+        text_len += o.serialize(&buf);
+        delete buf;
+        return o.serialize(&buf, WIRE_BINARY_V1);
+    };
+
+    auto len = user->serialize(&bs, WIRE_BINARY_V1);
+    auto su = dynamic_cast<User *>(Entity::deserialize(bs, len, nullptr));
+    ASSERT_NE(su, nullptr);
+    ASSERT_EQ(su->get_id(), user->get_id());
+    ASSERT_EQ(su->get_name(), user->get_name());
+    ASSERT_EQ(su->get_bio(), user->get_bio());
+    ASSERT_EQ(su->get_registration_time(), user->get_registration_time());
+    delete su;
+    delete bs;
+
+    len = group->serialize(&bs, WIRE_BINARY_V1);
+    auto sg = Group::deserialize(bs, len, [&](auto id) {
+        return *ti::helper::get_entity_in(entities.begin(), entities.end(), id);
+    });
+    ASSERT_EQ(sg->get_id(), group->get_id());
+    ASSERT_EQ(sg->get_members(), vector<Entity *>{user});
+    delete sg;
+    delete bs;
+
+    len = tf->serialize(&bs, WIRE_BINARY_V1);
+    auto stf = TextFrame::deserialize(bs, len);
+    ASSERT_EQ(stf->get_id(), tf->get_id());
+    ASSERT_EQ(stf->to_string(), tf->to_string());
+    delete stf;
+    // cut anywhere, it throws rather than reading past the end
+    for (size_t cut = 1; cut < len; ++cut) {
+        ASSERT_THROW(TextFrame::deserialize(bs, cut), std::runtime_error);
+    }
+    delete bs;
+
+    Message msg(nanoid::generate(), {tf}, 1700000000, user, group, user);
+    len = msg.serialize(&bs, WIRE_BINARY_V1);
+    auto smsg = Message::deserialize(bs, len, frames, entities);
+    ASSERT_EQ(smsg->get_id(), msg.get_id());
+    ASSERT_EQ(smsg->get_frames(), msg.get_frames());
+    ASSERT_EQ(smsg->get_sender(), user);
+    ASSERT_EQ(smsg->get_receiver(), group);
+    ASSERT_EQ(smsg->get_forward_source(), user);
+    ASSERT_EQ(smsg->get_time(), msg.get_time());
+    delete smsg;
+    delete bs;
+
+    for (auto e : entities) {
+        binary_len += measure(*e);
+    }
+    for (auto f : frames) {
+        binary_len += measure(*f);
+    }
+    std::cout << "text " << text_len << " bytes, binary " << binary_len
+              << " bytes" << std::endl;
+    ASSERT_LT(binary_len, text_len);
+}
+
+TEST(Serialization, BinaryFields) {
+    std::string out;
+    for (uint64_t n : {0ull, 127ull, 128ull, 300ull, ~0ull}) {
+        out.clear();
+        ti::helper::append_varint(out, n);
+        size_t ptr = 0;
+        ASSERT_EQ(ti::helper::read_varint(out.data(), out.size(), ptr), n);
+        ASSERT_EQ(ptr, out.size());
+    }
+
+    // NanoIDs are packed, anything else is kept as it is
+    std::string id;
+    for (const std::string &in :
+         {nanoid::generate(), std::string("_-_-_-_-_-_-_-_-_-_-_"),
+          std::string("ZZZZZZZZZZZZZZZZZZZZZ"), std::string(""),
+          std::string("not a nanoid"), std::string(21, '!')}) {
+        out.clear();
+        ti::helper::append_id(out, in);
+        if (in.length() == NANOID_LEN && in[0] != '!') {
+            ASSERT_EQ(out.size(), 16);
+        }
+        size_t ptr = 0;
+        ti::helper::read_id(out.data(), out.size(), ptr, id);
+        ASSERT_EQ(id, in);
+        ASSERT_EQ(ptr, out.size());
+    }
+    ASSERT_THROW(ti::helper::append_id(out, std::string(200, 'a')),
+                 std::runtime_error);
+}
+
+TEST_F(SerializationTest, Views) {
+    Message msg(nanoid::generate(), {tf, frames[0]}, 1700000000, user, group,
+                nullptr);
+    for (auto format : {WIRE_TEXT, WIRE_BINARY_V1}) {
+        char *bs;
+        auto len = user->serialize(&bs, format);
+        UserView uv(bs, len);
+        ASSERT_EQ(uv.id.str(), user->get_id());
+        ASSERT_TRUE(uv.name == user->get_name());
+        // read in place
+        ASSERT_GE(uv.bio.data, bs);
+        ASSERT_LE(uv.bio.data + uv.bio.len, bs + len);
+        ASSERT_EQ(uv.registration_time, user->get_registration_time());
+        delete bs;
+
+        len = tf->serialize(&bs, format);
+        TextFrameView fv(bs, len);
+        auto copy = fv.id;
+        ASSERT_EQ(copy.str(), tf->get_id());
+        ASSERT_TRUE(fv.content == tf->to_string());
+        delete bs;
+
+        len = msg.serialize(&bs, format);
+        MessageView mv(bs, len);
+        ASSERT_EQ(mv.id.str(), msg.get_id());
+        ASSERT_EQ(mv.frame_count, 2);
+        std::vector<std::string> fids;
+        mv.for_each_frame([&](StringView id) { fids.push_back(id.str()); });
+        ASSERT_EQ(fids, (vector<string>{tf->get_id(), frames[0]->get_id()}));
+        ASSERT_EQ(mv.sender.str(), user->get_id());
+        ASSERT_EQ(mv.receiver.str(), group->get_id());
+        ASSERT_EQ(mv.forward_source.get().len, 0);
+        ASSERT_EQ(mv.time, msg.get_time());
+        ASSERT_THROW(mv.materialize([](StringView) { return nullptr; },
+                                    [](StringView) { return nullptr; }),
+                     std::runtime_error);
+        delete bs;
+    }
+}
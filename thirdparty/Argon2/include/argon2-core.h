@@ -229,6 +229,51 @@ void Finalize(const Argon2_Context *context, Argon2_instance_t* instance);
  */
 void FillBlock(const block* prev_block, const block* ref_block, block* next_block, const uint64_t* Sbox);
 
+/*
+ * Implementations of the compression function, from the portable one to the widest vectors
+ */
+enum Argon2_kernel {
+    ARGON2_KERNEL_REF = 0,
+    ARGON2_KERNEL_SSE2,
+    ARGON2_KERNEL_AVX2,
+    ARGON2_KERNEL_AVX512,
+    ARGON2_KERNEL_COUNT
+};
+
+/*
+ * Fills a new memory block the way FillBlock does without an Sbox
+ */
+typedef void (*FillBlockKernel)(const block* prev_block, const block* ref_block, block* next_block);
+
+/*
+ * Portable kernel, the one the others are checked against
+ */
+void FillBlockRef(const block* prev_block, const block* ref_block, block* next_block);
+
+/*
+ * Looks up a kernel
+ * @return NULL if this build or this CPU can't run it
+ */
+FillBlockKernel GetKernel(Argon2_kernel kernel);
+
+/*
+ * Makes FillBlock use @a kernel from now on. Until then, it uses the widest one the CPU supports
+ * @return false if @a kernel can't run here
+ */
+bool SelectKernel(Argon2_kernel kernel);
+
+/*
+ * @return the kernel FillBlock uses
+ */
+Argon2_kernel SelectedKernel();
+
+/*
+ * @return the function of the kernel FillBlock uses
+ */
+FillBlockKernel SelectedKernelFn();
+
+const char* KernelName(Argon2_kernel kernel);
+
 /*
  * Function that fills the segment using previous segments also from other threads
  * @param instance Pointer to the current instance
@@ -238,7 +283,8 @@ void FillBlock(const block* prev_block, const block* ref_block, block* next_bloc
 void FillSegment(const Argon2_instance_t* instance, Argon2_position_t position);
 
 /*
- * Function that fills the entire memory t_cost times based on the first two blocks in each lane
+ * Function that fills the entire memory t_cost times based on the first two blocks in each lane.
+ * The segments of a slice are filled in parallel on threads kept for the whole process
  * @param instance Pointer to the current instance
  */
 void FillMemoryBlocks(const Argon2_instance_t* instance);
@@ -11,6 +11,16 @@
 #include <x86intrin.h>
 #endif
 
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+static BLAKE2_INLINE __m128i fBlaMka(__m128i x, __m128i y) {
+    const __m128i z = _mm_mul_epu32(x, y);
+    return _mm_add_epi64(_mm_add_epi64(x, y), _mm_add_epi64(z, z));
+}
+
 #if !defined(__XOP__)
 #if defined(__SSSE3__)
 #define r16                                                                    \
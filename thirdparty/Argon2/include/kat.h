@@ -48,4 +48,20 @@ void InternalKat(const Argon2_instance_t* instance, uint32_t pass);
  */
 void GenerateTestVectors(const std::string &type);
 
+/*
+ * Hashes fixed test vectors of every type with every fill-block kernel the CPU supports,
+ * and compares the tags with those of the reference kernel. The kernel selected before is kept
+ * @return false if any kernel got a tag wrong, which is printed to stderr
+ */
+bool VerifyKernels();
+
+/*
+ * Verifies the kernels, then times Argon2i with each of them and prints one line per kernel
+ * @param t_cost number of passes
+ * @param m_cost memory in KBytes
+ * @param lanes lanes, also hashed on as many threads
+ * @return false if a kernel failed
+ */
+bool BenchmarkKernels(uint32_t t_cost, uint32_t m_cost, uint32_t lanes);
+
 #endif
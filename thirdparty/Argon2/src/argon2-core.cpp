@@ -11,6 +11,11 @@
 
 
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <vector>
 #include <thread>
 #include <cstring>
@@ -147,8 +152,105 @@ uint32_t IndexAlpha(const Argon2_instance_t* instance, const Argon2_position_t*
     return absolute_position;
 }
 
+/*
+ * Threads filling the segments of other lanes, started once and kept for the
+ * whole process. The thread asking for a slice fills segments of it as well,
+ * so a single lane never leaves the calling thread
+ */
+class LanePool {
+    struct Slice {
+        const std::function<void(uint32_t)>* fill;
+        uint32_t lanes, next, pending, helpers;
+    };
+    std::mutex mtx;
+    std::condition_variable wake, finished;
+    std::deque<Slice*> slices;
+    std::vector<std::thread> workers;
+    bool running;
+
+    // Fill segments of @a slice until none is left. Call with @a lock held
+    void Work(Slice* slice, std::unique_lock<std::mutex>& lock) {
+        while (slice->next < slice->lanes) {
+            uint32_t lane = slice->next++;
+            lock.unlock();
+            (*slice->fill)(lane);
+            lock.lock();
+            if (--slice->pending == 0) {
+                // the slice is gone as soon as its owner sees this
+                finished.notify_all();
+                return;
+            }
+        }
+    }
+
+    void Help() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            wake.wait(lock, [&] { return !slices.empty() || !running; });
+            if (slices.empty()) {
+                return;
+            }
+            Slice* slice = slices.front();
+            if (slice->helpers == 0 || slice->next == slice->lanes) {
+                slices.pop_front();
+                continue;
+            }
+            slice->helpers--;
+            Work(slice, lock);
+        }
+    }
+
+public:
+    LanePool() : running(true) {
+    }
+
+    ~LanePool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            running = false;
+        }
+        wake.notify_all();
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+
+    static LanePool& Get() {
+        static LanePool pool;
+        return pool;
+    }
+
+    /*
+     * Calls @a fill for every lane, on up to @a threads threads at once, and returns when all are done
+     */
+    void Run(uint32_t lanes, uint32_t threads, const std::function<void(uint32_t)>& fill) {
+        uint32_t helpers = std::min(lanes, threads);
+        if (helpers <= 1) {
+            for (uint32_t l = 0; l < lanes; ++l) {
+                fill(l);
+            }
+            return;
+        }
+        helpers--;
+        Slice slice{&fill, lanes, 0, lanes, helpers};
+        std::unique_lock<std::mutex> lock(mtx);
+        // more threads than cores would only take turns
+        size_t wanted = std::min<size_t>(helpers, std::max(std::thread::hardware_concurrency(), 1u) - 1);
+        while (workers.size() < wanted) {
+            workers.emplace_back([this] { Help(); });
+        }
+        slices.push_back(&slice);
+        wake.notify_all();
+        Work(&slice, lock);
+        finished.wait(lock, [&] { return slice.pending == 0; });
+        auto it = std::find(slices.begin(), slices.end(), &slice);
+        if (it != slices.end()) {
+            slices.erase(it);
+        }
+    }
+};
+
 void FillMemoryBlocks(Argon2_instance_t* instance) {
-    std::vector<std::thread> Threads;
     if (instance == NULL) {
         return;
     }
@@ -157,21 +259,9 @@ void FillMemoryBlocks(Argon2_instance_t* instance) {
             GenerateSbox(instance);
         }
         for (uint8_t s = 0; s < ARGON2_SYNC_POINTS; ++s) {
-            for (uint32_t l = 0; l < instance->lanes; ++l) {
-                Threads.push_back(std::thread(FillSegment, instance, Argon2_position_t(r, l, s, 0)));
-                if(instance->threads <= Threads.size()){ //have to join extra threads
-                    for (auto& t : Threads) {
-                        t.join();
-                    }
-                    Threads.clear();
-                }
-            }
-            if(!Threads.empty()){
-                for (auto& t : Threads) {
-                    t.join();
-                }
-                Threads.clear();
-            }
+            LanePool::Get().Run(instance->lanes, instance->threads, [&](uint32_t l) {
+                FillSegment(instance, Argon2_position_t(r, l, s, 0));
+            });
         }
         if(instance->internal_print){
             InternalKat(instance, r); // Print all memory blocks
@@ -382,7 +472,7 @@ int Initialize(Argon2_instance_t* instance, Argon2_Context* context) {
         if (ARGON2_OK != result) {
             return result;
         }
-        memcpy(&(instance->memory), p, sizeof(instance->memory));
+        instance->memory = (block *) p;
     } else {
         result = AllocateMemory(&(instance->memory), instance->memory_blocks);
     }
@@ -0,0 +1,266 @@
+/*
+ * Argon2 source code package
+ *
+ * Vectorized compression function, and the choice between the kernels
+ * at run time.
+ *
+ * This work is licensed under a Creative Commons CC0 1.0 License/Waiver.
+ *
+ * You should have received a copy of the CC0 Public Domain Dedication along with
+ * this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+ */
+
+
+#include <atomic>
+#include <stdint.h>
+
+#include "argon2-core.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define ARGON2_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(ARGON2_X86_KERNELS) && defined(__SSE2__)
+#include "blamka-round-opt.h"
+
+/* 64 registers of two words, the layout of the reference implementation */
+static void FillBlockSSE2(const block* prev_block, const block* ref_block, block* next_block) {
+    __m128i state[64], block_XY[64];
+    for (unsigned i = 0; i < 64; ++i) {
+        state[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*) prev_block->v + i),
+                _mm_loadu_si128((const __m128i*) ref_block->v + i));
+        block_XY[i] = state[i];
+    }
+    for (unsigned i = 0; i < 8; ++i) {
+        BLAKE2_ROUND(state[8 * i + 0], state[8 * i + 1], state[8 * i + 2], state[8 * i + 3],
+                state[8 * i + 4], state[8 * i + 5], state[8 * i + 6], state[8 * i + 7]);
+    }
+    for (unsigned i = 0; i < 8; ++i) {
+        BLAKE2_ROUND(state[i], state[i + 8], state[i + 16], state[i + 24],
+                state[i + 32], state[i + 40], state[i + 48], state[i + 56]);
+    }
+    for (unsigned i = 0; i < 64; ++i) {
+        _mm_storeu_si128((__m128i*) next_block->v + i, _mm_xor_si128(state[i], block_XY[i]));
+    }
+}
+#endif
+
+#if defined(ARGON2_X86_KERNELS)
+#define ARGON2_AVX2 __attribute__((target("avx2")))
+#define ARGON2_AVX512 __attribute__((target("avx512f")))
+
+/*
+ * Both wide kernels hold four words of a BLAKE2 round in each quarter of
+ * a vector: A = (v0..v3), B = (v4..v7), C = (v8..v11), D = (v12..v15).
+ * The columns are then one G on A, B, C, D. The diagonals are another,
+ * after rotating B, C and D left by one, two and three words
+ */
+#define ARGON2_G(MULADD, XOR, ROR, A, B, C, D)                                 \
+    do {                                                                       \
+        A = MULADD(A, B);                                                      \
+        D = ROR(XOR(D, A), 32);                                                \
+        C = MULADD(C, D);                                                      \
+        B = ROR(XOR(B, C), 24);                                                \
+        A = MULADD(A, B);                                                      \
+        D = ROR(XOR(D, A), 16);                                                \
+        C = MULADD(C, D);                                                      \
+        B = ROR(XOR(B, C), 63);                                                \
+    } while ((void)0, 0)
+
+#define ARGON2_ROUND(MULADD, XOR, ROR, PERMUTE, A, B, C, D)                    \
+    do {                                                                       \
+        ARGON2_G(MULADD, XOR, ROR, A, B, C, D);                                \
+        B = PERMUTE(B, _MM_SHUFFLE(0, 3, 2, 1));                               \
+        C = PERMUTE(C, _MM_SHUFFLE(1, 0, 3, 2));                               \
+        D = PERMUTE(D, _MM_SHUFFLE(2, 1, 0, 3));                               \
+        ARGON2_G(MULADD, XOR, ROR, A, B, C, D);                                \
+        B = PERMUTE(B, _MM_SHUFFLE(2, 1, 0, 3));                               \
+        C = PERMUTE(C, _MM_SHUFFLE(1, 0, 3, 2));                               \
+        D = PERMUTE(D, _MM_SHUFFLE(0, 3, 2, 1));                               \
+    } while ((void)0, 0)
+
+static inline ARGON2_AVX2 __m256i MulAddAVX2(__m256i x, __m256i y) {
+    const __m256i z = _mm256_mul_epu32(x, y);
+    return _mm256_add_epi64(_mm256_add_epi64(x, y), _mm256_add_epi64(z, z));
+}
+
+static inline ARGON2_AVX2 __m256i RorAVX2(__m256i x, int n) {
+    switch (n) {
+        case 32:
+            return _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));
+        case 24:
+            return _mm256_shuffle_epi8(x, _mm256_setr_epi8(
+                    3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+                    3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10));
+        case 16:
+            return _mm256_shuffle_epi8(x, _mm256_setr_epi8(
+                    2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+                    2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9));
+        default:
+            // by 63, which is left by one
+            return _mm256_xor_si256(_mm256_srli_epi64(x, 63), _mm256_add_epi64(x, x));
+    }
+}
+
+#define ARGON2_ROUND_AVX2(A, B, C, D)                                          \
+    ARGON2_ROUND(MulAddAVX2, _mm256_xor_si256, RorAVX2,                        \
+            _mm256_permute4x64_epi64, A, B, C, D)
+
+/* 32 registers of four consecutive words */
+static ARGON2_AVX2 void FillBlockAVX2(const block* prev_block, const block* ref_block, block* next_block) {
+    __m256i state[32], block_XY[32];
+    for (unsigned i = 0; i < 32; ++i) {
+        state[i] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*) prev_block->v + i),
+                _mm256_loadu_si256((const __m256i*) ref_block->v + i));
+        block_XY[i] = state[i];
+    }
+    // a row of 16 words is four registers
+    for (unsigned i = 0; i < 8; ++i) {
+        ARGON2_ROUND_AVX2(state[4 * i], state[4 * i + 1], state[4 * i + 2], state[4 * i + 3]);
+    }
+    // words 2i, 2i+1, 2i+16, 2i+17 and so on are halves of registers 16 words apart
+    for (unsigned i = 0; i < 4; ++i) {
+        __m256i v[8];
+        for (unsigned j = 0; j < 4; ++j) {
+            v[j] = _mm256_permute2x128_si256(state[i + 8 * j], state[i + 8 * j + 4], 0x20);
+            v[j + 4] = _mm256_permute2x128_si256(state[i + 8 * j], state[i + 8 * j + 4], 0x31);
+        }
+        ARGON2_ROUND_AVX2(v[0], v[1], v[2], v[3]);
+        ARGON2_ROUND_AVX2(v[4], v[5], v[6], v[7]);
+        for (unsigned j = 0; j < 4; ++j) {
+            state[i + 8 * j] = _mm256_permute2x128_si256(v[j], v[j + 4], 0x20);
+            state[i + 8 * j + 4] = _mm256_permute2x128_si256(v[j], v[j + 4], 0x31);
+        }
+    }
+    for (unsigned i = 0; i < 32; ++i) {
+        _mm256_storeu_si256((__m256i*) next_block->v + i, _mm256_xor_si256(state[i], block_XY[i]));
+    }
+}
+
+static inline ARGON2_AVX512 __m512i MulAddAVX512(__m512i x, __m512i y) {
+    const __m512i z = _mm512_mul_epu32(x, y);
+    return _mm512_add_epi64(_mm512_add_epi64(x, y), _mm512_add_epi64(z, z));
+}
+
+#define ARGON2_ROUND_AVX512(A, B, C, D)                                        \
+    ARGON2_ROUND(MulAddAVX512, _mm512_xor_si512, _mm512_ror_epi64,             \
+            _mm512_permutex_epi64, A, B, C, D)
+
+/* 16 registers of eight consecutive words, each running two rounds at once */
+static ARGON2_AVX512 void FillBlockAVX512(const block* prev_block, const block* ref_block, block* next_block) {
+    __m512i state[16], block_XY[16];
+    for (unsigned i = 0; i < 16; ++i) {
+        state[i] = _mm512_xor_si512(_mm512_loadu_si512((const __m512i*) prev_block->v + i),
+                _mm512_loadu_si512((const __m512i*) ref_block->v + i));
+        block_XY[i] = state[i];
+    }
+    // two rows, each made of two registers
+    for (unsigned i = 0; i < 16; i += 4) {
+        __m512i v[4];
+        for (unsigned j = 0; j < 2; ++j) {
+            v[2 * j] = _mm512_shuffle_i64x2(state[i + j], state[i + j + 2], _MM_SHUFFLE(1, 0, 1, 0));
+            v[2 * j + 1] = _mm512_shuffle_i64x2(state[i + j], state[i + j + 2], _MM_SHUFFLE(3, 2, 3, 2));
+        }
+        ARGON2_ROUND_AVX512(v[0], v[1], v[2], v[3]);
+        for (unsigned j = 0; j < 2; ++j) {
+            state[i + j] = _mm512_shuffle_i64x2(v[2 * j], v[2 * j + 1], _MM_SHUFFLE(1, 0, 1, 0));
+            state[i + j + 2] = _mm512_shuffle_i64x2(v[2 * j], v[2 * j + 1], _MM_SHUFFLE(3, 2, 3, 2));
+        }
+    }
+    // four pairs of columns, gathered from registers 16 words apart
+    const __m512i gather_lo = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+    const __m512i gather_hi = _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+    const __m512i scatter_lo = _mm512_setr_epi64(0, 1, 4, 5, 8, 9, 12, 13);
+    const __m512i scatter_hi = _mm512_setr_epi64(2, 3, 6, 7, 10, 11, 14, 15);
+    for (unsigned i = 0; i < 2; ++i) {
+        __m512i v[8];
+        for (unsigned j = 0; j < 4; ++j) {
+            v[j] = _mm512_permutex2var_epi64(state[i + 4 * j], gather_lo, state[i + 4 * j + 2]);
+            v[j + 4] = _mm512_permutex2var_epi64(state[i + 4 * j], gather_hi, state[i + 4 * j + 2]);
+        }
+        ARGON2_ROUND_AVX512(v[0], v[1], v[2], v[3]);
+        ARGON2_ROUND_AVX512(v[4], v[5], v[6], v[7]);
+        for (unsigned j = 0; j < 4; ++j) {
+            state[i + 4 * j] = _mm512_permutex2var_epi64(v[j], scatter_lo, v[j + 4]);
+            state[i + 4 * j + 2] = _mm512_permutex2var_epi64(v[j], scatter_hi, v[j + 4]);
+        }
+    }
+    for (unsigned i = 0; i < 16; ++i) {
+        _mm512_storeu_si512((__m512i*) next_block->v + i, _mm512_xor_si512(state[i], block_XY[i]));
+    }
+}
+#endif
+
+FillBlockKernel GetKernel(Argon2_kernel kernel) {
+    switch (kernel) {
+        case ARGON2_KERNEL_REF:
+            return FillBlockRef;
+#if defined(ARGON2_X86_KERNELS) && defined(__SSE2__)
+        case ARGON2_KERNEL_SSE2:
+            return FillBlockSSE2;
+#endif
+#if defined(ARGON2_X86_KERNELS)
+        case ARGON2_KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2") ? FillBlockAVX2 : NULL;
+        case ARGON2_KERNEL_AVX512:
+            return __builtin_cpu_supports("avx512f") ? FillBlockAVX512 : NULL;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+static Argon2_kernel WidestKernel() {
+    int k = ARGON2_KERNEL_COUNT - 1;
+    while (GetKernel((Argon2_kernel) k) == NULL) {
+        --k;
+    }
+    return (Argon2_kernel) k;
+}
+
+static std::atomic<int> selected_kernel(-1);
+static std::atomic<FillBlockKernel> selected_fn(NULL);
+
+bool SelectKernel(Argon2_kernel kernel) {
+    FillBlockKernel fn = GetKernel(kernel);
+    if (fn == NULL) {
+        return false;
+    }
+    selected_fn = fn;
+    selected_kernel = kernel;
+    return true;
+}
+
+Argon2_kernel SelectedKernel() {
+    int k = selected_kernel;
+    if (k < 0) {
+        SelectKernel(WidestKernel());
+        k = selected_kernel;
+    }
+    return (Argon2_kernel) k;
+}
+
+FillBlockKernel SelectedKernelFn() {
+    FillBlockKernel fn = selected_fn;
+    if (fn == NULL) {
+        SelectedKernel();
+        fn = selected_fn;
+    }
+    return fn;
+}
+
+const char* KernelName(Argon2_kernel kernel) {
+    switch (kernel) {
+        case ARGON2_KERNEL_REF:
+            return "ref";
+        case ARGON2_KERNEL_SSE2:
+            return "sse2";
+        case ARGON2_KERNEL_AVX2:
+            return "avx2";
+        case ARGON2_KERNEL_AVX512:
+            return "avx512";
+        default:
+            return "unknown";
+    }
+}
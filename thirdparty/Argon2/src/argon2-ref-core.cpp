@@ -26,7 +26,7 @@
 const char* ARGON2_KAT_FILENAME = "kat-argon2-ref.log";
 
 
-void FillBlock(const block* prev_block, const block* ref_block, block* next_block, const uint64_t* Sbox) {
+static void FillBlockPortable(const block* prev_block, const block* ref_block, block* next_block, const uint64_t* Sbox) {
     block blockR = *prev_block ^ *ref_block;
     block block_tmp = blockR;
 
@@ -65,6 +65,19 @@ void FillBlock(const block* prev_block, const block* ref_block, block* next_bloc
     next_block->v[ARGON2_WORDS_IN_BLOCK - 1] += x;
 }
 
+void FillBlockRef(const block* prev_block, const block* ref_block, block* next_block) {
+    FillBlockPortable(prev_block, ref_block, next_block, NULL);
+}
+
+void FillBlock(const block* prev_block, const block* ref_block, block* next_block, const uint64_t* Sbox) {
+    if (Sbox != NULL) {
+        // the vector kernels only cover the compression function itself
+        FillBlockPortable(prev_block, ref_block, next_block, Sbox);
+    } else {
+        SelectedKernelFn()(prev_block, ref_block, next_block);
+    }
+}
+
 void GenerateAddresses(const Argon2_instance_t* instance, const Argon2_position_t* position, uint64_t* pseudo_rands) {
     block zero_block(0), input_block(0), address_block(0);
     if (instance != NULL && position != NULL) {
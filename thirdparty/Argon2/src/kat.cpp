@@ -11,10 +11,13 @@
 
 
 
+#include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <inttypes.h>
 
 #include <string>
+#include <vector>
 
 #include "argon2.h"
 #include "argon2-core.h"
@@ -203,3 +206,104 @@ void GenerateTestVectors(const std::string &type) {
     }
 }
 
+
+/*Tags of the fixed test vector inputs, as the reference kernel hashes them
+ * with 3 passes
+ */
+struct KernelVector {
+    int (*hash)(Argon2_Context*);
+    const char* name;
+    uint32_t lanes, m_cost;
+    const char* tag;
+};
+
+static const KernelVector kernel_vectors[] = {
+    {Argon2d, "Argon2d", 4, 16, "57b0613bfdd4131a0c348834c6729c2c7229921e6bba37665d978c4fe7175ed2"},
+    {Argon2d, "Argon2d", 1, 256, "39f55d549ada7dff82154b8f3b0aa42eefd86d8c4dbfba5552da627bb53287cd"},
+    {Argon2i, "Argon2i", 4, 16, "913ba437685b613cf12b944679534037ac46cfa88a02f6c7ba280e08894019f2"},
+    {Argon2i, "Argon2i", 1, 256, "a9f96a856fd1710a3492e53b9f0a4c61e91708e2cb59a06b791a2eba1784581d"},
+    {Argon2id, "Argon2id", 4, 16, "f87c9596bdbf750bfb353a8970e5441a70243eb49030dfe274d9ad4e370e389b"},
+    {Argon2id, "Argon2id", 1, 256, "a7b7c3ca459dd16d95b8b1fa343395836d32848726aeba4a17f61a3f4ab479b7"},
+    {Argon2ds, "Argon2ds", 4, 16, "fe5a9ec7d78f5fbbfa6cdc5f50c7b926fc2c6e9437aad3e3601ebbce58922c72"},
+    {Argon2ds, "Argon2ds", 1, 256, "7b59a13966cc77e085d3aeb5411ede5b29c20c8601e8a60dacb3434c7082794c"},
+};
+
+static std::string HashKernelVector(const KernelVector& vector) {
+    uint8_t out[32];
+    uint8_t pwd[32];
+    uint8_t salt[16];
+    uint8_t secret[8];
+    uint8_t ad[12];
+    memset(pwd, 1, sizeof(pwd));
+    memset(salt, 2, sizeof(salt));
+    memset(secret, 3, sizeof(secret));
+    memset(ad, 4, sizeof(ad));
+
+    Argon2_Context context(out, sizeof(out), pwd, sizeof(pwd), salt, sizeof(salt),
+            secret, sizeof(secret), ad, sizeof(ad), 3, vector.m_cost, vector.lanes, vector.lanes,
+            NULL, NULL, false, false, false, false);
+    if (vector.hash(&context) != ARGON2_OK) {
+        return std::string();
+    }
+    char hex[2 * sizeof(out) + 1];
+    for (unsigned i = 0; i < sizeof(out); ++i) {
+        snprintf(hex + 2 * i, 3, "%2.2x", out[i]);
+    }
+    return std::string(hex);
+}
+
+/*Hashes the test vectors with every kernel this CPU runs
+ */
+bool VerifyKernels() {
+    Argon2_kernel previous = SelectedKernel();
+    bool ok = true;
+    for (int k = 0; k < ARGON2_KERNEL_COUNT; ++k) {
+        if (!SelectKernel((Argon2_kernel) k)) {
+            continue;
+        }
+        for (const KernelVector& vector : kernel_vectors) {
+            if (HashKernelVector(vector) != vector.tag) {
+                fprintf(stderr, "Kernel %s: wrong tag for %s, %u lanes, %u KBytes\n",
+                        KernelName((Argon2_kernel) k), vector.name, vector.lanes, vector.m_cost);
+                ok = false;
+            }
+        }
+    }
+    SelectKernel(previous);
+    return ok;
+}
+
+/*Times Argon2i with every kernel this CPU runs
+ */
+bool BenchmarkKernels(uint32_t t_cost, uint32_t m_cost, uint32_t lanes) {
+    if (!VerifyKernels()) {
+        return false;
+    }
+    Argon2_kernel previous = SelectedKernel();
+    std::vector<uint8_t> pwd(32, 1), salt(16, 2);
+    uint8_t out[32];
+    double ref_ms = 0;
+    for (int k = 0; k < ARGON2_KERNEL_COUNT; ++k) {
+        if (!SelectKernel((Argon2_kernel) k)) {
+            printf("%-8s unsupported\n", KernelName((Argon2_kernel) k));
+            continue;
+        }
+        Argon2_Context context(out, sizeof(out), pwd.data(), (uint32_t) pwd.size(), salt.data(), (uint32_t) salt.size(),
+                NULL, 0, NULL, 0, t_cost, m_cost, lanes, lanes,
+                NULL, NULL, false, false, false, false);
+        auto start = std::chrono::steady_clock::now();
+        int rc = Argon2i(&context);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (rc != ARGON2_OK) {
+            fprintf(stderr, "Kernel %s: %s\n", KernelName((Argon2_kernel) k), ErrorMessage(rc));
+            SelectKernel(previous);
+            return false;
+        }
+        if (k == ARGON2_KERNEL_REF) {
+            ref_ms = ms;
+        }
+        printf("%-8s %10.2f ms %6.2fx\n", KernelName((Argon2_kernel) k), ms, ref_ms / ms);
+    }
+    SelectKernel(previous);
+    return true;
+}